@@ -49,6 +49,14 @@ main (int argc, char *argv[])
     bool verbose;            /* verbose flag for printing messages */
     bool use_cirrus;         /* should we use Cirrus during determination? */
     bool use_thermal;        /* should we use Thermal during determination? */
+    int input_mode;          /* how the input bands are accessed */
+    int fill_engine;         /* how the local minima are filled */
+    int fill_scale;          /* block size of the approximate fill */
+    bool fill_compare;       /* compare the approximate fill to the exact? */
+    int height_stride;       /* stride of the coarse cloud height search */
+    bool height_compare;     /* compare the coarse height search to the
+                                exhaustive one? */
+    int band_set;            /* bands used during determination */
 
     Input_t *input = NULL;    /* input data and meta data */
     Output_t *output = NULL;  /* output structure and metadata */
@@ -76,7 +84,9 @@ main (int argc, char *argv[])
     /* Read the command-line arguments, including the name of the input
        Landsat TOA reflectance product and the DEM */
     status = get_args(argc, argv, &xml_name, &cloud_prob, &cldpix,
-                      &sdpix, &use_cirrus, &use_thermal, &verbose);
+                      &sdpix, &use_cirrus, &use_thermal, &input_mode,
+                      &fill_engine, &fill_scale, &fill_compare,
+                      &height_stride, &height_compare, &verbose);
     if (status != SUCCESS)
     {
         RETURN_ERROR("calling get_args", FUNC_NAME, EXIT_FAILURE);
@@ -101,8 +111,15 @@ main (int argc, char *argv[])
         RETURN_ERROR("XML parsing error", FUNC_NAME, EXIT_FAILURE);
     }
 
+    /* Only the bands used during determination are opened and read */
+    band_set = INPUT_REFLECTIVE_BANDS;
+    if (use_cirrus)
+        band_set |= INPUT_BAND(BI_CIRRUS);
+    if (use_thermal)
+        band_set |= INPUT_BAND(BI_THERMAL);
+
     /* Open input file, read metadata, and set up buffers */
-    input = OpenInput(&xml_metadata, use_thermal);
+    input = OpenInput(&xml_metadata, band_set, input_mode);
     if (input == NULL)
     {
         RETURN_ERROR("opening input data specified in input XML",
@@ -186,7 +203,9 @@ main (int argc, char *argv[])
     status = potential_cloud_shadow_snow_mask(input, cloud_prob, &clear_ptm,
                                               &t_templ, &t_temph, pixel_mask,
                                               conf_mask, use_cirrus,
-                                              use_thermal, verbose);
+                                              use_thermal, fill_engine,
+                                              fill_scale, fill_compare,
+                                              verbose);
     if (status != SUCCESS)
     {
         RETURN_ERROR("processing potential_cloud_shadow_snow_mask",
@@ -200,7 +219,8 @@ main (int argc, char *argv[])
     int data_count = 0;
     status = object_cloud_shadow_match(input, clear_ptm, t_templ, t_temph,
                                        cldpix, sdpix, pixel_mask, &data_count,
-                                       use_thermal, verbose);
+                                       use_thermal, height_stride,
+                                       height_compare, verbose);
     if (status != SUCCESS)
     {
         RETURN_ERROR("processing object_cloud_and_shadow_match",
@@ -402,6 +422,37 @@ usage()
     printf("    --without-thermal: don't use thermal data during cloud"
            " detection and height determination for shadows"
            " (default is false, meaning always use thermal)\n");
+    printf("    --input-mode: how the input bands are accessed, either"
+           " 'line' to read each line from the files as each pass needs it"
+           ", 'resident' to load each band into memory once"
+           ", 'mmap' to map each band file into memory,"
+           " or 'prefetch' to read strips of lines ahead of the processing"
+           " on a background thread"
+           " (default is line)\n");
+    printf("    --fill-engine: how the local minima of the NIR and SWIR1"
+           " bands are filled, either 'queue' to flood from the fill"
+           " boundary level by level, or 'hybrid' to sweep the bands in"
+           " raster order before queueing the pixels still changing;"
+           " both give the same result"
+           " (default is queue)\n");
+    printf("    --fill-scale: fill the NIR and SWIR1 bands approximately,"
+           " on images reduced to the lowest value of each block of this"
+           " many rows and columns, such as 2 or 4, for quick-look products"
+           " (default is 1, meaning the exact fill)\n");
+    printf("    --fill-compare: also run the exact fill and report how"
+           " often the approximate fill changes the potential shadow test;"
+           " needs a --fill-scale above 1"
+           " (default is false)\n");
+    printf("    --height-stride: search the cloud base heights of each cloud"
+           " coarsely first, this many height steps at a time, such as 2 or"
+           " 4, then search a step at a time between the coarse heights"
+           " on either side of the best coarse match, with the stopping"
+           " rule starting over from the lower one"
+           " (default is 1, meaning the exhaustive search)\n");
+    printf("    --height-compare: also run the exhaustive height search and"
+           " report how often the coarse search matches a cloud at another"
+           " height; needs a --height-stride above 1"
+           " (default is false)\n");
     printf("    --verbose: display intermediate messages"
            " (default is false)\n");
     printf("\n");
@@ -41,6 +41,19 @@ typedef signed short int16;
 #define IS_OLITIRS 3
 
 
+/* Define the input access modes */
+#define INPUT_MODE_LINE     0 /* Read each line from the files as needed */
+#define INPUT_MODE_RESIDENT 1 /* Load each band into memory once */
+#define INPUT_MODE_MMAP     2 /* Map each band file into memory */
+#define INPUT_MODE_PREFETCH 3 /* Read strips ahead on a background thread */
+
+
+/* Define the local minima fill engines */
+#define FILL_ENGINE_QUEUE  0 /* Flood from the boundary by priority queue */
+#define FILL_ENGINE_HYBRID 1 /* Raster sweeps, then a queue of the unstable
+                                pixels */
+
+
 /* Define cloud confidence mask values */
 #define CLOUD_CONFIDENCE_NONE 0
 #define CLOUD_CONFIDENCE_LOW  1
@@ -5,100 +5,144 @@
 */
 
 /* System Includes */
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 
 /* Local Includes */
 #include "const.h"
 #include "error.h"
+#include "cfmask.h"
 #include "fill_local_minima_in_image.h"
 
 /* From IAS Math Implementation */
 #define IAS_MAX(A,B)    (((A) > (B)) ? (A) : (B))
 #define IAS_MIN(A,B)    (((A) < (B)) ? (A) : (B))
 
-/* Define the number of pixel elements to allocate in each block */
-#define BUFFER_BLOCK_SIZE 1000000
+/* Define the number of pixel indexes held in each chunk of a level, and the
+   number of chunks to allocate in each block */
+#define CHUNK_PIXELS 254
+#define BUFFER_BLOCK_CHUNKS 4096
+
+/* Number of rows and columns in each tile of the tiled fill */
+#define FILL_TILE_SIZE 256
+
+/* Number of levels or level words each bitmap word covers */
+#define LEVEL_WORD_BITS 64
+
+/* Index of the lowest bit set in a non-zero bitmap word */
+#if defined(__GNUC__)
+    #define LOWEST_BIT(word) __builtin_ctzll(word)
+#else
+static inline int LOWEST_BIT(unsigned long long word)
+{
+    int bit = 0;
+
+    while (!(word & 1))
+    {
+        word >>= 1;
+        bit++;
+    }
+    return bit;
+}
+#endif
 
 /* Support structures and routines for fill_minima. */
-typedef struct queue_element
+
+/* Chunk of pixel indexes (row * num_cols + col) queued at one level.  The
+   chunks of a level are linked from the first to the last in queue order. */
+typedef struct pixel_chunk
 {
-    int i;                  /* Row of pixel */
-    int j;                  /* Column of pixel */
-    struct queue_element *next;  /* Pointer to next pixel */
-} QUEUE_ELEMENT;
+    struct pixel_chunk *next;           /* Pointer to next chunk */
+    unsigned int pixels[CHUNK_PIXELS];  /* Pixel indexes */
+} PIXEL_CHUNK;
 
 typedef struct queue_header
 {
-    QUEUE_ELEMENT *first;           /* Pointer in queue - first */
-    QUEUE_ELEMENT *last;            /* Pointer in queue - last */
+    PIXEL_CHUNK *first;     /* Pointer in queue - first */
+    PIXEL_CHUNK *last;      /* Pointer in queue - last */
+    int head;               /* Next index to take from the first chunk */
+    int tail;               /* Next index to add to the last chunk */
 } QUEUE_HEADER;
 
-/* Pixel queue structure.  Instead of allocating each element in the queue
-   separately, a custom allocation scheme is used to allocate a block of
-   elements at a time and assign each of them as needed.  When an additional
-   block is needed, a new one is allocated.  The list of blocks is maintained
-   by using the first element in each block as a pointer to the next block. */
+/* Pixel queue structure.  Each level queues its pixel indexes in chunks,
+   which are allocated a block at a time and put back on a free list as the
+   level is emptied.  The list of blocks is maintained by using the first
+   chunk in each block as a pointer to the next block.  A bitmap of the
+   levels which have pixels, and a bitmap of its words which have bits set,
+   let the processing go straight to the next level with pixels. */
 typedef struct pixel_queue
 {
     int h_min;
     int num_levels;
     QUEUE_HEADER *q;
-    QUEUE_ELEMENT *pix_array;  /* First allocated QUEUE_ELEMENT block */
-    QUEUE_ELEMENT *current_pix_array;/* Current block of QUEUE_ELEMENT being
+    unsigned long long *level_bits;  /* Bit for each level with pixels */
+    unsigned long long *word_bits;   /* Bit for each level_bits word with
+                                        a bit set */
+    int num_level_words;       /* Number of words in level_bits */
+    int num_word_words;        /* Number of words in word_bits */
+    PIXEL_CHUNK *chunk_array;  /* First allocated PIXEL_CHUNK block */
+    PIXEL_CHUNK *current_chunk_array;/* Current block of PIXEL_CHUNK being
                                         used for allocs */
-    int next_new;              /* Next element to alloc in the current block */
-    QUEUE_ELEMENT *free_list;  /* Free list of elements */
+    int next_new;              /* Next chunk to alloc in the current block */
+    PIXEL_CHUNK *free_list;    /* Free list of chunks */
 } PIXEL_QUEUE;
 
 /*----------------------------------------------------------------------------
-NAME: *create_new_pixel
+NAME: *create_new_chunk
 
-PURPOSE: Allocate a new pixel queue element and initialize it.
+PURPOSE: Allocate a new pixel chunk, from the free list if it has one.
 
-RETURNS: Pointer to QUEUE_ELEMENT, NULL if the allocation fails
+RETURNS: Pointer to PIXEL_CHUNK, NULL if the allocation fails
 ----------------------------------------------------------------------------*/
-static QUEUE_ELEMENT *create_new_pixel
+static PIXEL_CHUNK *create_new_chunk
 (
-    PIXEL_QUEUE *pixel_q,   /* I: Pixel queue to use for allocations */
-    int i,                  /* I: Row of pixel */
-    int j                   /* I: Column of pixel */
+    PIXEL_QUEUE *pixel_q    /* I: Pixel queue to use for allocations */
 )
 {
-    char *FUNC_NAME = "create_new_pixel";
-    QUEUE_ELEMENT *p;
+    char *FUNC_NAME = "create_new_chunk";
+    PIXEL_CHUNK *chunk;
     int alloc_index = pixel_q->next_new;
 
-    if (alloc_index >= BUFFER_BLOCK_SIZE)
+    chunk = pixel_q->free_list;
+    if (chunk)
+    {
+        pixel_q->free_list = chunk->next;
+        chunk->next = NULL;
+        return chunk;
+    }
+
+    if (alloc_index >= BUFFER_BLOCK_CHUNKS)
     {
-        /* Allocate another block of pixel elements */
-        QUEUE_ELEMENT *new_block = malloc(BUFFER_BLOCK_SIZE
+        /* Allocate another block of chunks */
+        PIXEL_CHUNK *new_block = malloc(BUFFER_BLOCK_CHUNKS
                 * sizeof(*new_block));
         if (!new_block)
         {
-            RETURN_ERROR("Allocating a new block of queue elements",
+            RETURN_ERROR("Allocating a new block of queue chunks",
                          FUNC_NAME, NULL);
         }
         new_block[0].next = NULL;
 
-        /* The first element in the current array is used as a pointer to the
+        /* The first chunk in the current array is used as a pointer to the
            next block */
-        pixel_q->current_pix_array[0].next = new_block;
+        pixel_q->current_chunk_array[0].next = new_block;
 
         /* Allocating from the next block now */
-        pixel_q->current_pix_array = new_block;
+        pixel_q->current_chunk_array = new_block;
         pixel_q->next_new = 1;
         alloc_index = 1;
     }
     pixel_q->next_new++;
 
-    p = &pixel_q->current_pix_array[alloc_index];
-    p->i = i;
-    p->j = j;
-    p->next = NULL;
+    chunk = &pixel_q->current_chunk_array[alloc_index];
+    chunk->next = NULL;
 
-    return p;
+    return chunk;
 }
 
 /*----------------------------------------------------------------------------
@@ -117,7 +161,6 @@ static PIXEL_QUEUE *initialize_pixel_queue
     char *FUNC_NAME = "initialize_pixel_queue";
     PIXEL_QUEUE *pixel_q;
     int num_levels;
-    int i;
 
     pixel_q = (PIXEL_QUEUE *)calloc(1, sizeof(PIXEL_QUEUE));
     if (pixel_q == NULL)
@@ -128,34 +171,43 @@ static PIXEL_QUEUE *initialize_pixel_queue
     num_levels = h_max - h_min + 1;
     pixel_q->h_min = h_min;
     pixel_q->num_levels = num_levels;
+    pixel_q->num_level_words = (num_levels + LEVEL_WORD_BITS - 1)
+                               / LEVEL_WORD_BITS;
+    pixel_q->num_word_words = (pixel_q->num_level_words + LEVEL_WORD_BITS - 1)
+                              / LEVEL_WORD_BITS;
 
     pixel_q->q = (QUEUE_HEADER *)calloc(num_levels, sizeof(QUEUE_HEADER));
-    if (pixel_q->q == NULL)
+    pixel_q->level_bits = calloc(pixel_q->num_level_words,
+                                 sizeof(unsigned long long));
+    pixel_q->word_bits = calloc(pixel_q->num_word_words,
+                                sizeof(unsigned long long));
+    if (pixel_q->q == NULL || pixel_q->level_bits == NULL
+        || pixel_q->word_bits == NULL)
     {
+       free(pixel_q->q);
+       free(pixel_q->level_bits);
+       free(pixel_q->word_bits);
        free(pixel_q);
        RETURN_ERROR("Allocating memory for pixel queue header",
                     FUNC_NAME, NULL);
     }
-    for (i = 0; i < num_levels; i++)
-    {
-        pixel_q->q[i].first = NULL;
-        pixel_q->q[i].last = NULL;
-    }
 
-    /* Allocate a starting block of QUEUE_ELEMENT buffers */
-    pixel_q->pix_array = malloc(BUFFER_BLOCK_SIZE * sizeof(QUEUE_ELEMENT));
-    if (!pixel_q->pix_array)
+    /* Allocate a starting block of PIXEL_CHUNK buffers */
+    pixel_q->chunk_array = malloc(BUFFER_BLOCK_CHUNKS * sizeof(PIXEL_CHUNK));
+    if (!pixel_q->chunk_array)
     {
        free(pixel_q->q);
+       free(pixel_q->level_bits);
+       free(pixel_q->word_bits);
        free(pixel_q);
-       RETURN_ERROR("Allocating memory for the queue element array",
+       RETURN_ERROR("Allocating memory for the queue chunk array",
                     FUNC_NAME, NULL);
     }
 
     /* Reserve the first entry for the next block link */
     pixel_q->next_new = 1;
-    pixel_q->pix_array[0].next = NULL;
-    pixel_q->current_pix_array = pixel_q->pix_array;
+    pixel_q->chunk_array[0].next = NULL;
+    pixel_q->current_chunk_array = pixel_q->chunk_array;
 
     return pixel_q;
 }
@@ -172,19 +224,21 @@ static void free_pixel_queue
     PIXEL_QUEUE *pixel_q   /* I: Pointer to PIXEL_QUEUE */
 )
 {
-    QUEUE_ELEMENT *p;
+    PIXEL_CHUNK *p;
 
-    /* Free the blocks of pixel elements.  Note that the free list does not
-       need to be free'd since nothing in that list was directly allocated. */
-    p = pixel_q->pix_array;
+    /* Free the blocks of chunks.  Note that the free list does not need to
+       be free'd since nothing in that list was directly allocated. */
+    p = pixel_q->chunk_array;
     while (p)
     {
-        QUEUE_ELEMENT *next = p->next;
+        PIXEL_CHUNK *next = p->next;
         free(p);
         p = next;
     }
     free(pixel_q->q);
     pixel_q->q = NULL;
+    free(pixel_q->level_bits);
+    free(pixel_q->word_bits);
 
     free(pixel_q);
 }
@@ -196,130 +250,192 @@ PURPOSE: Add a pixel at level h
 
 RETURNS: SUCCESS/ERROR
 ----------------------------------------------------------------------------*/
-static int add_pixel
+static inline int add_pixel
 (
     PIXEL_QUEUE *pixel_q,/* I: Pointer to PIXEL_QUEUE */
-    int row,             /* I: Row of pixel */
-    int col,             /* I: Column of pixel */
+    unsigned int pixel,  /* I: Index of pixel (row * num_cols + col) */
     int h                /* I: Element level in the queue */
 )
 {
     char *FUNC_NAME = "add_pixel";
     int ndx;
-    QUEUE_ELEMENT *current;
-    QUEUE_ELEMENT *new_pixel;
+    int word;
     QUEUE_HEADER *level_q;
 
     ndx = h - pixel_q->h_min;
-    if (ndx > pixel_q->num_levels)
+    if (ndx < 0 || ndx >= pixel_q->num_levels)
     {
         RETURN_ERROR("Invalid element level", FUNC_NAME, ERROR);
     }
     level_q = &(pixel_q->q[ndx]);
 
-    /* Get a pixel element from the free list, if available */
-    new_pixel = pixel_q->free_list;
-    if (new_pixel)
+    /* Start a new chunk at the end of the queue at this level if it is
+       empty, or its last chunk is full */
+    if (level_q->last == NULL || level_q->tail == CHUNK_PIXELS)
     {
-        pixel_q->free_list = new_pixel->next;
-        new_pixel->next = NULL;
-        new_pixel->i = row;
-        new_pixel->j = col;
-    }
-    else
-    {
-        /* Take a copy of the pixel structure */
-        new_pixel = create_new_pixel(pixel_q, row, col);
-        if (!new_pixel)
+        PIXEL_CHUNK *new_chunk = create_new_chunk(pixel_q);
+        if (!new_chunk)
         {
-            RETURN_ERROR("Adding element to the pixel queue",
+            RETURN_ERROR("Adding chunk to the pixel queue",
                          FUNC_NAME, ERROR);
         }
-    }
 
-    /* Add to end of queue at this level */
-    current = level_q->last;
-    if (current != NULL)
-    {
-        current->next = new_pixel;
+        if (level_q->last == NULL)
+        {
+            level_q->first = new_chunk;
+            level_q->head = 0;
+
+            /* The level has pixels now */
+            word = ndx / LEVEL_WORD_BITS;
+            pixel_q->level_bits[word] |= 1ULL << (ndx % LEVEL_WORD_BITS);
+            pixel_q->word_bits[word / LEVEL_WORD_BITS] |=
+                1ULL << (word % LEVEL_WORD_BITS);
+        }
+        else
+            level_q->last->next = new_chunk;
+        level_q->last = new_chunk;
+        level_q->tail = 0;
     }
-    level_q->last = new_pixel;
 
-    /* If head of queue is NULL, make the new one the head */
-    if (level_q->first == NULL)
-    {
-        level_q->first = new_pixel;
-    }
+    /* Add to end of queue at this level */
+    level_q->last->pixels[level_q->tail++] = pixel;
 
     return SUCCESS;
 }
 
 /*----------------------------------------------------------------------------
-NAME: *get_first_pixel_entry
+NAME: get_first_pixel_entry
 
-PURPOSE: Return the first element in the queue at level h, and remove it
+PURPOSE: Return the first pixel in the queue at level h, and remove it
          from the queue
 
-RETURNS: First element in the queue at level h
+RETURNS: true if a pixel was returned, false if the level is empty
 ----------------------------------------------------------------------------*/
-static QUEUE_ELEMENT *get_first_pixel_entry
+static inline bool get_first_pixel_entry
 (
     PIXEL_QUEUE *pixel_q,/* I: Pointer to PIXEL_QUEUE */
-    int h                /* I: Element level in the queue */
+    int h,               /* I: Element level in the queue */
+    unsigned int *pixel  /* O: Index of the first pixel */
 )
 {
     int ndx;
-    QUEUE_ELEMENT *current;
+    int word;
+    PIXEL_CHUNK *first;
     QUEUE_HEADER *level_q;
 
     ndx = h - pixel_q->h_min;
     level_q = &(pixel_q->q[ndx]);
-    current = level_q->first;
+    first = level_q->first;
+    if (first == NULL)
+        return false;
 
     /* Remove from head of queue */
-    if (current != NULL)
+    *pixel = first->pixels[level_q->head++];
+
+    if (first == level_q->last)
     {
-        level_q->first = current->next;
-        if (level_q->first == NULL)
+        if (level_q->head < level_q->tail)
+            return true;
+
+        /* The level is empty now */
+        level_q->first = NULL;
+        level_q->last = NULL;
+        word = ndx / LEVEL_WORD_BITS;
+        pixel_q->level_bits[word] &= ~(1ULL << (ndx % LEVEL_WORD_BITS));
+        if (pixel_q->level_bits[word] == 0)
         {
-            level_q->last = NULL;
+            pixel_q->word_bits[word / LEVEL_WORD_BITS] &=
+                ~(1ULL << (word % LEVEL_WORD_BITS));
         }
     }
+    else
+    {
+        if (level_q->head < CHUNK_PIXELS)
+            return true;
+
+        /* Move on to the next chunk */
+        level_q->first = first->next;
+        level_q->head = 0;
+    }
+
+    /* Put the chunk on the free list */
+    first->next = pixel_q->free_list;
+    pixel_q->free_list = first;
 
-    return current;
+    return true;
 }
 
 /*----------------------------------------------------------------------------
-NAME:  kernel_has_fill
+NAME: next_pixel_level
 
-PURPOSE: Checks a 3x3 kernel around the line/sample passed in to see if any
-         of the pixels have fill.
+PURPOSE: Find the lowest level from h up which has pixels queued
 
-RETURN: true if the 3x3 kernel has fill pixels, FALSE if not
+RETURNS: The level, or the maximum level plus one if no level has pixels
 ----------------------------------------------------------------------------*/
-static inline bool kernel_has_fill
+static int next_pixel_level
 (
-    const short int *in_img,
-    int nl,
-    int ns,
-    int center_line,
-    int center_sample
+    PIXEL_QUEUE *pixel_q,/* I: Pointer to PIXEL_QUEUE */
+    int h                /* I: Lowest level to look at */
 )
 {
-    int start_line = center_line - 1;
-    int end_line = center_line + 1;
-    int start_samp = center_sample - 1;
-    int end_samp = center_sample + 1;
-    int line;
+    int ndx = h - pixel_q->h_min;
+    int word = ndx / LEVEL_WORD_BITS;
+    int group;
+    unsigned long long bits;
+
+    if (ndx >= pixel_q->num_levels)
+        return pixel_q->h_min + pixel_q->num_levels;
+
+    /* Look in the rest of the word holding the level */
+    bits = pixel_q->level_bits[word] & (~0ULL << (ndx % LEVEL_WORD_BITS));
+    if (bits)
+        return pixel_q->h_min + word * LEVEL_WORD_BITS + LOWEST_BIT(bits);
+
+    /* Find the next word with a bit set */
+    word++;
+    group = word / LEVEL_WORD_BITS;
+    if (group >= pixel_q->num_word_words)
+        return pixel_q->h_min + pixel_q->num_levels;
+    bits = pixel_q->word_bits[group] & (~0ULL << (word % LEVEL_WORD_BITS));
+    while (!bits)
+    {
+        group++;
+        if (group >= pixel_q->num_word_words)
+            return pixel_q->h_min + pixel_q->num_levels;
+        bits = pixel_q->word_bits[group];
+    }
+    word = group * LEVEL_WORD_BITS + LOWEST_BIT(bits);
+
+    return pixel_q->h_min + word * LEVEL_WORD_BITS
+           + LOWEST_BIT(pixel_q->level_bits[word]);
+}
 
-    if (start_line < 0)
-        start_line = 0;
-    else if (end_line >= nl)
-        end_line = nl - 1;
-    if (start_samp < 0)
-        start_samp = 0;
-    else if (end_samp >= ns)
-        end_samp = ns - 1;
+/*----------------------------------------------------------------------------
+NAME:  kernel_fill_bands
+
+PURPOSE: Checks a 3x3 kernel around the line/sample passed in to see which
+         of the bands have fill in it.
+
+RETURN: Mask with the bit of each band having fill pixels in the 3x3
+        kernel set
+----------------------------------------------------------------------------*/
+static inline unsigned int kernel_fill_bands
+(
+    const short int *const *in_imgs, /* I: Input image of each band */
+    int num_bands,                   /* I: Number of bands */
+    int nl,                          /* I: Number of lines */
+    int ns,                          /* I: Number of samples */
+    int center_line,                 /* I: Line of the kernel center */
+    int center_sample                /* I: Sample of the kernel center */
+)
+{
+    int start_line = IAS_MAX(0, center_line - 1);
+    int end_line = IAS_MIN(nl - 1, center_line + 1);
+    int start_samp = IAS_MAX(0, center_sample - 1);
+    int end_samp = IAS_MIN(ns - 1, center_sample + 1);
+    unsigned int all_bands = (1U << num_bands) - 1;
+    unsigned int fill_bands = 0;
+    int line;
 
     for (line = start_line; line <= end_line; line++)
     {
@@ -327,130 +443,609 @@ static inline bool kernel_has_fill
 
         for (samp = start_samp; samp <= end_samp; samp++)
         {
-            /* return 1 if fill found */
-            if (in_img[line * ns + samp] == FILL_PIXEL)
-                return true;
+            int band;
+
+            for (band = 0; band < num_bands; band++)
+            {
+                if (in_imgs[band][line * ns + samp] == FILL_PIXEL)
+                    fill_bands |= 1U << band;
+            }
+
+            /* Stop once every band has fill */
+            if (fill_bands == all_bands)
+                return fill_bands;
         }
     }
 
-    /* no fill found */
-    return false;
+    return fill_bands;
 }
 
 /*----------------------------------------------------------------------------
-NAME:  fill_local_minima_in_image
+NAME:  SEED_LIST
 
-PURPOSE: Fill all local minima in the input img. The input array should be a
-         2-d array. This function returns an array of the same shape and
-         datatype, with the same contents, but with local minima filled using
-         the reconstruction-by-erosion algorithm.
+PURPOSE: List of the boundary pixels (row * num_cols + col), which are next
+         to fill in at least one of the bands.
+----------------------------------------------------------------------------*/
+typedef struct seed_list
+{
+    unsigned int *pixels;      /* Pixel indexes, in image order */
+    int count;                 /* Number of pixels in the list */
+    int size;                  /* Number of pixels allocated */
+} SEED_LIST;
 
-RETURN: SUCCESS/ERROR
+/*----------------------------------------------------------------------------
+NAME:  add_seed
+
+PURPOSE: Adds a pixel to the end of a seed list, growing the list if it is
+         full.
+
+RETURNS: SUCCESS/ERROR
+----------------------------------------------------------------------------*/
+static int add_seed
+(
+    SEED_LIST *seeds,      /* I/O: Seed list */
+    unsigned int pixel     /* I: Index of pixel (row * num_cols + col) */
+)
+{
+    char *FUNC_NAME = "add_seed";
+
+    if (seeds->count == seeds->size)
+    {
+        int size = seeds->size > 0 ? 2 * seeds->size : CHUNK_PIXELS * 16;
+        unsigned int *pixels = realloc(seeds->pixels,
+                                       size * sizeof(unsigned int));
+        if (pixels == NULL)
+        {
+            RETURN_ERROR("Growing the seed list", FUNC_NAME, ERROR);
+        }
+        seeds->pixels = pixels;
+        seeds->size = size;
+    }
+
+    seeds->pixels[seeds->count++] = pixel;
+
+    return SUCCESS;
+}
 
+/*----------------------------------------------------------------------------
+NAME:  is_spreading
+
+PURPOSE: Checks whether a pixel lowers its neighbors, which the fill does
+         for the pixels it processes below the maximum.  For the pixels of
+         the seed list, it tells whether they start the fill of a band.
+
+RETURN: true if the pixel lowers its neighbors
 ----------------------------------------------------------------------------*/
-int fill_local_minima_in_image
+static inline bool is_spreading
 (
-    const char *band_name,     /* I: Band name being filled */
     const short int *in_img,   /* I: Input image buffer */
-    int num_rows,              /* I: Number of rows in the input image */
-    int num_cols,              /* I: Number of columns in the input image */
-    float boundary_val,        /* I: Background (land) percentage */
-    short int *out_img         /* O: Output image buffer */
+    const short int *out_img,  /* I: Output image buffer */
+    int hmax,                  /* I: Maximum value in the image */
+    unsigned int pixel         /* I: Index of pixel (row * num_cols + col) */
 )
 {
-    char *FUNC_NAME = "add_pixel";
+    return in_img[pixel] != FILL_PIXEL && out_img[pixel] < hmax;
+}
+
+/*----------------------------------------------------------------------------
+NAME:  FILL_TILES
+
+PURPOSE: State of the tiled fill.  The image is split into square tiles,
+         which are filled separately using the current values around them,
+         until no tile changes any more.
+----------------------------------------------------------------------------*/
+typedef struct fill_tiles
+{
+    const short int *in_img;   /* Input image buffer */
+    short int *out_img;        /* Output image buffer */
+    int num_rows;              /* Number of rows in the image */
+    int num_cols;              /* Number of columns in the image */
+    int hmin;                  /* Minimum value in the image */
+    int hmax;                  /* Maximum value in the image */
+    int tile_rows;             /* Number of tiles down the image */
+    int tile_cols;             /* Number of tiles across the image */
+    unsigned char *dirty;      /* Tiles which need to be filled again, since
+                                  the values around them changed */
+    unsigned char *seeded;     /* Tiles which have queued their boundary
+                                  pixels */
+    const unsigned int *tile_seeds; /* Seeds sorted by tile */
+    const int *tile_first_seed;     /* First seed of each tile */
+} FILL_TILES;
+
+/*----------------------------------------------------------------------------
+NAME:  relax_tile_pixel
+
+PURPOSE: Lowers a pixel of a tile to the level reaching it from a
+         neighbor, the same way the serial fill sets a pixel when its first
+         neighbor is processed, and queues it if it has to be processed.
+
+RETURNS: SUCCESS/ERROR
+----------------------------------------------------------------------------*/
+static inline int relax_tile_pixel
+(
+    FILL_TILES *tiles,     /* I/O: State of the tiled fill */
+    PIXEL_QUEUE *pixel_q,  /* I/O: The thread's pixel queue */
+    int pixel,             /* I: Index of pixel (row * num_cols + col) */
+    int level,             /* I: Level of the neighbor */
+    bool *edge_changed,    /* O: Set if a pixel on the tile edge changed */
+    bool on_edge           /* I: The pixel is on the tile edge */
+)
+{
+    short int in = tiles->in_img[pixel];
+    short int *out = &tiles->out_img[pixel];
+    int value;
+
+    /* Exclude null area of original image */
+    if (in == FILL_PIXEL)
+        return SUCCESS;
+
+    /* The serial fill only sets the pixels still at the maximum, which
+       is also the lowest level reaching them except for values above the
+       maximum */
+    value = IAS_MAX(level, in);
+    if (value < *out || (*out == tiles->hmax && value != *out))
+    {
+        *out = value;
+        if (on_edge)
+            *edge_changed = true;
+        if (in < tiles->hmax)
+            return add_pixel(pixel_q, pixel, value);
+    }
+
+    return SUCCESS;
+}
+
+/*----------------------------------------------------------------------------
+NAME:  fill_tile
+
+PURPOSE: Fills one tile, starting from its own boundary pixels the first
+         time, and from the current values of the pixels around it.
+
+RETURNS: SUCCESS/ERROR
+----------------------------------------------------------------------------*/
+static int fill_tile
+(
+    FILL_TILES *tiles,     /* I/O: State of the tiled fill */
+    PIXEL_QUEUE *pixel_q,  /* I/O: The thread's pixel queue */
+    int tile,              /* I: Index of the tile */
+    bool *edge_changed     /* O: Set if a pixel on the tile edge changed */
+)
+{
+    char *FUNC_NAME = "fill_tile";
+    int num_rows = tiles->num_rows;
+    int num_cols = tiles->num_cols;
+    int start_row = (tile / tiles->tile_cols) * FILL_TILE_SIZE;
+    int start_col = (tile % tiles->tile_cols) * FILL_TILE_SIZE;
+    int end_row = IAS_MIN(num_rows, start_row + FILL_TILE_SIZE);
+    int end_col = IAS_MIN(num_cols, start_col + FILL_TILE_SIZE);
     int r, c;
-    PIXEL_QUEUE *pixel_q;
-    QUEUE_ELEMENT *p;
     int h_current;
-    int hmin, hmax;
-    int pixel_count = num_rows * num_cols;
+    unsigned int p;
 
-    printf("minima filling setup for %s band\n", band_name);
+    *edge_changed = false;
 
-    /* Find the min and max values in the input buffer. */
-    hmin = 32767;
-    hmax = -32767;
-    for (r = 0; r < pixel_count; r++)
+    /* The first time, queue the boundary pixels of the tile, which are the
+       only pixels below the maximum before the tile has been filled */
+    if (!tiles->seeded[tile])
     {
-         if (in_img[r] == FILL_PIXEL)
-             continue;    /* Fill data */
-         if (in_img[r] < hmin)
-             hmin = in_img[r];
-         else if (in_img[r] > hmax)
-             hmax = in_img[r];
+        int i;
+
+        tiles->seeded[tile] = 1;
+        for (i = tiles->tile_first_seed[tile];
+             i < tiles->tile_first_seed[tile + 1]; i++)
+        {
+            p = tiles->tile_seeds[i];
+            if (!is_spreading(tiles->in_img, tiles->out_img, tiles->hmax, p))
+                continue;
+            if (add_pixel(pixel_q, p, tiles->out_img[p]) != SUCCESS)
+            {
+                RETURN_ERROR("Adding pixel to queue", FUNC_NAME, ERROR);
+            }
+        }
     }
 
-    /* If hmin and hmax values have not changed, entire image is fill. */
-    if (hmin == 32767 && hmax == -32767)
+    /* Treat the pixels around the tile which the serial fill would have
+       queued as already processed at their current values */
+    for (r = IAS_MAX(0, start_row - 1); r < IAS_MIN(num_rows, end_row + 1);
+         r++)
     {
-        RETURN_ERROR("Entire image is fill", FUNC_NAME, ERROR);
-    }
+        int step = 1;
 
-    /* If the boundary value is set to zero, use the maximum value. */
-    if (boundary_val == 0)
-        boundary_val = hmax;
+        /* Only the first and last columns of the rows inside the tile */
+        if (r >= start_row && r < end_row)
+            step = end_col - start_col + 1;
 
-    /* Fill the out_img with the max value. */
-    for (r = 0; r < pixel_count; r++)
-        out_img[r] = hmax;
+        for (c = start_col - 1; c <= end_col; c += step)
+        {
+            int pixel = r * num_cols + c;
+            int level;
+            int nr, nc;
 
-    pixel_q = initialize_pixel_queue(hmin, hmax);
-    if (!pixel_q)
-    {
-        RETURN_ERROR("Allocating pixel queue", FUNC_NAME, ERROR);
+            if (c < 0 || c >= num_cols)
+                continue;
+            if (tiles->in_img[pixel] == FILL_PIXEL)
+                continue;
+            level = tiles->out_img[pixel];
+            if (level >= tiles->hmax)
+                continue;
+
+            for (nr = IAS_MAX(start_row, r - 1);
+                 nr < IAS_MIN(end_row, r + 2); nr++)
+            {
+                for (nc = IAS_MAX(start_col, c - 1);
+                     nc < IAS_MIN(end_col, c + 2); nc++)
+                {
+                    bool on_edge = nr == start_row || nr == end_row - 1
+                                   || nc == start_col || nc == end_col - 1;
+
+                    if (relax_tile_pixel(tiles, pixel_q, nr * num_cols + nc,
+                                         level, edge_changed, on_edge)
+                        != SUCCESS)
+                    {
+                        RETURN_ERROR("Adding pixel to queue", FUNC_NAME,
+                                     ERROR);
+                    }
+                }
+            }
+        }
     }
 
-    /* Initialize the boundary pixels. */
-    for (r = 0; r < num_rows; r++)
+    /* Process until stability inside the tile */
+    h_current = next_pixel_level(pixel_q, tiles->hmin);
+    while (h_current < tiles->hmax)
     {
-        const short int *in_line = &in_img[r * num_cols];
-        short int *out_line = &out_img[r * num_cols];
-
-        /* Find the boundary pixels on this row */
-        for (c = 0; c < num_cols; c++)
+        while (get_first_pixel_entry(pixel_q, h_current, &p))
         {
-            /* Not a boundary if it is fill */
-            if (in_line[c] == FILL_PIXEL)
+            int p_row = p / num_cols;
+            int p_col = p - p_row * num_cols;
+
+            for (r = IAS_MAX(start_row, p_row - 1);
+                 r < IAS_MIN(end_row, p_row + 2); r++)
             {
-                /* Set the filled image to a fill pixel */
-                out_line[c] = FILL_PIXEL;
-                continue;
+                for (c = IAS_MAX(start_col, p_col - 1);
+                     c < IAS_MIN(end_col, p_col + 2); c++)
+                {
+                    bool on_edge = r == start_row || r == end_row - 1
+                                   || c == start_col || c == end_col - 1;
+
+                    /* Skip the current pixel */
+                    if (r == p_row && c == p_col)
+                        continue;
+
+                    if (relax_tile_pixel(tiles, pixel_q, r * num_cols + c,
+                                         h_current, edge_changed, on_edge)
+                        != SUCCESS)
+                    {
+                        RETURN_ERROR("Adding pixel to queue", FUNC_NAME,
+                                     ERROR);
+                    }
+                }
             }
+        }
+        h_current = next_pixel_level(pixel_q, h_current + 1);
+    }
+
+    return SUCCESS;
+}
+
+/*----------------------------------------------------------------------------
+NAME:  fill_tiles
+
+PURPOSE: Fills the image a tile at a time, with the tiles split between the
+         threads.  The tiles are taken in four groups, alternating rows and
+         columns of tiles, so the tiles filled at the same time never touch.
+         The groups are repeated while any tile has changed the pixels
+         around its neighbors.
+
+NOTES:
+1. The pixels only ever move down from the maximum to the lowest level
+   reaching them, which is where the serial fill sets them, so the result
+   is the same as the serial fill's.
+
+RETURNS: SUCCESS/ERROR
+----------------------------------------------------------------------------*/
+static int fill_tiles
+(
+    FILL_TILES *tiles      /* I/O: State of the tiled fill */
+)
+{
+    char *FUNC_NAME = "fill_tiles";
+    int num_tiles = tiles->tile_rows * tiles->tile_cols;
+    int num_queues = 1;
+    PIXEL_QUEUE **queues;
+    int status = SUCCESS;
+    bool changed;
+    int group;
+    int i;
 
-            /* If the 3x3 kernel has any fill pixels, it is a boundary pixel */
-            if (kernel_has_fill(in_img, num_rows, num_cols, r, c))
+#ifdef _OPENMP
+    num_queues = omp_get_max_threads();
+#endif
+    queues = calloc(num_queues, sizeof(PIXEL_QUEUE *));
+    if (queues == NULL)
+    {
+        RETURN_ERROR("Allocating the pixel queues", FUNC_NAME, ERROR);
+    }
+    for (i = 0; i < num_queues; i++)
+    {
+        queues[i] = initialize_pixel_queue(tiles->hmin, tiles->hmax);
+        if (queues[i] == NULL)
+            status = ERROR;
+    }
+
+    do
+    {
+        changed = false;
+        for (group = 0; group < 4 && status == SUCCESS; group++)
+        {
+#ifdef _OPENMP
+            #pragma omp parallel for schedule(dynamic, 1) \
+                reduction(||:changed)
+#endif
+            for (i = 0; i < num_tiles; i++)
             {
-                if (add_pixel(pixel_q, r, c, boundary_val) != SUCCESS)
+                int tile_row = i / tiles->tile_cols;
+                int tile_col = i % tiles->tile_cols;
+                PIXEL_QUEUE *pixel_q = queues[0];
+                bool edge_changed;
+                int tile_status;
+                int r, c;
+
+                /* The status is shared, so a failure in any thread stops
+                   the tiles not yet started by the others */
+#ifdef _OPENMP
+                #pragma omp atomic read
+#endif
+                tile_status = status;
+
+                /* Only the tiles of the group are written now, so only
+                   their flags are read */
+                if ((tile_row % 2) * 2 + tile_col % 2 != group
+                    || !tiles->dirty[i] || tile_status != SUCCESS)
                 {
-                    free_pixel_queue(pixel_q);
-                    RETURN_ERROR("Adding pixel to queue",
-                                 FUNC_NAME, ERROR);
+                    continue;
                 }
+                tiles->dirty[i] = 0;
+                changed = true;
 
-                out_line[c] = boundary_val;
+#ifdef _OPENMP
+                pixel_q = queues[omp_get_thread_num()];
+#endif
+                if (fill_tile(tiles, pixel_q, i, &edge_changed) != SUCCESS)
+                {
+#ifdef _OPENMP
+                    #pragma omp atomic write
+#endif
+                    status = ERROR;
+                    continue;
+                }
+
+                /* The neighbors have to be filled again from the new
+                   values */
+                if (!edge_changed)
+                    continue;
+                for (r = IAS_MAX(0, tile_row - 1);
+                     r <= IAS_MIN(tiles->tile_rows - 1, tile_row + 1); r++)
+                {
+                    for (c = IAS_MAX(0, tile_col - 1);
+                         c <= IAS_MIN(tiles->tile_cols - 1, tile_col + 1);
+                         c++)
+                    {
+                        if (r != tile_row || c != tile_col)
+                        {
+#ifdef _OPENMP
+                            #pragma omp atomic write
+#endif
+                            tiles->dirty[r * tiles->tile_cols + c] = 1;
+                        }
+                    }
+                }
             }
         }
+    } while (changed && status == SUCCESS);
+
+    for (i = 0; i < num_queues; i++)
+    {
+        if (queues[i] != NULL)
+            free_pixel_queue(queues[i]);
     }
+    free(queues);
 
-    printf("main minima filling started for %s band\n", band_name);
+    if (status != SUCCESS)
+    {
+        RETURN_ERROR("Filling the tiles", FUNC_NAME, ERROR);
+    }
 
-    /* Process until stability */
-    h_current = (int)hmin;
-    do
+    return SUCCESS;
+}
+
+/*----------------------------------------------------------------------------
+NAME:  sort_tile_seeds
+
+PURPOSE: Sorts the seed list by tile, keeping the image order within each
+         tile, so each tile can queue its own seeds.
+
+RETURNS: SUCCESS/ERROR
+----------------------------------------------------------------------------*/
+static int sort_tile_seeds
+(
+    const SEED_LIST *seeds,     /* I: Seed list, in image order */
+    int num_cols,               /* I: Number of columns in the image */
+    int tile_cols,              /* I: Number of tiles across the image */
+    int num_tiles,              /* I: Number of tiles in the image */
+    unsigned int **tile_seeds,  /* O: Seeds sorted by tile */
+    int **tile_first_seed       /* O: First seed of each tile, with the
+                                      number of seeds at the end */
+)
+{
+    char *FUNC_NAME = "sort_tile_seeds";
+    int *next;
+    int i;
+
+    *tile_seeds = malloc(IAS_MAX(seeds->count, 1) * sizeof(unsigned int));
+    *tile_first_seed = calloc(num_tiles + 1, sizeof(int));
+    next = calloc(num_tiles, sizeof(int));
+    if (*tile_seeds == NULL || *tile_first_seed == NULL || next == NULL)
+    {
+        free(*tile_seeds);
+        free(*tile_first_seed);
+        free(next);
+        RETURN_ERROR("Allocating the tile seeds", FUNC_NAME, ERROR);
+    }
+
+    /* Count the seeds of each tile, then place them after the seeds of
+       the tiles before */
+    for (i = 0; i < seeds->count; i++)
+    {
+        int row = seeds->pixels[i] / num_cols;
+        int col = seeds->pixels[i] - row * num_cols;
+
+        (*tile_first_seed)[(row / FILL_TILE_SIZE) * tile_cols
+                           + col / FILL_TILE_SIZE + 1]++;
+    }
+    for (i = 0; i < num_tiles; i++)
+    {
+        (*tile_first_seed)[i + 1] += (*tile_first_seed)[i];
+        next[i] = (*tile_first_seed)[i];
+    }
+    for (i = 0; i < seeds->count; i++)
+    {
+        int row = seeds->pixels[i] / num_cols;
+        int col = seeds->pixels[i] - row * num_cols;
+        int tile = (row / FILL_TILE_SIZE) * tile_cols + col / FILL_TILE_SIZE;
+
+        (*tile_seeds)[next[tile]++] = seeds->pixels[i];
+    }
+
+    free(next);
+
+    return SUCCESS;
+}
+
+/*----------------------------------------------------------------------------
+NAME:  fill_band_in_tiles
+
+PURPOSE: Fills one band a tile at a time, starting from the seeds of each
+         tile.
+
+RETURNS: SUCCESS/ERROR
+----------------------------------------------------------------------------*/
+static int fill_band_in_tiles
+(
+    const short int *in_img,        /* I: Input image buffer */
+    short int *out_img,             /* I/O: Output image buffer, with the
+                                            boundary pixels set */
+    int num_rows,                   /* I: Number of rows in the image */
+    int num_cols,                   /* I: Number of columns in the image */
+    int hmin,                       /* I: Minimum value in the image */
+    int hmax,                       /* I: Maximum value in the image */
+    const unsigned int *tile_seeds, /* I: Seeds sorted by tile */
+    const int *tile_first_seed      /* I: First seed of each tile */
+)
+{
+    char *FUNC_NAME = "fill_band_in_tiles";
+    FILL_TILES tiles;
+    int num_tiles;
+    int status;
+
+    tiles.in_img = in_img;
+    tiles.out_img = out_img;
+    tiles.num_rows = num_rows;
+    tiles.num_cols = num_cols;
+    tiles.hmin = hmin;
+    tiles.hmax = hmax;
+    tiles.tile_rows = (num_rows + FILL_TILE_SIZE - 1) / FILL_TILE_SIZE;
+    tiles.tile_cols = (num_cols + FILL_TILE_SIZE - 1) / FILL_TILE_SIZE;
+    tiles.tile_seeds = tile_seeds;
+    tiles.tile_first_seed = tile_first_seed;
+    num_tiles = tiles.tile_rows * tiles.tile_cols;
+
+    /* Every tile is filled at least once */
+    tiles.dirty = malloc(num_tiles);
+    tiles.seeded = calloc(num_tiles, 1);
+    if (tiles.dirty == NULL || tiles.seeded == NULL)
+    {
+        free(tiles.dirty);
+        free(tiles.seeded);
+        RETURN_ERROR("Allocating the tile flags", FUNC_NAME, ERROR);
+    }
+    memset(tiles.dirty, 1, num_tiles);
+
+    status = fill_tiles(&tiles);
+    free(tiles.dirty);
+    free(tiles.seeded);
+    if (status != SUCCESS)
+    {
+        RETURN_ERROR("Filling the image tiles", FUNC_NAME, ERROR);
+    }
+
+    return SUCCESS;
+}
+
+/*----------------------------------------------------------------------------
+NAME:  fill_band
+
+PURPOSE: Fills one band with a single pixel queue, starting from the seeds
+         of the whole image.
+
+RETURNS: SUCCESS/ERROR
+----------------------------------------------------------------------------*/
+static int fill_band
+(
+    const short int *in_img,   /* I: Input image buffer */
+    short int *out_img,        /* I/O: Output image buffer, with the
+                                       boundary pixels set */
+    int num_rows,              /* I: Number of rows in the image */
+    int num_cols,              /* I: Number of columns in the image */
+    int hmin,                  /* I: Minimum value in the image */
+    int hmax,                  /* I: Maximum value in the image */
+    const SEED_LIST *seeds     /* I: Seed list of all the bands */
+)
+{
+    char *FUNC_NAME = "fill_band";
+    int r, c;
+    int i;
+    PIXEL_QUEUE *pixel_q;
+    unsigned int p;
+    int h_current;
+
+    pixel_q = initialize_pixel_queue(hmin, hmax);
+    if (!pixel_q)
+    {
+        RETURN_ERROR("Allocating pixel queue", FUNC_NAME, ERROR);
+    }
+
+    /* Queue the boundary pixels of this band */
+    for (i = 0; i < seeds->count; i++)
     {
-        while ((p = get_first_pixel_entry(pixel_q, h_current)))
+        p = seeds->pixels[i];
+        if (!is_spreading(in_img, out_img, hmax, p))
+            continue;
+        if (add_pixel(pixel_q, p, out_img[p]) != SUCCESS)
         {
+            free_pixel_queue(pixel_q);
+            RETURN_ERROR("Adding pixel to queue", FUNC_NAME, ERROR);
+        }
+    }
+
+    /* Process until stability, going straight to each level with pixels */
+    h_current = next_pixel_level(pixel_q, hmin);
+    while (h_current < hmax)
+    {
+        while (get_first_pixel_entry(pixel_q, h_current, &p))
+        {
+            int p_row = p / num_cols;
+            int p_col = p - p_row * num_cols;
             int start_row;
             int end_row;
 
-            start_row = IAS_MAX(0, p->i - 1);
-            end_row = IAS_MIN(num_rows, p->i + 2);
+            start_row = IAS_MAX(0, p_row - 1);
+            end_row = IAS_MIN(num_rows, p_row + 2);
 
             for (r = start_row; r < end_row; r++)
             {
-                int start_col = IAS_MAX(0, p->j - 1);
-                int end_col = IAS_MIN(num_cols, p->j + 2);
+                int start_col = IAS_MAX(0, p_col - 1);
+                int end_col = IAS_MIN(num_cols, p_col + 2);
                 const short int *in_row = &in_img[r * num_cols];
                 short int *out_row = &out_img[r * num_cols];
 
@@ -459,7 +1054,7 @@ int fill_local_minima_in_image
                     short int pixel;
 
                     /* Skip the current pixel */
-                    if (r == p->i && c == p->j)
+                    if (r == p_row && c == p_col)
                         continue;
 
                     pixel = in_row[c];
@@ -470,7 +1065,8 @@ int fill_local_minima_in_image
                         out_row[c] = IAS_MAX(h_current, pixel);
                         if (pixel < hmax)
                         {
-                            if (add_pixel(pixel_q, r, c, out_row[c]) != SUCCESS)
+                            if (add_pixel(pixel_q, r * num_cols + c,
+                                          out_row[c]) != SUCCESS)
                             {
                                 free_pixel_queue(pixel_q);
                                 RETURN_ERROR("Adding pixel to queue",
@@ -480,17 +1076,770 @@ int fill_local_minima_in_image
                     }
                 }
             }
-
-            /* Put the element on the free list */
-            p->next = pixel_q->free_list;
-            pixel_q->free_list = p;
         }
-        h_current++;
-    } while (h_current < hmax);
+        h_current = next_pixel_level(pixel_q, h_current + 1);
+    }
 
     free_pixel_queue(pixel_q);
 
-    printf("main minima filling completed for %s band\n", band_name);
+    return SUCCESS;
+}
+
+/*----------------------------------------------------------------------------
+NAME:  can_lower_pixel
+
+PURPOSE: Checks whether a pixel is lowered by a neighbor at the level
+         passed in, the same way the queued fill sets it.
+
+RETURNS: true if the pixel would change
+----------------------------------------------------------------------------*/
+static inline bool can_lower_pixel
+(
+    const short int *in_img,   /* I: Input image buffer */
+    const short int *out_img,  /* I: Output image buffer */
+    int hmax,                  /* I: Maximum value in the image */
+    int pixel,                 /* I: Index of pixel (row * num_cols + col) */
+    int level                  /* I: Level of the neighbor */
+)
+{
+    short int in = in_img[pixel];
+    int value;
+
+    /* Exclude null area of original image */
+    if (in == FILL_PIXEL)
+        return false;
+
+    /* The pixels still at the maximum take the first level reaching them,
+       even above the maximum */
+    value = IAS_MAX(level, in);
+    return value < out_img[pixel]
+           || (out_img[pixel] == hmax && value != hmax);
+}
+
+/*----------------------------------------------------------------------------
+NAME:  sweep_pixel
+
+PURPOSE: Lowers a pixel of a raster sweep from the lowest of the neighbors
+         already swept.
+
+RETURNS: None
+----------------------------------------------------------------------------*/
+static inline void sweep_pixel
+(
+    const short int *in_img,   /* I: Input image buffer */
+    short int *out_img,        /* I/O: Output image buffer */
+    int hmax,                  /* I: Maximum value in the image */
+    int pixel,                 /* I: Index of pixel (row * num_cols + col) */
+    const int *neighbors,      /* I: Neighbors already swept */
+    int num_neighbors          /* I: Number of neighbors */
+)
+{
+    int level = hmax;
+    int i;
+
+    if (in_img[pixel] == FILL_PIXEL)
+        return;
+
+    for (i = 0; i < num_neighbors; i++)
+    {
+        int q = neighbors[i];
+
+        if (is_spreading(in_img, out_img, hmax, q) && out_img[q] < level)
+            level = out_img[q];
+    }
+
+    if (level < hmax && can_lower_pixel(in_img, out_img, hmax, pixel, level))
+        out_img[pixel] = IAS_MAX(level, in_img[pixel]);
+}
+
+/*----------------------------------------------------------------------------
+NAME:  sweep_neighbors
+
+PURPOSE: Lists the neighbors of a pixel which come before it in a raster
+         sweep, forward (rows and columns increasing) or backward.
+
+RETURNS: Number of neighbors
+----------------------------------------------------------------------------*/
+static inline int sweep_neighbors
+(
+    int num_rows,      /* I: Number of rows in the image */
+    int num_cols,      /* I: Number of columns in the image */
+    int row,           /* I: Row of the pixel */
+    int col,           /* I: Column of the pixel */
+    bool forward,      /* I: Forward sweep, else backward */
+    int *neighbors     /* O: Neighbors, at most 4 */
+)
+{
+    int step = forward ? -1 : 1;
+    int prev_row = row + step;
+    int count = 0;
+    int c;
+
+    if (col + step >= 0 && col + step < num_cols)
+        neighbors[count++] = row * num_cols + col + step;
+    if (prev_row >= 0 && prev_row < num_rows)
+    {
+        for (c = IAS_MAX(0, col - 1); c <= IAS_MIN(num_cols - 1, col + 1);
+             c++)
+        {
+            neighbors[count++] = prev_row * num_cols + c;
+        }
+    }
+
+    return count;
+}
+
+/*----------------------------------------------------------------------------
+NAME:  fill_band_hybrid
+
+PURPOSE: Fills one band with the hybrid reconstruction: a forward and a
+         backward raster sweep carry the levels through the image in memory
+         order, then the pixels still able to lower a neighbor are queued
+         and processed until stability.
+
+RETURNS: SUCCESS/ERROR
+
+NOTES:
+1. After the backward sweep, each pixel is stable with respect to the
+   neighbors swept after it, so only the ones which can lower a neighbor
+   swept before it are queued.
+2. The unstable pixels are queued by level, in the same pixel queue as the
+   queued fill, so each is mostly lowered once; a single FIFO lowers the
+   pixels of noisy images several times over.
+3. The pixels are only ever lowered to levels the queued fill reaches them
+   with, and the queue runs until no pixel can lower a neighbor, so the
+   output is the same as the queued fill's.
+----------------------------------------------------------------------------*/
+static int fill_band_hybrid
+(
+    const short int *in_img,   /* I: Input image buffer */
+    short int *out_img,        /* I/O: Output image buffer, with the
+                                       boundary pixels set */
+    int num_rows,              /* I: Number of rows in the image */
+    int num_cols,              /* I: Number of columns in the image */
+    int hmin,                  /* I: Minimum value in the image */
+    int hmax                   /* I: Maximum value in the image */
+)
+{
+    char *FUNC_NAME = "fill_band_hybrid";
+    PIXEL_QUEUE *pixel_q;
+    int forward_offsets[4];
+    int backward_offsets[4];
+    int neighbors[4];
+    int num_neighbors;
+    int r, c;
+    int i;
+    unsigned int p;
+    int h_current;
+
+    /* The neighbors swept before a pixel away from the image edges, in
+       the forward and backward sweeps */
+    forward_offsets[0] = -1;
+    forward_offsets[1] = -num_cols - 1;
+    forward_offsets[2] = -num_cols;
+    forward_offsets[3] = -num_cols + 1;
+    for (i = 0; i < 4; i++)
+        backward_offsets[i] = -forward_offsets[i];
+
+    /* Forward sweep */
+    for (r = 0; r < num_rows; r++)
+    {
+        for (c = 0; c < num_cols; c++)
+        {
+            int pixel = r * num_cols + c;
+
+            if (r > 0 && c > 0 && c < num_cols - 1)
+            {
+                for (i = 0; i < 4; i++)
+                    neighbors[i] = pixel + forward_offsets[i];
+                num_neighbors = 4;
+            }
+            else
+            {
+                num_neighbors = sweep_neighbors(num_rows, num_cols, r, c,
+                                                true, neighbors);
+            }
+            sweep_pixel(in_img, out_img, hmax, pixel, neighbors,
+                        num_neighbors);
+        }
+    }
+
+    pixel_q = initialize_pixel_queue(hmin, hmax);
+    if (!pixel_q)
+    {
+        RETURN_ERROR("Allocating pixel queue", FUNC_NAME, ERROR);
+    }
+
+    /* Backward sweep, queueing the pixels which can still lower one of the
+       neighbors swept before them */
+    for (r = num_rows - 1; r >= 0; r--)
+    {
+        for (c = num_cols - 1; c >= 0; c--)
+        {
+            int pixel = r * num_cols + c;
+
+            if (r < num_rows - 1 && c > 0 && c < num_cols - 1)
+            {
+                for (i = 0; i < 4; i++)
+                    neighbors[i] = pixel + backward_offsets[i];
+                num_neighbors = 4;
+            }
+            else
+            {
+                num_neighbors = sweep_neighbors(num_rows, num_cols, r, c,
+                                                false, neighbors);
+            }
+            sweep_pixel(in_img, out_img, hmax, pixel, neighbors,
+                        num_neighbors);
+            if (!is_spreading(in_img, out_img, hmax, pixel))
+                continue;
+
+            for (i = 0; i < num_neighbors; i++)
+            {
+                if (can_lower_pixel(in_img, out_img, hmax, neighbors[i],
+                                    out_img[pixel]))
+                {
+                    if (add_pixel(pixel_q, pixel, out_img[pixel])
+                        != SUCCESS)
+                    {
+                        free_pixel_queue(pixel_q);
+                        RETURN_ERROR("Adding pixel to queue", FUNC_NAME,
+                                     ERROR);
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    /* Lower the neighbors of the queued pixels until stability.  A pixel
+       lowered after it was queued is processed at its lower level first,
+       and again to no effect at the level it was queued at. */
+    h_current = next_pixel_level(pixel_q, hmin);
+    while (h_current < hmax)
+    {
+        while (get_first_pixel_entry(pixel_q, h_current, &p))
+        {
+            int p_row = p / num_cols;
+            int p_col = p - p_row * num_cols;
+            int level = out_img[p];
+
+            for (r = IAS_MAX(0, p_row - 1);
+                 r < IAS_MIN(num_rows, p_row + 2); r++)
+            {
+                for (c = IAS_MAX(0, p_col - 1);
+                     c < IAS_MIN(num_cols, p_col + 2); c++)
+                {
+                    int pixel = r * num_cols + c;
+
+                    if (!can_lower_pixel(in_img, out_img, hmax, pixel,
+                                         level))
+                    {
+                        continue;
+                    }
+
+                    out_img[pixel] = IAS_MAX(level, in_img[pixel]);
+                    if (in_img[pixel] < hmax
+                        && add_pixel(pixel_q, pixel, out_img[pixel])
+                           != SUCCESS)
+                    {
+                        free_pixel_queue(pixel_q);
+                        RETURN_ERROR("Adding pixel to queue", FUNC_NAME,
+                                     ERROR);
+                    }
+                }
+            }
+        }
+        h_current = next_pixel_level(pixel_q, h_current + 1);
+    }
+
+    free_pixel_queue(pixel_q);
+
+    return SUCCESS;
+}
+
+/*----------------------------------------------------------------------------
+NAME:  find_value_ranges
+
+PURPOSE: Finds the min and max values of each image, leaving them at 32767
+         and -32767 for an image which is entirely fill.
+
+RETURNS: None
+----------------------------------------------------------------------------*/
+static void find_value_ranges
+(
+    int num_bands,                   /* I: Number of images */
+    const short int *const *in_imgs, /* I: Input image buffers */
+    int pixel_count,                 /* I: Number of pixels in each image */
+    int *hmin,                       /* O: Minimum value of each image */
+    int *hmax                        /* O: Maximum value of each image */
+)
+{
+    int band;
+    int i;
+
+    for (band = 0; band < num_bands; band++)
+    {
+        hmin[band] = 32767;
+        hmax[band] = -32767;
+    }
+
+    for (i = 0; i < pixel_count; i++)
+    {
+        for (band = 0; band < num_bands; band++)
+        {
+            short int value = in_imgs[band][i];
+
+            if (value == FILL_PIXEL)
+                continue;    /* Fill data */
+            if (value < hmin[band])
+                hmin[band] = value;
+            else if (value > hmax[band])
+                hmax[band] = value;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------
+NAME:  fill_local_minima_in_images
+
+PURPOSE: Fill all local minima in several input images of the same size,
+         such as the bands of a scene.  Each image is filled with the
+         reconstruction-by-erosion algorithm, but the boundary pixels next
+         to the fill of all the images are found in a single pass over the
+         images, which also sets the starting output values.
+
+RETURN: SUCCESS/ERROR
+
+NOTES:
+1. The images may have fill in different places; a pixel only starts the
+   fill of the images with fill next to it.
+2. Both fill engines give the same output.  The queued fill splits each
+   band into tiles between the threads, while the hybrid fill sweeps the
+   bands at the same time.
+----------------------------------------------------------------------------*/
+int fill_local_minima_in_images
+(
+    int num_bands,                   /* I: Number of images to fill, up to
+                                           FILL_MAX_BANDS */
+    const char *const *band_names,   /* I: Band name of each image */
+    const short int *const *in_imgs, /* I: Input image buffers */
+    int num_rows,                    /* I: Number of rows in the images */
+    int num_cols,                    /* I: Number of columns in the images */
+    const float *boundary_vals,      /* I: Background (land) percentage of
+                                           each image */
+    int fill_engine,                 /* I: FILL_ENGINE_* used for the fill */
+    short int *const *out_imgs       /* O: Output image buffers */
+)
+{
+    char *FUNC_NAME = "fill_local_minima_in_images";
+    int r, c;
+    int i;
+    int band;
+    int hmin[FILL_MAX_BANDS];
+    int hmax[FILL_MAX_BANDS];
+    float boundary_val[FILL_MAX_BANDS];
+    unsigned int all_bands;
+    bool use_tiles = false;
+    int num_lists = 1;
+    SEED_LIST *lists;
+    SEED_LIST seeds;
+    unsigned int *tile_seeds = NULL;
+    int *tile_first_seed = NULL;
+    int status;
+    int pixel_count = num_rows * num_cols;
+
+    if (num_bands < 1 || num_bands > FILL_MAX_BANDS)
+    {
+        RETURN_ERROR("Invalid number of bands", FUNC_NAME, ERROR);
+    }
+    all_bands = (1U << num_bands) - 1;
+
+    for (band = 0; band < num_bands; band++)
+        printf("minima filling setup for %s band\n", band_names[band]);
+
+    /* Find the min and max values in the input buffers. */
+    find_value_ranges(num_bands, in_imgs, pixel_count, hmin, hmax);
+
+    for (band = 0; band < num_bands; band++)
+    {
+        /* If hmin and hmax values have not changed, entire image is fill. */
+        if (hmin[band] == 32767 && hmax[band] == -32767)
+        {
+            RETURN_ERROR("Entire image is fill", FUNC_NAME, ERROR);
+        }
+
+        /* If the boundary value is set to zero, use the maximum value. */
+        boundary_val[band] = boundary_vals[band];
+        if (boundary_val[band] == 0)
+            boundary_val[band] = hmax[band];
+    }
+
+    /* With more than one thread the images are filled a tile at a time */
+#ifdef _OPENMP
+    use_tiles = omp_get_max_threads() > 1;
+    if (use_tiles)
+        num_lists = omp_get_max_threads();
+#endif
+    lists = calloc(num_lists, sizeof(SEED_LIST));
+    if (lists == NULL)
+    {
+        RETURN_ERROR("Allocating the seed lists", FUNC_NAME, ERROR);
+    }
+
+    /* Set the starting output values and find the boundary pixels of all
+       the bands.  Each thread lists the boundary pixels of its own rows,
+       which follow the rows of the threads before it. */
+    status = SUCCESS;
+#ifdef _OPENMP
+    #pragma omp parallel private(r, c, band) if (use_tiles)
+#endif
+    {
+        SEED_LIST *list = &lists[0];
+
+#ifdef _OPENMP
+        list = &lists[omp_get_thread_num()];
+        #pragma omp for schedule(static)
+#endif
+        for (r = 0; r < num_rows; r++)
+        {
+            for (c = 0; c < num_cols; c++)
+            {
+                int pixel = r * num_cols + c;
+                unsigned int fill_bands = 0;
+                bool seed = false;
+
+                for (band = 0; band < num_bands; band++)
+                {
+                    if (in_imgs[band][pixel] == FILL_PIXEL)
+                        fill_bands |= 1U << band;
+                }
+
+                /* If the 3x3 kernel has any fill pixels, it is a boundary
+                   pixel of the bands which aren't fill themselves */
+                if (fill_bands != all_bands)
+                {
+                    fill_bands = kernel_fill_bands(in_imgs, num_bands,
+                                                   num_rows, num_cols, r, c);
+                }
+
+                for (band = 0; band < num_bands; band++)
+                {
+                    short int *out = &out_imgs[band][pixel];
+
+                    if (in_imgs[band][pixel] == FILL_PIXEL)
+                    {
+                        /* Set the filled image to a fill pixel */
+                        *out = FILL_PIXEL;
+                    }
+                    else if (fill_bands & (1U << band))
+                    {
+                        /* Same check as adding the pixel to the queue */
+                        if ((int)boundary_val[band] < hmin[band]
+                            || (int)boundary_val[band] > hmax[band])
+                        {
+#ifdef _OPENMP
+                            #pragma omp atomic write
+#endif
+                            status = ERROR;
+                        }
+                        *out = boundary_val[band];
+                        seed = true;
+                    }
+                    else
+                        *out = hmax[band];
+                }
+
+                if (seed && add_seed(list, pixel) != SUCCESS)
+                {
+#ifdef _OPENMP
+                    #pragma omp atomic write
+#endif
+                    status = ERROR;
+                }
+            }
+        }
+    }
+
+    /* Join the lists of the threads */
+    seeds.count = 0;
+    for (i = 0; i < num_lists; i++)
+        seeds.count += lists[i].count;
+    seeds.size = seeds.count;
+    seeds.pixels = malloc(IAS_MAX(seeds.count, 1) * sizeof(unsigned int));
+    if (seeds.pixels == NULL)
+        status = ERROR;
+    else
+    {
+        seeds.count = 0;
+        for (i = 0; i < num_lists; i++)
+        {
+            if (lists[i].count > 0)
+            {
+                memcpy(&seeds.pixels[seeds.count], lists[i].pixels,
+                       lists[i].count * sizeof(unsigned int));
+            }
+            seeds.count += lists[i].count;
+        }
+    }
+    for (i = 0; i < num_lists; i++)
+        free(lists[i].pixels);
+    free(lists);
+    if (status != SUCCESS)
+    {
+        free(seeds.pixels);
+        RETURN_ERROR("Adding pixel to queue", FUNC_NAME, ERROR);
+    }
+
+    if (fill_engine == FILL_ENGINE_HYBRID)
+    {
+        /* The sweeps go through a band in order, so the bands are filled
+           at the same time instead */
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 1) if (use_tiles)
+#endif
+        for (band = 0; band < num_bands; band++)
+        {
+            printf("main minima filling started for %s band\n",
+                   band_names[band]);
+
+            if (fill_band_hybrid(in_imgs[band], out_imgs[band], num_rows,
+                                 num_cols, hmin[band], hmax[band])
+                != SUCCESS)
+            {
+#ifdef _OPENMP
+                #pragma omp atomic write
+#endif
+                status = ERROR;
+                continue;
+            }
+
+            printf("main minima filling completed for %s band\n",
+                   band_names[band]);
+        }
+    }
+    else
+    {
+        /* The tiles take their seeds from the same sorted list for all the
+           bands */
+        if (use_tiles)
+        {
+            int tile_rows = (num_rows + FILL_TILE_SIZE - 1) / FILL_TILE_SIZE;
+            int tile_cols = (num_cols + FILL_TILE_SIZE - 1) / FILL_TILE_SIZE;
+
+            status = sort_tile_seeds(&seeds, num_cols, tile_cols,
+                                     tile_rows * tile_cols, &tile_seeds,
+                                     &tile_first_seed);
+        }
+
+        for (band = 0; band < num_bands && status == SUCCESS; band++)
+        {
+            printf("main minima filling started for %s band\n",
+                   band_names[band]);
+
+            if (use_tiles)
+            {
+                status = fill_band_in_tiles(in_imgs[band], out_imgs[band],
+                                            num_rows, num_cols, hmin[band],
+                                            hmax[band], tile_seeds,
+                                            tile_first_seed);
+            }
+            else
+            {
+                status = fill_band(in_imgs[band], out_imgs[band], num_rows,
+                                   num_cols, hmin[band], hmax[band],
+                                   &seeds);
+            }
+
+            if (status == SUCCESS)
+            {
+                printf("main minima filling completed for %s band\n",
+                       band_names[band]);
+            }
+        }
+    }
+
+    free(seeds.pixels);
+    free(tile_seeds);
+    free(tile_first_seed);
+
+    if (status != SUCCESS)
+    {
+        RETURN_ERROR("Filling the bands", FUNC_NAME, ERROR);
+    }
+
+    return SUCCESS;
+}
+
+/*----------------------------------------------------------------------------
+NAME:  fill_local_minima_approx
+
+PURPOSE: Fill the local minima of several images approximately, on images
+         reduced by a block size.  Each block of the images is reduced to
+         the lowest of its values, the reduced images are filled, and each
+         pixel takes the filled value of its block, but never below its own
+         value.
+
+RETURN: SUCCESS/ERROR
+
+NOTES:
+1. A block is only fill if all its pixels are.
+2. The reduced images can have a lower maximum than the full images, so
+   the boundary values are kept within the values of the reduced images.
+----------------------------------------------------------------------------*/
+int fill_local_minima_approx
+(
+    int num_bands,                   /* I: Number of images to fill, up to
+                                           FILL_MAX_BANDS */
+    const char *const *band_names,   /* I: Band name of each image */
+    const short int *const *in_imgs, /* I: Input image buffers */
+    int num_rows,                    /* I: Number of rows in the images */
+    int num_cols,                    /* I: Number of columns in the images */
+    const float *boundary_vals,      /* I: Background (land) percentage of
+                                           each image */
+    int fill_engine,                 /* I: FILL_ENGINE_* used for the fill */
+    int scale,                       /* I: Number of rows and columns in
+                                           each block */
+    short int *const *out_imgs       /* O: Output image buffers */
+)
+{
+    char *FUNC_NAME = "fill_local_minima_approx";
+    short int *coarse_in[FILL_MAX_BANDS];
+    short int *coarse_out[FILL_MAX_BANDS];
+    int hmin[FILL_MAX_BANDS];
+    int hmax[FILL_MAX_BANDS];
+    float boundary_val[FILL_MAX_BANDS];
+    int coarse_rows;
+    int coarse_cols;
+    int status;
+    int band;
+    int r;
+
+    if (scale <= 1)
+    {
+        return fill_local_minima_in_images(num_bands, band_names, in_imgs,
+                                           num_rows, num_cols, boundary_vals,
+                                           fill_engine, out_imgs);
+    }
+    if (num_bands < 1 || num_bands > FILL_MAX_BANDS)
+    {
+        RETURN_ERROR("Invalid number of bands", FUNC_NAME, ERROR);
+    }
+
+    coarse_rows = (num_rows + scale - 1) / scale;
+    coarse_cols = (num_cols + scale - 1) / scale;
+    status = SUCCESS;
+    for (band = 0; band < num_bands; band++)
+    {
+        coarse_in[band] = malloc(coarse_rows * coarse_cols
+                                 * sizeof(short int));
+        coarse_out[band] = malloc(coarse_rows * coarse_cols
+                                  * sizeof(short int));
+        if (coarse_in[band] == NULL || coarse_out[band] == NULL)
+            status = ERROR;
+    }
+    if (status != SUCCESS)
+    {
+        for (band = 0; band < num_bands; band++)
+        {
+            free(coarse_in[band]);
+            free(coarse_out[band]);
+        }
+        RETURN_ERROR("Allocating the reduced images", FUNC_NAME, ERROR);
+    }
+
+    /* Reduce each block to the lowest of its values */
+#ifdef _OPENMP
+    #pragma omp parallel for private(band)
+#endif
+    for (r = 0; r < coarse_rows; r++)
+    {
+        int end_row = IAS_MIN(num_rows, (r + 1) * scale);
+        int c;
+
+        for (c = 0; c < coarse_cols; c++)
+        {
+            int end_col = IAS_MIN(num_cols, (c + 1) * scale);
+
+            for (band = 0; band < num_bands; band++)
+            {
+                short int lowest = FILL_PIXEL;
+                int row, col;
+
+                for (row = r * scale; row < end_row; row++)
+                {
+                    const short int *in_row = &in_imgs[band][row * num_cols];
+
+                    for (col = c * scale; col < end_col; col++)
+                    {
+                        if (in_row[col] != FILL_PIXEL
+                            && (lowest == FILL_PIXEL || in_row[col] < lowest))
+                        {
+                            lowest = in_row[col];
+                        }
+                    }
+                }
+                coarse_in[band][r * coarse_cols + c] = lowest;
+            }
+        }
+    }
+
+    /* Keep the boundary values within the reduced images */
+    find_value_ranges(num_bands, (const short int *const *)coarse_in,
+                      coarse_rows * coarse_cols, hmin, hmax);
+    for (band = 0; band < num_bands; band++)
+    {
+        boundary_val[band] = boundary_vals[band];
+        if (boundary_val[band] != 0 && hmin[band] <= hmax[band])
+        {
+            boundary_val[band] = IAS_MAX(boundary_val[band], hmin[band]);
+            boundary_val[band] = IAS_MIN(boundary_val[band], hmax[band]);
+        }
+    }
+
+    status = fill_local_minima_in_images(num_bands, band_names,
+                 (const short int *const *)coarse_in, coarse_rows,
+                 coarse_cols, boundary_val, fill_engine, coarse_out);
+
+    /* Give each pixel the filled value of its block */
+    if (status == SUCCESS)
+    {
+#ifdef _OPENMP
+        #pragma omp parallel for private(band)
+#endif
+        for (r = 0; r < num_rows; r++)
+        {
+            const short int *coarse_row;
+            int c;
+
+            for (band = 0; band < num_bands; band++)
+            {
+                const short int *in_row = &in_imgs[band][r * num_cols];
+                short int *out_row = &out_imgs[band][r * num_cols];
+
+                coarse_row = &coarse_out[band][(r / scale) * coarse_cols];
+                for (c = 0; c < num_cols; c++)
+                {
+                    if (in_row[c] == FILL_PIXEL)
+                        out_row[c] = FILL_PIXEL;
+                    else
+                        out_row[c] = IAS_MAX(coarse_row[c / scale],
+                                             in_row[c]);
+                }
+            }
+        }
+    }
+
+    for (band = 0; band < num_bands; band++)
+    {
+        free(coarse_in[band]);
+        free(coarse_out[band]);
+    }
+
+    if (status != SUCCESS)
+    {
+        RETURN_ERROR("Filling the reduced images", FUNC_NAME, ERROR);
+    }
 
     return SUCCESS;
 }
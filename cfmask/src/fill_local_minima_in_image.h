@@ -2,14 +2,38 @@
 #define FILL_LOCAL_MINIMA_IN_IMAGE_H
 
 
-int fill_local_minima_in_image
+/* Maximum number of images filled together */
+#define FILL_MAX_BANDS 8
+
+
+int fill_local_minima_in_images
+(
+    int num_bands,                   /* I: Number of images to fill, up to
+                                           FILL_MAX_BANDS */
+    const char *const *band_names,   /* I: Band name of each image */
+    const short int *const *in_imgs, /* I: Input image buffers */
+    int num_rows,                    /* I: Number of rows in the images */
+    int num_cols,                    /* I: Number of columns in the images */
+    const float *boundary_vals,      /* I: Background (land) percentage of
+                                           each image */
+    int fill_engine,                 /* I: FILL_ENGINE_* used for the fill */
+    short int *const *out_imgs       /* O: Output image buffers */
+);
+
+int fill_local_minima_approx
 (
-    const char *band_name,   /* I: Band name being filled */
-    const short int *in_img, /* I: Input image buffer */
-    int num_rows,            /* I: Number of rows in the input image */
-    int num_cols,            /* I: Number of columns in the input image */
-    float boundary_val,      /* I: Background (land) percentage */
-    short int *out_img       /* O: Output image buffer */
+    int num_bands,                   /* I: Number of images to fill, up to
+                                           FILL_MAX_BANDS */
+    const char *const *band_names,   /* I: Band name of each image */
+    const short int *const *in_imgs, /* I: Input image buffers */
+    int num_rows,                    /* I: Number of rows in the images */
+    int num_cols,                    /* I: Number of columns in the images */
+    const float *boundary_vals,      /* I: Background (land) percentage of
+                                           each image */
+    int fill_engine,                 /* I: FILL_ENGINE_* used for the fill */
+    int scale,                       /* I: Number of rows and columns in
+                                           each block */
+    short int *const *out_imgs       /* O: Output image buffers */
 );
 
 
@@ -1,4 +1,3 @@
-
 /*
     NOTE: Taken from IAS_3_6_0_IT and modified a bit for logging and such
           related items.  Tried to keep as identical as possible.
@@ -7,24 +6,30 @@
 /* System Includes */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 
 /* Local Includes */
 #include "const.h"
 #include "error.h"
 #include "identify_clouds.h"
 
+/* Define the number of rows in each strip of the mask labeled by a thread */
+#define CLOUD_STRIP_ROWS 256
+
 /*****************************************************************************
 Name: create_cloud_runs
 
 Purpose: Given a pixel mask, generate the set of run-length encoded line
-    segments that cover the clouds.
+    segments that cover the clouds in a range of rows.
 
 Returns: SUCCESS/ERROR
 *****************************************************************************/
 static int create_cloud_runs
 (
     unsigned char *pixel_mask, /* I: Cloud pixel mask */
-    int nrows,                 /* I: Number of rows */
+    int first_row,             /* I: First row to encode */
+    int end_row,               /* I: Row after the last row to encode */
     int ncols,                 /* I: Number of columns */
     RLE_T **cloud_runs,        /* I/O: Array of cloud runs */
     int *out_run_count         /* O: Count of cloud runs found */
@@ -41,7 +46,7 @@ static int create_cloud_runs
     *cloud_runs = NULL;
 
     /* Loop over all the rows */
-    for (row = 0; row < nrows; row++)
+    for (row = first_row; row < end_row; row++)
     {
         int col;
         const unsigned char *mask_row = &pixel_mask[row * ncols];
@@ -62,7 +67,7 @@ static int create_cloud_runs
 
             /* Found a starting cloud pixel, so find the length of the cloud
                run */
-            for (run_len = 1; run_len < ncols; run_len++)
+            for (run_len = 1; col + run_len < ncols; run_len++)
             {
                 if (!(mask_row[col + run_len] & CF_CLOUD_BIT))
                     break;
@@ -100,16 +105,6 @@ static int create_cloud_runs
         }
     }
 
-    /* Use realloc to shrink set of runs to the actual number found */
-    temp_runs = realloc(runs, run_count * sizeof(*runs));
-    if (!temp_runs)
-    {
-        free(runs);
-        RETURN_ERROR("Failed shrinking cloud pixel run allocation",
-                     FUNC_NAME, ERROR);
-    }
-    runs = temp_runs;
-
     *cloud_runs = runs;
     *out_run_count = run_count;
 
@@ -117,6 +112,130 @@ static int create_cloud_runs
 }
 
 
+/*****************************************************************************
+Name: find_run
+
+Purpose: Find the run a run was joined to, halving the path to it along the
+    way.
+
+Returns: The first run of the cloud holding the run
+*****************************************************************************/
+static inline int find_run
+(
+    int *run_parent,    /* I/O: Run each run was joined to, or itself */
+    int run_index       /* I: Run to look up */
+)
+{
+    while (run_parent[run_index] != run_index)
+    {
+        run_parent[run_index] = run_parent[run_parent[run_index]];
+        run_index = run_parent[run_index];
+    }
+
+    return run_index;
+}
+
+
+/*****************************************************************************
+Name: join_overlapping_runs
+
+Purpose: Join the runs of a row to the runs of the previous row they touch.
+    The clouds are always joined to their earliest run, so the run a cloud
+    ends up at doesn't depend on the order the joins were made in.
+
+Returns: None
+*****************************************************************************/
+static void join_overlapping_runs
+(
+    RLE_T *runs,        /* I: Array of cloud runs */
+    int *run_parent,    /* I/O: Run each run was joined to, or itself */
+    int prev_first,     /* I: First run of the previous row */
+    int prev_end,       /* I: Run after the last run of the previous row */
+    int cur_first,      /* I: First run of the row */
+    int cur_end         /* I: Run after the last run of the row */
+)
+{
+    int prev_index = prev_first;
+    int run_index;
+
+    for (run_index = cur_first; run_index < cur_end; run_index++)
+    {
+        RLE_T *run = &runs[run_index];
+        int end_col = run->start_col + run->col_count;
+        int index;
+
+        /* Skip the runs of the previous row that end before this one starts.
+           Note that the overlap includes cloud pixels on the diagonal, so a
+           run ending just before this one starts still touches it. */
+        while (prev_index < prev_end
+               && runs[prev_index].start_col + runs[prev_index].col_count
+                  < run->start_col)
+        {
+            prev_index++;
+        }
+
+        /* Join with every run of the previous row touching this one; the
+           last of them may touch the next run in this row too, so it isn't
+           skipped */
+        for (index = prev_index;
+             index < prev_end && runs[index].start_col <= end_col; index++)
+        {
+            int root = find_run(run_parent, run_index);
+            int prev_root = find_run(run_parent, index);
+
+            if (prev_root < root)
+                run_parent[root] = prev_root;
+            else if (root < prev_root)
+                run_parent[prev_root] = root;
+        }
+    }
+}
+
+
+/*****************************************************************************
+Name: join_strip_runs
+
+Purpose: Join the touching runs of each pair of consecutive rows in a strip.
+
+Returns: None
+*****************************************************************************/
+static void join_strip_runs
+(
+    RLE_T *runs,        /* I: Array of cloud runs */
+    int *run_parent,    /* I/O: Run each run was joined to, or itself */
+    int first_run,      /* I: First run of the strip */
+    int end_run         /* I: Run after the last run of the strip */
+)
+{
+    int prev_first = first_run;
+    int prev_end = first_run;
+    int run_index;
+
+    for (run_index = first_run; run_index < end_run; run_index++)
+        run_parent[run_index] = run_index;
+
+    run_index = first_run;
+    while (run_index < end_run)
+    {
+        int row = runs[run_index].row;
+        int row_end = run_index;
+
+        while (row_end < end_run && runs[row_end].row == row)
+            row_end++;
+
+        if (prev_end > prev_first && runs[prev_first].row == row - 1)
+        {
+            join_overlapping_runs(runs, run_parent, prev_first, prev_end,
+                                  run_index, row_end);
+        }
+
+        prev_first = run_index;
+        prev_end = row_end;
+        run_index = row_end;
+    }
+}
+
+
 /*****************************************************************************
 Name: identify_clouds
 
@@ -124,263 +243,331 @@ Purpose: Given a pixel mask identifying individual pixels as clouds, group
     the individual pixels into cloud objects using run-length encoding.
 
 Notes:
-    - cloud number zero is reserved for the "no cloud" condition
+    - the clouds are recorded from index zero, since there is no image of
+      the cloud numbers that needs a "no cloud" number
+    - the mask is encoded and the runs joined a strip of rows at a time in
+      parallel, then the runs on each side of the seams between the strips
+      are joined
+    - the clouds are numbered in the order of their first run, and the runs
+      of each cloud are listed in image order, so the results don't depend
+      on the number of threads
+    - the size, bounding box and temperature range of each cloud are found
+      as the clouds are numbered, and the small clouds are dropped there, so
+      the callers don't have to walk the runs again for them
 
 Returns: SUCCESS/ERROR
 *****************************************************************************/
 int identify_clouds
 (
     unsigned char *pixel_mask,   /* I: Cloud pixel mask */
+    int16 *temp_data,            /* I: Brightness temperature of each pixel;
+                                       NULL if there is no thermal data */
     int nrows,                   /* I: Number of rows */
     int ncols,                   /* I: Number of columns */
+    int min_cloud_pixels,        /* I: Clouds of this many pixels or fewer
+                                       are dropped */
     RLE_T **out_cloud_runs,      /* O: Array of cloud run-length encoded
                                        segments */
-    int **out_cloud_lookup,      /* O: Array to map clouds to cloud runs */
-    int **out_cloud_pixel_count, /* O: Cloud number */
-    int *out_cloud_count,        /* O: Number of clouds in the cloud_lookup
-                                       and cloud_pixel_count arrays */
-    int *cloud_map               /* I/O: Image containing the cloud number for
-                                         each pixel */
+    CLOUD_T **out_clouds,        /* O: Array of the records of the clouds */
+    int *out_cloud_count,        /* O: Number of clouds in the clouds array */
+    int *out_small_cloud_count   /* O: Number of clouds that were dropped */
 )
 {
     char *FUNC_NAME = "identify_clouds";
     RLE_T *runs = NULL;
-    int run_count;
-    int *cloud_lookup = NULL;  /* Array that points to the first RLE for each
+    RLE_T **strip_runs = NULL; /* Array of the cloud runs of each strip */
+    int *strip_first = NULL;   /* Array of the first run of each strip, and
+                                  the run count at the end */
+    int *run_parent = NULL;    /* Array of the run each run was joined to, or
+                                  the run itself */
+    int *run_cloud = NULL;     /* Array of the cloud number of each run */
+    CLOUD_T *clouds = NULL;    /* Array of the cloud records */
+    CLOUD_T *temp_clouds;
+    int *cloud_last = NULL;    /* Array that points to the last RLE for each
                                   cloud number */
-    int *temp_ptr;
-    int next_cloud_number = 1;
+    long total_runs;
+    int run_count;
+    int num_strips;
+    int strip;
     int run_index;
     int cloud_index;
-    int cloud_count;
-    int *cloud_pixel_count = NULL;
+    int cloud_count = 0;
+    int kept_count;
+    int failed = 0;
 
     *out_cloud_runs = NULL;
-    *out_cloud_lookup = NULL;
-    *out_cloud_pixel_count = NULL;
+    *out_clouds = NULL;
     *out_cloud_count = 0;
+    *out_small_cloud_count = 0;
 
-    /* Identify the set of "runs" of cloud pixels */
-    if (create_cloud_runs(pixel_mask, nrows, ncols, &runs, &run_count)
-        != SUCCESS)
-    {
-        RETURN_ERROR("Failed identifying clouds", FUNC_NAME, ERROR);
-    }
-
-    /* If no runs of clouds found, no need to do anything else */
-    if (run_count == 0)
+    num_strips = (nrows + CLOUD_STRIP_ROWS - 1) / CLOUD_STRIP_ROWS;
+    if (num_strips == 0)
         return SUCCESS;
 
-    /* Allocate the cloud lookup table sized to assume each run is a separate
-       cloud */
-    cloud_lookup = malloc((1 + run_count) * sizeof(*cloud_lookup));
-    if (!cloud_lookup)
+    strip_runs = calloc(num_strips, sizeof(*strip_runs));
+    strip_first = malloc((num_strips + 1) * sizeof(*strip_first));
+    if (!strip_runs || !strip_first)
     {
-        free(runs);
-        RETURN_ERROR("Failed allocating cloud lookup table",
+        free(strip_runs);
+        free(strip_first);
+        RETURN_ERROR("Allocating memory for identifying clouds",
                      FUNC_NAME, ERROR);
     }
 
-    /* The first entry in the lookup is reserved for "no clouds" */
-    cloud_lookup[0] = -1;
-
-    /* Walk the cloud runs to group them into clouds */
-    for (run_index = 0; run_index < run_count; run_index++)
+    /* Identify the set of "runs" of cloud pixels in each strip */
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1) reduction(||:failed)
+#endif
+    for (strip = 0; strip < num_strips; strip++)
     {
-        RLE_T *run = &runs[run_index];
-        int use_next = 1;
-        int assigned_cloud_number = 0;
-        int end_col = run->start_col + run->col_count;
-
-        /* Check for overlap with clouds from the previous row if not the
-           first row.  Note that the overlap includes cloud pixels on the
-           diagonal, so the column range for the check includes an extra pixel
-           on both ends. */
-        if (run->row > 0)
+        int first_row = strip * CLOUD_STRIP_ROWS;
+        int end_row = first_row + CLOUD_STRIP_ROWS;
+        if (end_row > nrows)
+            end_row = nrows;
+
+        if (create_cloud_runs(pixel_mask, first_row, end_row, ncols,
+                              &strip_runs[strip], &strip_first[strip + 1])
+            != SUCCESS)
         {
-            int *prev_cloud_map_row = &cloud_map[(run->row - 1) * ncols];
-            int col;
-            int start = run->start_col - 1;
-            if (start < 0)
-                start = 0;
+            failed = 1;
+        }
+    }
 
-            for (col = start; col <= end_col; col++)
-            {
-                int cloud_number = prev_cloud_map_row[col];
+    /* Find where the runs of each strip start in the full set */
+    total_runs = 0;
+    if (!failed)
+    {
+        for (strip = 0; strip < num_strips; strip++)
+        {
+            int strip_count = strip_first[strip + 1];
 
-                /* Check for a cloud in the previous row */
-                if (cloud_number != 0)
-                {
-                    int fill_col;
-                    int *cloud_map_row = &cloud_map[run->row * ncols];
-
-                    /* Found a cloud, so assign this run to that cloud */
-                    run->next_index = cloud_lookup[cloud_number];
-                    cloud_lookup[cloud_number] = run_index;
-
-                    /* Set this cloud number for the run in the cloud map */
-                    for (fill_col = run->start_col; fill_col < end_col;
-                        fill_col++)
-                    {
-                        cloud_map_row[fill_col] = cloud_number;
-                    }
-
-                    /* Assigned a cloud number, so no need to look */
-                    assigned_cloud_number = cloud_number;
-                    use_next = 0;
-                    break;
-                }
-            }
+            strip_first[strip] = (int)total_runs;
+            total_runs += strip_count;
+            if (total_runs >= INT_MAX)
+                break;
+        }
+    }
+    run_count = (int)total_runs;
+    strip_first[num_strips] = run_count;
 
-            /* If an overlapping cloud from the previous row was found, look
-               for additional overlapping clouds to merge with, continuing at
-               the next column */
-            for (col = col + 1; col <= end_col; col++)
+    /* Gather the runs of the strips in image order */
+    if (!failed && total_runs < INT_MAX && run_count > 0)
+    {
+        runs = malloc(run_count * sizeof(*runs));
+        if (runs)
+        {
+#ifdef _OPENMP
+            #pragma omp parallel for schedule(dynamic, 1)
+#endif
+            for (strip = 0; strip < num_strips; strip++)
             {
-                int cloud_number = prev_cloud_map_row[col];
-
-                /* Check for a cloud in the previous row */
-                if (cloud_number != 0 && cloud_number != assigned_cloud_number)
-                {
-                    int fill_col;
-                    int last_index;
-                    int *cloud_map_row = &cloud_map[run->row * ncols];
-
-                    /* Found another cloud to merge with, so renumber the
-                       newly found cloud to match this number.  The cloud map
-                       update is "lazy" since it just updates the cloud
-                       numbers in the previous row and pixels to the left in
-                       the current row.  A final pass will update the
-                       cloud_map to make sure it has the correct cloud numbers
-                       for every pixel */
-                    for (fill_col = 0; fill_col < ncols; fill_col++)
-                    {
-                        if (prev_cloud_map_row[fill_col] == cloud_number)
-                        {
-                            prev_cloud_map_row[fill_col]
-                                = assigned_cloud_number;
-                        }
-                    }
-
-                    /* Also fill the pixels on the current row that may belong
-                       to the same cloud */
-                    for (fill_col = 0; fill_col < col; fill_col++)
-                    {
-                        if (cloud_map_row[fill_col] == cloud_number)
-                        {
-                            cloud_map_row[fill_col] = assigned_cloud_number;
-                        }
-                    }
-
-                    /* Find the last node in the cloud being merged */
-                    last_index = cloud_lookup[cloud_number];
-                    while (runs[last_index].next_index != -1)
-                    {
-                        last_index = runs[last_index].next_index;
-                    }
-
-                    /* Merge the newly found cloud list into the current
-                       cloud's list */
-                    runs[last_index].next_index
-                        = cloud_lookup[assigned_cloud_number];
-                    cloud_lookup[assigned_cloud_number]
-                        = cloud_lookup[cloud_number];
-                    cloud_lookup[cloud_number] = -1;
-                }
+                memcpy(&runs[strip_first[strip]], strip_runs[strip],
+                       (strip_first[strip + 1] - strip_first[strip])
+                       * sizeof(*runs));
             }
         }
+    }
+    for (strip = 0; strip < num_strips; strip++)
+        free(strip_runs[strip]);
+    free(strip_runs);
 
-        /* If no cloud number was assigned, use the next one */
-        if (use_next)
-        {
-            int fill_col;
-            int *cloud_map_row = &cloud_map[run->row * ncols];
+    if (failed)
+    {
+        free(strip_first);
+        RETURN_ERROR("Failed identifying clouds", FUNC_NAME, ERROR);
+    }
 
-            for (fill_col = run->start_col; fill_col < end_col; fill_col++)
-            {
-                cloud_map_row[fill_col] = next_cloud_number;
-            }
+    /* Make sure we never overflow the capacity of the cloud counter since
+       that would break this implementation.  This is incredibly unlikely
+       since it would require much larger scenes than are currently
+       processed. */
+    if (total_runs >= INT_MAX)
+    {
+        free(strip_first);
+        RETURN_ERROR("Too many clouds identified", FUNC_NAME, ERROR);
+    }
 
-            run->next_index = -1;
-            cloud_lookup[next_cloud_number] = run_index;
+    /* If no runs of clouds found, no need to do anything else */
+    if (run_count == 0)
+    {
+        free(strip_first);
+        return SUCCESS;
+    }
 
-            next_cloud_number++;
+    run_parent = malloc(run_count * sizeof(*run_parent));
+    run_cloud = malloc(run_count * sizeof(*run_cloud));
+    if (!runs || !run_parent || !run_cloud)
+    {
+        free(strip_first);
+        free(run_parent);
+        free(run_cloud);
+        free(runs);
+        RETURN_ERROR("Allocating memory for identifying clouds",
+                     FUNC_NAME, ERROR);
+    }
 
-            /* Make sure we never overflow the capacity of the cloud counter
-               since that would break this implementation.  This is incredibly
-               unlikely since it would require much larger scenes than are
-               currently processed. */
-            if (next_cloud_number < 0)
-            {
-                free(cloud_lookup);
-                free(runs);
-                RETURN_ERROR("Too many clouds identified", FUNC_NAME, ERROR);
-            }
-        }
+    /* Join the touching runs inside each strip */
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for (strip = 0; strip < num_strips; strip++)
+    {
+        join_strip_runs(runs, run_parent, strip_first[strip],
+                        strip_first[strip + 1]);
     }
 
-    /* Condense the cloud lookup table */
-    cloud_count = next_cloud_number;
-    next_cloud_number = 1;
-    for (cloud_index = 1; cloud_index < cloud_count; cloud_index++)
+    /* Join the touching runs on each side of the seams between the strips */
+    for (strip = 1; strip < num_strips; strip++)
     {
-        if (cloud_lookup[cloud_index] != -1)
+        int seam_row = strip * CLOUD_STRIP_ROWS;
+        int prev_first = strip_first[strip];
+        int cur_end = strip_first[strip];
+
+        while (prev_first > strip_first[strip - 1]
+               && runs[prev_first - 1].row == seam_row - 1)
         {
-            cloud_lookup[next_cloud_number] = cloud_lookup[cloud_index];
-            next_cloud_number++;
+            prev_first--;
         }
+        while (cur_end < strip_first[strip + 1]
+               && runs[cur_end].row == seam_row)
+        {
+            cur_end++;
+        }
+
+        join_overlapping_runs(runs, run_parent, prev_first,
+                              strip_first[strip], strip_first[strip], cur_end);
     }
-    cloud_count = next_cloud_number;
+    free(strip_first);
 
-    /* Shrink cloud_lookup array to only use what it needs */
-    temp_ptr = realloc(cloud_lookup, sizeof(*cloud_lookup) * cloud_count);
-    if (!temp_ptr)
+    /* Allocate the cloud records sized to assume each run is a separate
+       cloud */
+    clouds = malloc(run_count * sizeof(*clouds));
+    cloud_last = malloc(run_count * sizeof(*cloud_last));
+    if (!clouds || !cloud_last)
     {
-        free(cloud_lookup);
+        free(clouds);
+        free(cloud_last);
+        free(run_parent);
+        free(run_cloud);
         free(runs);
-        RETURN_ERROR("Failed shrinking cloud lookup array", FUNC_NAME, ERROR);
+        RETURN_ERROR("Failed allocating cloud records", FUNC_NAME, ERROR);
     }
-    cloud_lookup = temp_ptr;
 
-    /* Allocate memory for the count of pixels in each cloud */
-    cloud_pixel_count = malloc(cloud_count * sizeof(*cloud_pixel_count));
-    if (!cloud_pixel_count)
+    /* Number the clouds in the order of their first run, which is the run
+       they were joined to, link the runs of each cloud, and find the size
+       and bounding box of each cloud */
+    for (run_index = 0; run_index < run_count; run_index++)
     {
-        free(cloud_lookup);
-        free(runs);
-        RETURN_ERROR("Failed allocating memory for the cloud pixel count "
-                     "array", FUNC_NAME, ERROR);
+        RLE_T *run = &runs[run_index];
+        int root = find_run(run_parent, run_index);
+        int last_col = run->start_col + run->col_count - 1;
+        CLOUD_T *cloud;
+
+        if (root == run_index)
+        {
+            run_cloud[run_index] = cloud_count;
+            cloud = &clouds[cloud_count];
+            cloud_count++;
+
+            cloud->first_run = run_index;
+            cloud->pixel_count = 0;
+            cloud->first_row = run->row;
+            cloud->first_col = run->start_col;
+            cloud->last_col = last_col;
+        }
+        else
+        {
+            run_cloud[run_index] = run_cloud[root];
+            cloud = &clouds[run_cloud[root]];
+            runs[cloud_last[run_cloud[root]]].next_index = run_index;
+
+            if (cloud->first_col > run->start_col)
+                cloud->first_col = run->start_col;
+            if (cloud->last_col < last_col)
+                cloud->last_col = last_col;
+        }
+
+        cloud_last[run_cloud[run_index]] = run_index;
+        cloud->pixel_count += run->col_count;
+        cloud->last_row = run->row;
     }
 
-    /* Update the cloud map with the latest cloud numbers and to cover any
-       cloud merges that occurred */
-    for (cloud_index = 1; cloud_index < cloud_count; cloud_index++)
+    free(cloud_last);
+    free(run_parent);
+    free(run_cloud);
+
+    /* Drop the small clouds, keeping the others in order */
+    kept_count = 0;
+    for (cloud_index = 0; cloud_index < cloud_count; cloud_index++)
     {
-        int run_index = cloud_lookup[cloud_index];
-        int pixel_count = 0;
+        if (clouds[cloud_index].pixel_count > min_cloud_pixels)
+        {
+            clouds[kept_count] = clouds[cloud_index];
+            kept_count++;
+        }
+    }
+    *out_small_cloud_count = cloud_count - kept_count;
+    cloud_count = kept_count;
+
+    /* Find the temperature range of each cloud */
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 64)
+#endif
+    for (cloud_index = 0; cloud_index < cloud_count; cloud_index++)
+    {
+        CLOUD_T *cloud = &clouds[cloud_index];
+        int16 temp_min = SHRT_MAX;
+        int16 temp_max = SHRT_MIN;
+        int cloud_run_index = cloud->first_run;
+
+        if (!temp_data)
+        {
+            cloud->temp_min = 0;
+            cloud->temp_max = 0;
+            continue;
+        }
 
-        while (run_index != -1)
+        while (cloud_run_index != -1)
         {
-            RLE_T *run = &runs[run_index];
-            int fill_col;
-            int *cloud_map_row = &cloud_map[run->row * ncols];
-            int end_col = run->start_col + run->col_count;
+            RLE_T *run = &runs[cloud_run_index];
+            int16 *temp = &temp_data[run->row * ncols + run->start_col];
+            int col;
 
-            for (fill_col = run->start_col; fill_col < end_col; fill_col++)
+            for (col = 0; col < run->col_count; col++)
             {
-                cloud_map_row[fill_col] = cloud_index;
+                if (temp[col] < temp_min)
+                    temp_min = temp[col];
+                if (temp[col] > temp_max)
+                    temp_max = temp[col];
             }
-            pixel_count += run->col_count;
-
-            run_index = run->next_index;
+            cloud_run_index = run->next_index;
         }
 
-        cloud_pixel_count[cloud_index] = pixel_count;
+        cloud->temp_min = temp_min;
+        cloud->temp_max = temp_max;
+    }
+
+    /* Shrink the cloud records to only use what they need */
+    if (cloud_count == 0)
+    {
+        free(clouds);
+        clouds = NULL;
+    }
+    else
+    {
+        temp_clouds = realloc(clouds, cloud_count * sizeof(*clouds));
+        if (!temp_clouds)
+        {
+            free(clouds);
+            free(runs);
+            RETURN_ERROR("Failed shrinking the cloud records", FUNC_NAME,
+                         ERROR);
+        }
+        clouds = temp_clouds;
     }
 
     *out_cloud_runs = runs;
-    *out_cloud_lookup = cloud_lookup;
-    *out_cloud_pixel_count = cloud_pixel_count;
+    *out_clouds = clouds;
     *out_cloud_count = cloud_count;
 
     return SUCCESS;
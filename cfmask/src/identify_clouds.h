@@ -2,6 +2,9 @@
 #define IDENTIFY_CLOUDS_H
 
 
+#include "cfmask.h"
+
+
 /* Define a run-length encoded structure for storing a run of cloud pixels */
 typedef struct rle_t
 {
@@ -12,19 +15,36 @@ typedef struct rle_t
 } RLE_T;
 
 
+/* Define a structure for the record of a cloud object */
+typedef struct cloud_t
+{
+    int first_run;      /* Index to the first run of the cloud */
+    int pixel_count;    /* Number of pixels in the cloud */
+    int first_row;      /* First row of the cloud's bounding box */
+    int last_row;       /* Last row of the cloud's bounding box */
+    int first_col;      /* First column of the cloud's bounding box */
+    int last_col;       /* Last column of the cloud's bounding box */
+    int16 temp_min;     /* Minimum temperature of the cloud; zero without
+                           thermal data */
+    int16 temp_max;     /* Maximum temperature of the cloud; zero without
+                           thermal data */
+} CLOUD_T;
+
+
 int identify_clouds
 (
     unsigned char *pixel_mask,   /* I: Cloud pixel mask */
+    int16 *temp_data,            /* I: Brightness temperature of each pixel;
+                                       NULL if there is no thermal data */
     int nrows,                   /* I: Number of rows */
     int ncols,                   /* I: Number of columns */
+    int min_cloud_pixels,        /* I: Clouds of this many pixels or fewer
+                                       are dropped */
     RLE_T **out_cloud_runs,      /* O: Array of cloud run-length encoded
                                        segments */
-    int **out_cloud_lookup,      /* O: Array to map clouds to cloud runs */
-    int **out_cloud_pixel_count, /* O: Cloud number */
-    int *out_cloud_count,        /* O: Number of clouds in the cloud_lookup
-                                       and cloud_pixel_count arrays */
-    int *cloud_map               /* I/O: Image containing the cloud number for
-                                         each pixel */
+    CLOUD_T **out_clouds,        /* O: Array of the records of the clouds */
+    int *out_cloud_count,        /* O: Number of clouds in the clouds array */
+    int *out_small_cloud_count   /* O: Number of clouds that were dropped */
 );
 
 
@@ -2,11 +2,22 @@
 !File: input.c
 *****************************************************************************/
 
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
+#include <stdlib.h>
 #include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "espa_metadata.h"
 #include "espa_geoloc.h"
-#include "raw_binary_io.h"
 
 #include "const.h"
 #include "error.h"
@@ -150,6 +161,635 @@ dn_to_toa_saturation
 }
 
 
+/*****************************************************************************
+MODULE:  read_fully
+
+PURPOSE: Reads the requested number of bytes at the specified offset of the
+         file with positioned reads, continuing after short reads.
+
+RETURN:  Type = Bool
+    Value  Description
+    -----  -------------------------------------------------------------------
+    true   No Errors
+    false  Errors encountered
+*****************************************************************************/
+static bool
+read_fully
+(
+    int fd,       /* I: file descriptor to read from */
+    void *dst,    /* O: data read */
+    size_t bytes, /* I: number of bytes to read */
+    off_t offset  /* I: offset in the file to read from */
+)
+{
+    char *pos = dst;
+    ssize_t count;
+
+    while (bytes > 0)
+    {
+        count = pread(fd, pos, bytes, offset);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+
+        pos += count;
+        bytes -= count;
+        offset += count;
+    }
+
+    return true;
+}
+
+
+/*****************************************************************************
+MODULE:  build_band_luts
+
+PURPOSE: Builds a lookup table, indexed by the value read from the file, for
+         each open band which needs its values changed as it is read.  For
+         Landsat 4-7 the saturated values are replaced with the maximum
+         values, and the thermal band is converted from scaled Kelvin to the
+         unscaled Celsius (times 100) values the application is based upon,
+         leaving fill and saturated values as fill or saturated.  Bands which
+         don't need any change are left without a table.  The object match
+         has always used the thermal band without the saturated value
+         replaced, so the thermal band gets a second table for it when the
+         value is replaced.
+
+RETURN:  Type = Bool
+    Value  Description
+    -----  -------------------------------------------------------------------
+    true   No Errors
+    false  Errors encountered
+*****************************************************************************/
+static bool
+build_band_luts
+(
+    Input_t *input /* I: input reflectance band data */
+)
+{
+    int band_index;
+    int value;        /* value read from the file */
+    int16 result;     /* value the processing is given */
+    int satu_ref;     /* saturated value of the band */
+    bool saturation;  /* replace the saturated value for the band */
+    float therm_val;  /* tempoary thermal value for conversion from Kelvin to
+                         Celsius */
+
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+    {
+        if (!input->open[band_index])
+            continue;
+
+        /* Landsat 8 doesn't have saturation issues.  A saturated value which
+           isn't known is left at the fill value, so don't replace it. */
+        satu_ref = input->meta.satu_value_ref[band_index];
+        saturation = input->satellite != IS_LANDSAT_8
+                     && satu_ref != FILL_PIXEL
+                     && satu_ref >= SHRT_MIN && satu_ref <= SHRT_MAX;
+
+        if (!saturation && band_index != BI_THERMAL)
+            continue;
+
+        input->lut[band_index] = malloc(INPUT_LUT_SIZE * sizeof(int16));
+        if (input->lut[band_index] == NULL)
+        {
+            RETURN_ERROR("allocating band lookup table", "build_band_luts",
+                         false);
+        }
+
+        if (band_index == BI_THERMAL && saturation)
+        {
+            input->therm_match_lut = malloc(INPUT_LUT_SIZE * sizeof(int16));
+            if (input->therm_match_lut == NULL)
+            {
+                RETURN_ERROR("allocating thermal match lookup table",
+                             "build_band_luts", false);
+            }
+        }
+
+        for (value = SHRT_MIN; value <= SHRT_MAX; value++)
+        {
+            result = value;
+
+            if (band_index == BI_THERMAL
+                && value != input->meta.fill && value != satu_ref)
+            {
+                /* unscale and convert to celsius */
+                therm_val = value * input->meta.therm_scale_fact;
+                therm_val -= 273.15;
+
+                /* apply the old scale factor that the cfmask processing is
+                   based upon, to get the original unscaled Celsius values */
+                therm_val *= 100.0;
+                result = (int)round(therm_val);
+            }
+
+            if (band_index == BI_THERMAL && input->therm_match_lut != NULL)
+                input->therm_match_lut[(unsigned short)value] = result;
+
+            if (saturation && result == satu_ref)
+                result = input->meta.satu_value_max[band_index];
+
+            input->lut[band_index][(unsigned short)value] = result;
+        }
+    }
+
+    return true;
+}
+
+
+/*****************************************************************************
+MODULE:  apply_band_lut
+
+PURPOSE: Replaces the values read from the file for the specified band with
+         the values from its lookup table, if it has one.
+*****************************************************************************/
+static void
+apply_band_lut
+(
+    Input_t *input, /* I: input reflectance band data */
+    int band_index, /* I: the band the values are from */
+    int16 *data,    /* I/O: values to replace */
+    long count      /* I: number of values to replace */
+)
+{
+    const int16 *lut = input->lut[band_index];
+    long i;
+
+    if (lut == NULL)
+        return;
+
+    for (i = 0; i < count; i++)
+        data[i] = lut[(unsigned short)data[i]];
+}
+
+
+/*****************************************************************************
+MODULE:  load_resident_band
+
+PURPOSE: Reads all of the lines for the specified band into an aligned
+         memory plane with one block read.  A thermal band which has its
+         saturated value replaced is kept the way the object match uses it,
+         with the saturated value left as it is, and the value is replaced
+         as the processing threads' lines are served.
+
+RETURN:  Type = Bool
+    Value  Description
+    -----  -------------------------------------------------------------------
+    true   No Errors
+    false  Errors encountered
+*****************************************************************************/
+static bool
+load_resident_band
+(
+    Input_t *input, /* I: input reflectance band data */
+    int band_index  /* I: the band to load */
+)
+{
+    void *plane = NULL;
+    long count = (long)input->size.l * input->size.s;
+    long i;
+
+    if (posix_memalign(&plane, INPUT_CUBE_ALIGN, count * sizeof(int16)) != 0)
+    {
+        RETURN_ERROR("allocating resident band memory", "load_resident_band",
+                     false);
+    }
+    input->cube[band_index] = plane;
+
+    if (band_index == BI_THERMAL && input->therm_match_lut != NULL)
+    {
+        if (!read_fully(input->fd_bin[BI_THERMAL], plane,
+                        count * sizeof(int16), 0))
+        {
+            RETURN_ERROR("error reading thermal band", "load_resident_band",
+                         false);
+        }
+        for (i = 0; i < count; i++)
+        {
+            input->cube[BI_THERMAL][i] =
+                input->therm_match_lut[(unsigned short)
+                                       input->cube[BI_THERMAL][i]];
+        }
+        return true;
+    }
+
+    if (!GetInputBlock(input, band_index, 0, input->size.l,
+                       input->cube[band_index]))
+    {
+        RETURN_ERROR("error reading band", "load_resident_band", false);
+    }
+
+    return true;
+}
+
+
+/*****************************************************************************
+MODULE:  map_band
+
+PURPOSE: Memory maps the specified band file and tells the kernel the
+         mapping will be read sequentially.
+
+NOTES:
+1. The mapping is read only.  The bands which have their values replaced
+   through a lookup table are copied to their line buffers.
+
+RETURN:  Type = Bool
+    Value  Description
+    -----  -------------------------------------------------------------------
+    true   No Errors
+    false  Errors encountered
+*****************************************************************************/
+static bool
+map_band
+(
+    Input_t *input, /* I: input reflectance band data */
+    int band_index  /* I: the band to map */
+)
+{
+    struct stat file_stat;
+    void *map = NULL;
+    size_t map_bytes = (size_t)input->size.l * input->size.s * sizeof(int16);
+    int fd = input->fd_bin[band_index];
+
+    if (fstat(fd, &file_stat) != 0)
+    {
+        RETURN_ERROR("error getting band file size", "map_band", false);
+    }
+    if ((size_t)file_stat.st_size < map_bytes)
+    {
+        RETURN_ERROR("band file is smaller than the image size", "map_band",
+                     false);
+    }
+
+    map = mmap(NULL, map_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        RETURN_ERROR("error mapping band file", "map_band", false);
+    }
+
+    /* Only a hint, so don't fail if it isn't taken */
+    madvise(map, map_bytes, MADV_SEQUENTIAL);
+
+    input->map[band_index] = map;
+    input->map_bytes[band_index] = map_bytes;
+
+    return true;
+}
+
+
+/*****************************************************************************
+MODULE:  advise_mapped_lines
+
+PURPOSE: Asks the kernel to start reading the next group of lines of a
+         mapped band when the first line of the current group is requested.
+*****************************************************************************/
+static void
+advise_mapped_lines
+(
+    Input_t *input, /* I: input reflectance band data */
+    int band_index, /* I: the band being read */
+    int iline       /* I: the line being read */
+)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t line_bytes = input->size.s * sizeof(int16);
+    size_t start;
+    size_t end;
+
+    if (iline % INPUT_MMAP_ADVISE_LINES != 0)
+        return;
+
+    /* madvise needs a page aligned start address */
+    start = (size_t)(iline + INPUT_MMAP_ADVISE_LINES) * line_bytes;
+    start -= start % page_size;
+    end = (size_t)(iline + 2 * INPUT_MMAP_ADVISE_LINES) * line_bytes;
+    if (end > input->map_bytes[band_index])
+        end = input->map_bytes[band_index];
+    if (start >= end)
+        return;
+
+    madvise((char *)input->map[band_index] + start, end - start,
+            MADV_WILLNEED);
+}
+
+
+/*****************************************************************************
+MODULE:  prefetch_stream
+
+PURPOSE: Returns the strip ring of the specified stream the reader fills.
+         Each set of MAX_BAND_COUNT streams is the bands of one of the
+         processing threads' lines.  The prefetch lock must be held.
+
+RETURN:  Type = Input_prefetch_t *
+    The strip ring, or NULL if there is no such stream
+*****************************************************************************/
+static Input_prefetch_t *
+prefetch_stream
+(
+    Input_t *input, /* I: input reflectance band data */
+    int stream      /* I: the stream to return */
+)
+{
+    Input_lines_t *lines = input->prefetch_lines;
+    int owner = stream / MAX_BAND_COUNT;
+
+    while (lines != NULL && owner-- > 0)
+        lines = lines->next;
+    if (lines == NULL)
+        return NULL;
+
+    return &lines->prefetch[stream % MAX_BAND_COUNT];
+}
+
+
+/*****************************************************************************
+MODULE:  prefetch_reader
+
+PURPOSE: Background reader for the prefetch mode.  Keeps the strip ring of
+         each band requested by a processing thread filled with the strips
+         following the one the thread is processing, so the reads overlap
+         the processing.
+*****************************************************************************/
+static void *
+prefetch_reader
+(
+    void *arg /* I: input reflectance band data */
+)
+{
+    Input_t *input = arg;
+    Input_prefetch_t *prefetch = NULL;
+    int nstrips = (input->size.l + INPUT_PREFETCH_LINES - 1)
+                  / INPUT_PREFETCH_LINES;
+    int nstreams;
+    int stream = 0;
+    int band_index = 0;
+    int count;
+    int slot;
+    int strip;
+    int first_line;
+    int nlines;
+    int generation;
+    bool status;
+
+    pthread_mutex_lock(&input->lock);
+    while (!input->reader_stop)
+    {
+        /* Find the next band of the threads' lines, round robin, which has
+           been requested, has strips left, and has a free buffer */
+        nstreams = MAX_BAND_COUNT * input->prefetch_lines_count;
+        slot = -1;
+        for (count = 0; count < nstreams && slot == -1; count++)
+        {
+            stream = (stream + 1) % nstreams;
+            band_index = stream % MAX_BAND_COUNT;
+            prefetch = prefetch_stream(input, stream);
+            if (prefetch == NULL || !input->open[band_index]
+                || !prefetch->active
+                || prefetch->next_strip >= nstrips)
+            {
+                continue;
+            }
+
+            for (slot = 0; slot < INPUT_PREFETCH_STRIPS; slot++)
+            {
+                if (prefetch->state[slot] == PREFETCH_FREE)
+                    break;
+            }
+            if (slot == INPUT_PREFETCH_STRIPS)
+                slot = -1;
+        }
+
+        if (slot == -1)
+        {
+            /* Nothing to do until the processing moves along */
+            pthread_cond_wait(&input->changed, &input->lock);
+            continue;
+        }
+
+        strip = prefetch->next_strip++;
+        generation = prefetch->current_generation;
+        prefetch->strip[slot] = strip;
+        prefetch->generation[slot] = generation;
+        prefetch->state[slot] = PREFETCH_FILLING;
+
+        /* Read without holding the lock, so the processing can use the
+           strips which are ready */
+        first_line = strip * INPUT_PREFETCH_LINES;
+        nlines = INPUT_PREFETCH_LINES;
+        if (first_line + nlines > input->size.l)
+            nlines = input->size.l - first_line;
+
+        pthread_mutex_unlock(&input->lock);
+        status = GetInputBlock(input, band_index, first_line, nlines,
+                               prefetch->data[slot]);
+        pthread_mutex_lock(&input->lock);
+
+        if (!status)
+        {
+            prefetch->state[slot] = PREFETCH_FREE;
+            input->reader_error = true;
+            pthread_cond_broadcast(&input->changed);
+            break;
+        }
+
+        /* Drop the strip if the band was restarted while it was read */
+        if (generation == prefetch->current_generation)
+            prefetch->state[slot] = PREFETCH_READY;
+        else
+            prefetch->state[slot] = PREFETCH_FREE;
+        pthread_cond_broadcast(&input->changed);
+    }
+    pthread_mutex_unlock(&input->lock);
+
+    return NULL;
+}
+
+
+/*****************************************************************************
+MODULE:  alloc_prefetch_strips
+
+PURPOSE: Allocates the buffers of a strip ring, if they aren't already.
+
+RETURN:  Type = Bool
+    Value  Description
+    -----  -------------------------------------------------------------------
+    true   No Errors
+    false  Errors encountered
+*****************************************************************************/
+static bool
+alloc_prefetch_strips
+(
+    Input_t *input,            /* I: input reflectance band data */
+    Input_prefetch_t *prefetch /* I/O: strip ring to allocate */
+)
+{
+    int slot;
+
+    for (slot = 0; slot < INPUT_PREFETCH_STRIPS; slot++)
+    {
+        if (prefetch->data[slot] != NULL)
+            continue;
+
+        prefetch->data[slot] = malloc((size_t)INPUT_PREFETCH_LINES
+                                      * input->size.s * sizeof(int16));
+        if (prefetch->data[slot] == NULL)
+        {
+            RETURN_ERROR("allocating prefetch strip memory",
+                         "alloc_prefetch_strips", false);
+        }
+    }
+
+    return true;
+}
+
+
+/*****************************************************************************
+MODULE:  start_prefetch
+
+PURPOSE: Starts the background reader, which fills the strip rings of the
+         processing threads' lines as they are handed to it.
+
+RETURN:  Type = Bool
+    Value  Description
+    -----  -------------------------------------------------------------------
+    true   No Errors
+    false  Errors encountered
+*****************************************************************************/
+static bool
+start_prefetch
+(
+    Input_t *input /* I: input reflectance band data */
+)
+{
+    if (pthread_mutex_init(&input->lock, NULL) != 0
+        || pthread_cond_init(&input->changed, NULL) != 0)
+    {
+        RETURN_ERROR("initializing prefetch locking", "start_prefetch", false);
+    }
+
+    input->reader_stop = false;
+    input->reader_error = false;
+    if (pthread_create(&input->reader, NULL, prefetch_reader, input) != 0)
+    {
+        pthread_cond_destroy(&input->changed);
+        pthread_mutex_destroy(&input->lock);
+        RETURN_ERROR("starting the prefetch reader", "start_prefetch", false);
+    }
+    input->reader_running = true;
+
+    return true;
+}
+
+
+/*****************************************************************************
+MODULE:  stop_prefetch
+
+PURPOSE: Stops the background reader, if it was started.
+*****************************************************************************/
+static void
+stop_prefetch
+(
+    Input_t *input /* I: input reflectance band data */
+)
+{
+    if (!input->reader_running)
+        return;
+
+    pthread_mutex_lock(&input->lock);
+    input->reader_stop = true;
+    pthread_cond_broadcast(&input->changed);
+    pthread_mutex_unlock(&input->lock);
+
+    pthread_join(input->reader, NULL);
+    pthread_cond_destroy(&input->changed);
+    pthread_mutex_destroy(&input->lock);
+    input->reader_running = false;
+}
+
+
+/*****************************************************************************
+MODULE:  get_prefetched_line
+
+PURPOSE: Returns the specified line from the prefetched strips, waiting for
+         the reader if the strip isn't ready yet.  Strips before the one
+         holding the line are released to the reader, and if the line isn't
+         in the strip the reader is working towards (e.g. a new pass starting
+         back at the first line) the band is restarted at that strip.
+
+RETURN:  Type = int16 *
+    The line data or NULL when an error occurs
+*****************************************************************************/
+static int16 *
+get_prefetched_line
+(
+    Input_t *input,             /* I: input reflectance band data */
+    Input_prefetch_t *prefetch, /* I/O: strip ring of the band to read */
+    int iline                   /* I: the line to read in the band */
+)
+{
+    int strip = iline / INPUT_PREFETCH_LINES;
+    int16 *line = NULL;
+    int slot;
+    bool pending;
+
+    pthread_mutex_lock(&input->lock);
+    prefetch->active = true;
+    while (line == NULL && !input->reader_error)
+    {
+        pending = false;
+        for (slot = 0; slot < INPUT_PREFETCH_STRIPS; slot++)
+        {
+            if (prefetch->state[slot] == PREFETCH_FREE
+                || prefetch->generation[slot] != prefetch->current_generation)
+            {
+                continue;
+            }
+
+            if (prefetch->strip[slot] == strip)
+            {
+                if (prefetch->state[slot] == PREFETCH_READY)
+                {
+                    line = &prefetch->data[slot]
+                        [(long)(iline % INPUT_PREFETCH_LINES) * input->size.s];
+                }
+                else
+                    pending = true;
+            }
+            else if (prefetch->strip[slot] < strip
+                     && prefetch->state[slot] == PREFETCH_READY)
+            {
+                /* Already processed, so give it back to the reader */
+                prefetch->state[slot] = PREFETCH_FREE;
+                pthread_cond_broadcast(&input->changed);
+            }
+        }
+
+        if (line != NULL)
+            break;
+
+        if (!pending && prefetch->next_strip != strip)
+        {
+            /* Restart the band at this strip */
+            prefetch->current_generation++;
+            for (slot = 0; slot < INPUT_PREFETCH_STRIPS; slot++)
+            {
+                if (prefetch->state[slot] == PREFETCH_READY)
+                    prefetch->state[slot] = PREFETCH_FREE;
+            }
+            prefetch->next_strip = strip;
+        }
+
+        pthread_cond_broadcast(&input->changed);
+        pthread_cond_wait(&input->changed, &input->lock);
+    }
+    pthread_mutex_unlock(&input->lock);
+
+    return line;
+}
+
+
 /*****************************************************************************
 MODULE:  OpenInput
 
@@ -163,11 +803,15 @@ Input_t *
 OpenInput
 (
     Espa_internal_meta_t *metadata, /* I: input metadata */
-    bool use_thermal                /* I: value to indicate if thermal data
-                                          should be used */
+    int band_set,                   /* I: bands the processing uses, as
+                                          INPUT_BAND() bits; only these are
+                                          opened and read */
+    int input_mode                  /* I: how the bands are accessed; one of
+                                          the INPUT_MODE_* values */
 )
 {
     Input_t *input = NULL;
+    bool use_thermal = (band_set & INPUT_BAND(BI_THERMAL)) != 0;
     char *error_string = NULL;
     int band_index;
     int esun_index;
@@ -194,11 +838,19 @@ OpenInput
     for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
     {
         input->file_name[band_index] = NULL;
-        input->fp_bin[band_index] = NULL;
+        input->fd_bin[band_index] = -1;
         input->open[band_index] = false;
         /* Initialize to NULL, memory is allocated later */
-        input->buf[band_index] = NULL;
+        input->cube[band_index] = NULL;
+        input->map[band_index] = NULL;
+        input->map_bytes[band_index] = 0;
+        input->lut[band_index] = NULL;
     }
+    input->therm_match_lut = NULL;
+    input->input_mode = input_mode;
+    input->reader_running = false;
+    input->prefetch_lines = NULL;
+    input->prefetch_lines_count = 0;
 
     /* Initialize and get input from header file */
     if (!GetXMLInput(input, metadata))
@@ -208,14 +860,29 @@ OpenInput
         RETURN_ERROR("getting input from header file", "OpenInput", NULL);
     }
 
+    /* Make sure the sensor has the requested bands */
+    for (band_index = input->num_toa_bands; band_index < BI_THERMAL;
+         band_index++)
+    {
+        if (band_set & INPUT_BAND(band_index))
+        {
+            FreeInput(input);
+            RETURN_ERROR("requested band isn't available for the sensor",
+                         "OpenInput", NULL);
+        }
+    }
+
     /* Open TOA reflectance files for access */
     for (band_index = 0; band_index < input->num_toa_bands; band_index++)
     {
+        if (!(band_set & INPUT_BAND(band_index)))
+            continue;
+
         printf("Band %d Filename: %s\n",
                band_index, input->file_name[band_index]);
-        input->fp_bin[band_index] =
-            open_raw_binary(input->file_name[band_index], "r");
-        if (input->fp_bin[band_index] == NULL)
+        input->fd_bin[band_index] =
+            open(input->file_name[band_index], O_RDONLY);
+        if (input->fd_bin[band_index] == -1)
         {
             RETURN_ERROR("opening input TOA binary file", "OpenInput", NULL);
         }
@@ -227,9 +894,9 @@ OpenInput
         /* Open thermal file for access */
         printf("Thermal Band Filename: %s\n",
                input->file_name[BI_THERMAL]);
-        input->fp_bin[BI_THERMAL] =
-            open_raw_binary(input->file_name[BI_THERMAL], "r");
-        if (input->fp_bin[BI_THERMAL] == NULL)
+        input->fd_bin[BI_THERMAL] =
+            open(input->file_name[BI_THERMAL], O_RDONLY);
+        if (input->fd_bin[BI_THERMAL] == -1)
         {
             error_string = "opening thermal binary file";
         }
@@ -240,34 +907,10 @@ OpenInput
     }
     else
     {
-        input->fp_bin[BI_THERMAL] = NULL;
+        input->fd_bin[BI_THERMAL] = -1;
         input->open[BI_THERMAL] = false;
     }
 
-    /* Allocate input buffers.  Thermal band only has one band.  Image and QA
-       buffers have multiple bands. */
-    for (band_index = 0; band_index < input->num_toa_bands; band_index++)
-    {
-        input->buf[band_index] = calloc(input->size.s, sizeof(int16));
-        if (input->buf[band_index] == NULL)
-        {
-            error_string = "allocating input band buffer";
-        }
-    }
-
-    if (use_thermal)
-    {
-        input->buf[BI_THERMAL] = calloc(input->size.s, sizeof(int16));
-        if (input->buf[BI_THERMAL] == NULL)
-        {
-            error_string = "allocating input thermal band buffer";
-        }
-    }
-    else
-    {
-        input->buf[BI_THERMAL] = NULL;
-    }
-
     snprintf(full_path, sizeof(full_path), "%s/%s",
              esun_path, "EarthSunDistance.txt");
     dsun_fd = fopen(full_path, "r");
@@ -306,6 +949,85 @@ OpenInput
         }
     }
 
+    /* Build the lookup tables which replace the values as they are read */
+    if (!build_band_luts(input))
+    {
+        error_string = "building band lookup tables";
+    }
+
+    if (error_string != NULL)
+    {
+        CloseInput(input);
+        FreeInput(input);
+        RETURN_ERROR(error_string, "OpenInput", NULL);
+    }
+
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+    {
+        if (!input->open[band_index])
+            continue;
+
+        /* The files are read front to back in every mode, so let the kernel
+           read ahead aggressively; only a hint, so don't fail if it isn't
+           taken */
+        posix_fadvise(input->fd_bin[band_index], 0, 0,
+                      POSIX_FADV_SEQUENTIAL);
+    }
+
+    if (input_mode == INPUT_MODE_RESIDENT)
+    {
+        bool load_error = false;
+
+        /* Load each of the open bands once, so the passes don't need to
+           re-read them.  The bands are independent, so load them at the same
+           time if threading is enabled. */
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 1) reduction(||:load_error)
+#endif
+        for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+        {
+            if (!input->open[band_index])
+                continue;
+
+            if (!load_resident_band(input, band_index))
+                load_error = true;
+        }
+
+        if (load_error)
+        {
+            CloseInput(input);
+            FreeInput(input);
+            RETURN_ERROR("loading resident band data", "OpenInput", NULL);
+        }
+    }
+    else if (input_mode == INPUT_MODE_MMAP)
+    {
+        /* Map each of the open bands, so the lines come straight from the
+           page cache */
+        for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+        {
+            if (!input->open[band_index])
+                continue;
+
+            if (!map_band(input, band_index))
+            {
+                CloseInput(input);
+                FreeInput(input);
+                RETURN_ERROR("mapping band data", "OpenInput", NULL);
+            }
+        }
+    }
+    else if (input_mode == INPUT_MODE_PREFETCH)
+    {
+        /* Start reading strips ahead of the processing */
+        if (!start_prefetch(input))
+        {
+            CloseInput(input);
+            FreeInput(input);
+            RETURN_ERROR("starting the prefetch reader", "OpenInput", NULL);
+        }
+    }
+
     return input;
 }
 
@@ -333,20 +1055,23 @@ CloseInput
 
     if (input != NULL)
     {
+        /* The reader thread uses the files, so stop it first */
+        stop_prefetch(input);
+
         none_open = true;
         for (band_index = 0; band_index < input->num_toa_bands; band_index++)
         {
             if (input->open[band_index])
             {
                 none_open = false;
-                close_raw_binary(input->fp_bin[band_index]);
+                close(input->fd_bin[band_index]);
                 input->open[band_index] = false;
             }
         }
 
         if (input->open[BI_THERMAL])
         {
-            close_raw_binary(input->fp_bin[BI_THERMAL]);
+            close(input->fd_bin[BI_THERMAL]);
             input->open[BI_THERMAL] = false;
         }
 
@@ -390,9 +1115,18 @@ FreeInput
             }
             free(input->file_name[band_index]);
             input->file_name[band_index] = NULL;
-            free(input->buf[band_index]);
+            free(input->cube[band_index]);
+            input->cube[band_index] = NULL;
+            if (input->map[band_index] != NULL)
+                munmap(input->map[band_index], input->map_bytes[band_index]);
+            input->map[band_index] = NULL;
+            free(input->lut[band_index]);
+            input->lut[band_index] = NULL;
         }
 
+        free(input->therm_match_lut);
+        input->therm_match_lut = NULL;
+
         free(input);
         input = NULL;
     }
@@ -402,134 +1136,397 @@ FreeInput
 
 
 /*****************************************************************************
-MODULE:  GetInputLine
+MODULE:  GetInputThermBand
 
-PURPOSE: Reads the data for the current band and line
+PURPOSE: Reads all of the lines of the thermal brightness data, converted to
+         Celsius as the object match uses them: the saturated value is left
+         as it is rather than replaced with the maximum value.
 
-RETURN:  Type = Bool,  Updated Input_T data structure.
-    Input_t:  Updated memory buffer for the specified band
+RETURN:  Type = Bool
     Value  Description
     -----  -------------------------------------------------------------------
     true   No Errors
     false  Errors encountered
 *****************************************************************************/
 bool
-GetInputLine
+GetInputThermBand
 (
     Input_t *input, /* I: input reflectance band data */
-    int band_index, /* I: the band to read */
-    int iline       /* I: the line to read in the band */
+    int16 *dst      /* O: thermal data, size.l * size.s values */
 )
 {
-    void *buf = NULL;
-    long loc; /* pointer location in the raw binary file */
+    long count;       /* number of values in the band */
+    long i;
+    const int16 *lut; /* table converting the values read */
 
     /* Check the parameters */
     if (input == NULL)
     {
-        RETURN_ERROR("invalid input structure", "GetIntputLine", false);
-    }
-    if (band_index < 0 || band_index >= input->num_toa_bands)
-    {
-        RETURN_ERROR("invalid band number", "GetInputLine", false);
+        RETURN_ERROR("invalid input structure", "GetInputThermBand", false);
     }
-    if (!input->open[band_index])
+    if (!input->open[BI_THERMAL])
     {
-        RETURN_ERROR("file not open", "GetInputLine", false);
+        RETURN_ERROR("file not open", "GetInputThermBand", false);
     }
-    if (iline < 0 || iline >= input->size.l)
+
+    /* The resident band is already held as the object match uses it */
+    count = (long)input->size.l * input->size.s;
+    if (input->input_mode == INPUT_MODE_RESIDENT)
     {
-        RETURN_ERROR("invalid line number", "GetInputLine", false);
+        memcpy(dst, input->cube[BI_THERMAL], count * sizeof(int16));
+        return true;
     }
 
-    /* Read the data */
-    buf = input->buf[band_index];
-    loc = (long)(iline * input->size.s * sizeof(int16));
-    if (fseek(input->fp_bin[band_index], loc, SEEK_SET))
+    /* Otherwise start from the values in the file, since the prefetched and
+       block data have the saturated value replaced */
+    if (input->input_mode == INPUT_MODE_MMAP)
     {
-        RETURN_ERROR("error seeking line (binary)", "GetInputLine", false);
+        memcpy(dst, input->map[BI_THERMAL], count * sizeof(int16));
     }
-
-    if (read_raw_binary(input->fp_bin[band_index], 1, input->size.s,
-                        sizeof(int16), buf) != SUCCESS)
+    else if (!read_fully(input->fd_bin[BI_THERMAL], dst,
+                         count * sizeof(int16), 0))
     {
-        RETURN_ERROR("error reading line (binary)", "GetInputLine", false);
+        RETURN_ERROR("error reading thermal band (binary)",
+                     "GetInputThermBand", false);
     }
 
+    /* Convert from Kelvin back to degrees Celsius since the application is
+       based on the unscaled Celsius values originally produced. */
+    lut = input->therm_match_lut;
+    if (lut == NULL)
+        lut = input->lut[BI_THERMAL];
+    for (i = 0; i < count; i++)
+        dst[i] = lut[(unsigned short)dst[i]];
+
     return true;
 }
 
+
 /*****************************************************************************
-MODULE:  GetInputThermLine
+MODULE:  GetInputBlock
 
-PURPOSE: Reads the thermal brightness data for the current line.
+PURPOSE: Reads a block of contiguous lines for the specified band with one
+         request, and asks the kernel to start reading the lines following
+         the block.  The values are replaced through the band lookup table,
+         which replaces saturated values and converts the thermal band to
+         Celsius.
 
-RETURN:  Type = Bool,  Updated Input_T data structure.
-    Input_t:  Updated memory buffer for the specified band
+NOTES:
+1. The read is positioned, so different bands, or different blocks of the
+   same band, may be read from different threads at the same time.
+
+RETURN:  Type = Bool
     Value  Description
     -----  -------------------------------------------------------------------
     true   No Errors
     false  Errors encountered
 *****************************************************************************/
 bool
-GetInputThermLine
+GetInputBlock
 (
-    Input_t *input, /* I: input reflectance band data */
-    int iline       /* I: the line to read in the band */
+    Input_t *input,  /* I: input reflectance band data */
+    int band_index,  /* I: the band to read */
+    int first_line,  /* I: the first line to read in the band */
+    int nlines,      /* I: the number of lines to read */
+    int16 *dst       /* O: block data, nlines * size.s values */
 )
 {
-    void *buf = NULL;
-    int i;            /* looping variable */
-    long loc;         /* pointer location in the raw binary file */
-    float therm_val;  /* tempoary thermal value for conversion from Kelvin to
-                         Celsius */
+    long loc;        /* pointer location in the raw binary file */
+    long block_size; /* size of the block in bytes */
 
     /* Check the parameters */
     if (input == NULL)
     {
-        RETURN_ERROR("invalid input structure", "GetIntputThermLine", false);
+        RETURN_ERROR("invalid input structure", "GetInputBlock", false);
     }
-    if (!input->open[BI_THERMAL])
+    if (band_index < 0 || band_index >= MAX_BAND_COUNT)
     {
-        RETURN_ERROR("file not open", "GetInputThermLine", false);
+        RETURN_ERROR("invalid band number", "GetInputBlock", false);
     }
-    if (iline < 0 || iline >= input->size.l)
+    if (!input->open[band_index])
     {
-        RETURN_ERROR("invalid line number", "GetInputThermLine", false);
+        RETURN_ERROR("file not open", "GetInputBlock", false);
+    }
+    if (first_line < 0 || nlines <= 0 || first_line + nlines > input->size.l)
+    {
+        RETURN_ERROR("invalid line range", "GetInputBlock", false);
     }
 
     /* Read the data */
-    buf = input->buf[BI_THERMAL];
-    loc = (long) (iline * input->size.s * sizeof(int16));
-    if (fseek(input->fp_bin[BI_THERMAL], loc, SEEK_SET))
+    block_size = (long)nlines * input->size.s * sizeof(int16);
+    loc = (long)first_line * input->size.s * sizeof(int16);
+    if (!read_fully(input->fd_bin[band_index], dst, block_size, loc))
     {
-        RETURN_ERROR("error seeking thermal line (binary)",
-                     "GetInputThermLine", false);
+        RETURN_ERROR("error reading block (binary)", "GetInputBlock", false);
     }
 
-    if (read_raw_binary(input->fp_bin[BI_THERMAL], 1, input->size.s,
-                        sizeof (int16), buf) != SUCCESS)
+    /* Only a hint, so don't fail if it isn't taken */
+    if (first_line + nlines < input->size.l)
     {
-        RETURN_ERROR("error reading thermal line (binary)",
-                     "GetInputThermLine", false);
+        posix_fadvise(input->fd_bin[band_index], loc + block_size,
+                      block_size, POSIX_FADV_WILLNEED);
     }
 
-    /* Convert from Kelvin back to degrees Celsius since the application is
-       based on the unscaled Celsius values originally produced.  If input is
-       fill or saturated, then leave as fill or saturated. */
-    for (i = 0; i < input->size.s; i++)
+    /* Replace saturated values, and convert the thermal band from Kelvin
+       back to degrees Celsius since the application is based on the unscaled
+       Celsius values originally produced. */
+    apply_band_lut(input, band_index, dst, (long)nlines * input->size.s);
+
+    return true;
+}
+
+
+/*****************************************************************************
+MODULE:  CreateInputLines
+
+PURPOSE: Creates the lines a processing thread reads the input bands into.
+         The block, line and strip buffers are allocated as each band is
+         first read.  In the prefetch mode the lines are handed to the
+         reader, which fills their strips ahead of the thread.
+
+RETURN:  Type = Input_lines_t *
+    Value  Description
+    -----  -------------------------------------------------------------------
+    NULL   Errors encountered
+*****************************************************************************/
+Input_lines_t *
+CreateInputLines
+(
+    Input_t *input /* I: input reflectance band data */
+)
+{
+    Input_lines_t *lines;
+
+    if (input == NULL)
+    {
+        RETURN_ERROR("invalid input structure", "CreateInputLines", NULL);
+    }
+
+    lines = calloc(1, sizeof(Input_lines_t));
+    if (lines == NULL)
+    {
+        RETURN_ERROR("allocating input lines structure", "CreateInputLines",
+                     NULL);
+    }
+    lines->input = input;
+
+    if (input->reader_running)
+    {
+        pthread_mutex_lock(&input->lock);
+        lines->next = input->prefetch_lines;
+        input->prefetch_lines = lines;
+        input->prefetch_lines_count++;
+        pthread_mutex_unlock(&input->lock);
+    }
+
+    return lines;
+}
+
+
+/*****************************************************************************
+MODULE:  get_line_buffer
+
+PURPOSE: Returns the one line buffer of a band for a thread's own lines,
+         which the resident and mapped modes copy the lines into when their
+         values need replacing.
+
+RETURN:  Type = int16 *
+    Value  Description
+    -----  -------------------------------------------------------------------
+    NULL   Errors encountered
+*****************************************************************************/
+static int16 *
+get_line_buffer
+(
+    Input_t *input,       /* I: input reflectance band data */
+    Input_lines_t *lines, /* I/O: the thread's lines */
+    int band_index        /* I: the band of the buffer */
+)
+{
+    if (lines->block[band_index] == NULL)
     {
-        if (input->buf[BI_THERMAL][i] != input->meta.fill &&
-            input->buf[BI_THERMAL][i] != input->meta.satu_value_ref[BI_THERMAL])
+        lines->block[band_index] = malloc(input->size.s * sizeof(int16));
+        if (lines->block[band_index] == NULL)
         {
-            /* unscale and convert to celsius */
-            therm_val = input->buf[BI_THERMAL][i] * input->meta.therm_scale_fact;
-            therm_val -= 273.15;
+            RETURN_ERROR("allocating line buffer", "get_line_buffer", NULL);
+        }
+    }
 
-            /* apply the old scale factor that the cfmask processing is based
-               upon, to get the original unscaled Celsius values */
-            therm_val *= 100.0;
-            input->buf[BI_THERMAL][i] = (int)round(therm_val);
+    return lines->block[band_index];
+}
+
+
+/*****************************************************************************
+MODULE:  get_lines_line
+
+PURPOSE: Returns the specified line of a band for a thread's own lines.  The
+         resident and mapped data are pointed at, except for the mapped bands
+         which have their values replaced, and the resident thermal band when
+         its saturated value is replaced, which are copied.  The prefetch
+         mode serves the line from the thread's own strips, which the reader
+         fills ahead of the thread.  Otherwise the line is served from the
+         thread's block, which is read starting at the line when it doesn't
+         hold it, since each thread moves forward through its own range of
+         lines.
+
+NOTES:
+1. Only the thread's own buffers are changed, and the reads are positioned,
+   so this may be called from several threads at the same time.
+
+RETURN:  Type = int16 *
+    Value  Description
+    -----  -------------------------------------------------------------------
+    NULL   Errors encountered
+*****************************************************************************/
+static int16 *
+get_lines_line
+(
+    Input_t *input,       /* I: input reflectance band data */
+    Input_lines_t *lines, /* I/O: the thread's lines */
+    int band_index,       /* I: the band to read */
+    int iline             /* I: the line to read in the band */
+)
+{
+    long line_offset = (long)iline * input->size.s;
+    int nlines;
+    int col;
+    int16 *line;
+
+    if (input->input_mode == INPUT_MODE_RESIDENT)
+    {
+        if (band_index != BI_THERMAL || input->therm_match_lut == NULL)
+            return &input->cube[band_index][line_offset];
+
+        /* The resident thermal band keeps the saturated value for the
+           object match, so replace it for the line */
+        line = get_line_buffer(input, lines, BI_THERMAL);
+        if (line == NULL)
+            return NULL;
+        memcpy(line, &input->cube[BI_THERMAL][line_offset],
+               input->size.s * sizeof(int16));
+        for (col = 0; col < input->size.s; col++)
+        {
+            if (line[col] == input->meta.satu_value_ref[BI_THERMAL])
+                line[col] = input->meta.satu_value_max[BI_THERMAL];
+        }
+        return line;
+    }
+
+    if (input->input_mode == INPUT_MODE_MMAP)
+    {
+        advise_mapped_lines(input, band_index, iline);
+        if (input->lut[band_index] == NULL)
+            return &input->map[band_index][line_offset];
+
+        line = get_line_buffer(input, lines, band_index);
+        if (line == NULL)
+            return NULL;
+        memcpy(line, &input->map[band_index][line_offset],
+               input->size.s * sizeof(int16));
+        apply_band_lut(input, band_index, line, input->size.s);
+        return line;
+    }
+
+    if (input->input_mode == INPUT_MODE_PREFETCH)
+    {
+        if (!alloc_prefetch_strips(input, &lines->prefetch[band_index]))
+        {
+            RETURN_ERROR("allocating line strips", "get_lines_line", NULL);
+        }
+        return get_prefetched_line(input, &lines->prefetch[band_index],
+                                   iline);
+    }
+
+    /* The line mode reads into the thread's block */
+    if (lines->block[band_index] == NULL)
+    {
+        lines->block[band_index] = malloc((long)INPUT_BLOCK_LINES
+                                          * input->size.s * sizeof(int16));
+        if (lines->block[band_index] == NULL)
+        {
+            RETURN_ERROR("allocating line block", "get_lines_line", NULL);
+        }
+        lines->block_lines[band_index] = 0;
+    }
+
+    if (iline < lines->block_first[band_index]
+        || iline >= lines->block_first[band_index]
+                    + lines->block_lines[band_index])
+    {
+        nlines = input->size.l - iline;
+        if (nlines > INPUT_BLOCK_LINES)
+            nlines = INPUT_BLOCK_LINES;
+
+        if (!GetInputBlock(input, band_index, iline, nlines,
+                           lines->block[band_index]))
+        {
+            lines->block_lines[band_index] = 0;
+            RETURN_ERROR("error reading line block", "get_lines_line", NULL);
+        }
+        lines->block_first[band_index] = iline;
+        lines->block_lines[band_index] = nlines;
+    }
+
+    return &lines->block[band_index][(long)(iline
+                                     - lines->block_first[band_index])
+                                     * input->size.s];
+}
+
+
+/*****************************************************************************
+MODULE:  GetInputLines
+
+PURPOSE: Reads the data for each band in the band set for the current line
+         into a thread's own lines, so the threads processing different lines
+         don't share any line buffer.
+
+RETURN:  Type = Bool,  Updated Input_lines_t data structure.
+    Input_lines_t:  Updated line buffers for the bands in the band set
+    Value  Description
+    -----  -------------------------------------------------------------------
+    true   No Errors
+    false  Errors encountered
+*****************************************************************************/
+bool
+GetInputLines
+(
+    Input_t *input,       /* I: input reflectance band data */
+    Input_lines_t *lines, /* I/O: the thread's lines */
+    int band_set,         /* I: the bands to read, as INPUT_BAND() bits */
+    int iline             /* I: the line to read in the bands */
+)
+{
+    int band_index;
+    char errstr[MAX_STR_LEN];
+
+    /* Check the parameters */
+    if (input == NULL || lines == NULL)
+    {
+        RETURN_ERROR("invalid input structure", "GetInputLines", false);
+    }
+    if (iline < 0 || iline >= input->size.l)
+    {
+        RETURN_ERROR("invalid line number", "GetInputLines", false);
+    }
+
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+    {
+        if (!(band_set & INPUT_BAND(band_index)))
+            continue;
+
+        if (!input->open[band_index])
+        {
+            RETURN_ERROR("file not open", "GetInputLines", false);
+        }
+
+        lines->buf[band_index] =
+            get_lines_line(input, lines, band_index, iline);
+        if (lines->buf[band_index] == NULL)
+        {
+            snprintf(errstr, sizeof(errstr),
+                     "Reading input image data for line %d, band %d",
+                     iline, band_index);
+            RETURN_ERROR(errstr, "GetInputLines", false);
         }
     }
 
@@ -537,6 +1534,76 @@ GetInputThermLine
 }
 
 
+/*****************************************************************************
+MODULE:  FreeInputLines
+
+PURPOSE: Frees the lines a processing thread read the input bands into.  In
+         the prefetch mode the lines are first taken back from the reader,
+         once it has finished any strip it is reading into them.
+*****************************************************************************/
+void
+FreeInputLines
+(
+    Input_lines_t *lines /* I: the thread's lines */
+)
+{
+    Input_t *input;
+    Input_lines_t **link;
+    int band_index;
+    int slot;
+    bool filling;
+
+    if (lines == NULL)
+        return;
+
+    input = lines->input;
+    if (input->reader_running)
+    {
+        pthread_mutex_lock(&input->lock);
+        for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+            lines->prefetch[band_index].active = false;
+
+        do
+        {
+            filling = false;
+            for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+            {
+                for (slot = 0; slot < INPUT_PREFETCH_STRIPS; slot++)
+                {
+                    if (lines->prefetch[band_index].state[slot]
+                        == PREFETCH_FILLING)
+                    {
+                        filling = true;
+                    }
+                }
+            }
+            if (filling)
+                pthread_cond_wait(&input->changed, &input->lock);
+        } while (filling);
+
+        for (link = &input->prefetch_lines; *link != NULL;
+             link = &(*link)->next)
+        {
+            if (*link == lines)
+            {
+                *link = lines->next;
+                input->prefetch_lines_count--;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&input->lock);
+    }
+
+    for (band_index = 0; band_index < MAX_BAND_COUNT; band_index++)
+    {
+        free(lines->block[band_index]);
+        for (slot = 0; slot < INPUT_PREFETCH_STRIPS; slot++)
+            free(lines->prefetch[band_index].data[slot]);
+    }
+    free(lines);
+}
+
+
 #define DATE_STRING_LEN (50)
 #define TIME_STRING_LEN (50)
 
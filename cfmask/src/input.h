@@ -2,10 +2,42 @@
 #define INPUT_H
 
 
+#include <pthread.h>
+
 #include "const.h"
 #include "cfmask.h"
 
 
+/* Bit for a band in a band set, and the reflective bands every sensor has */
+#define INPUT_BAND(band_index) (1 << (band_index))
+#define INPUT_REFLECTIVE_BANDS                                        \
+    (INPUT_BAND(BI_BLUE) | INPUT_BAND(BI_GREEN) | INPUT_BAND(BI_RED)  \
+     | INPUT_BAND(BI_NIR) | INPUT_BAND(BI_SWIR_1) | INPUT_BAND(BI_SWIR_2))
+
+/* Byte alignment of the resident band planes */
+#define INPUT_CUBE_ALIGN 64
+
+/* Number of entries in a band lookup table, one for each int16 value */
+#define INPUT_LUT_SIZE 65536
+
+/* Number of lines read with each block read by a thread's lines in the
+   line mode */
+#define INPUT_BLOCK_LINES 128
+
+/* Number of lines the kernel is asked to read ahead in the mapped mode */
+#define INPUT_MMAP_ADVISE_LINES 256
+
+/* Number of lines in each prefetched strip, and the number of strips in the
+   ring for each band */
+#define INPUT_PREFETCH_LINES 64
+#define INPUT_PREFETCH_STRIPS 2
+
+/* States of a prefetch strip buffer */
+#define PREFETCH_FREE    0 /* Available to the reader */
+#define PREFETCH_FILLING 1 /* Being read by the reader */
+#define PREFETCH_READY   2 /* Read and available to the processing */
+
+
 /* Structure for the metadata */
 typedef struct
 {
@@ -26,6 +58,26 @@ typedef struct
 } Input_meta_t;
 
 
+/* Structure for the prefetched strips of one band */
+typedef struct
+{
+    int16 *data[INPUT_PREFETCH_STRIPS]; /* Strip buffers */
+    int strip[INPUT_PREFETCH_STRIPS];   /* Strip held in each buffer */
+    int state[INPUT_PREFETCH_STRIPS];   /* PREFETCH_* state of each buffer */
+    int generation[INPUT_PREFETCH_STRIPS]; /* Generation each buffer was
+                                              filled for */
+    int current_generation;   /* Bumped when the processing restarts the band
+                                 at a strip which isn't next, so strips still
+                                 being read for the old position are dropped */
+    int next_strip;           /* Next strip the reader will read */
+    bool active;              /* Indicates the band has been requested */
+} Input_prefetch_t;
+
+
+/* The lines of the input bands read by one processing thread */
+struct Input_lines_s;
+
+
 /* Structure for the 'input' data type */
 typedef struct
 {
@@ -35,25 +87,78 @@ typedef struct
     int num_toa_bands;          /* Number of input TOA reflectance bands */
     Img_coord_int_t size;       /* Input file size */
     char *file_name[MAX_BAND_COUNT]; /* Name of the input TOA image files */
-    FILE *fp_bin[MAX_BAND_COUNT]; /* File ptr for TOA refl binary files */
+    int fd_bin[MAX_BAND_COUNT]; /* File descriptor for TOA refl binary
+                                   files */
     bool open[MAX_BAND_COUNT];  /* Indicates whether the specific input
                                    TOA reflectance file is open for access;
                                    'true' = open, 'false' = not open */
-    int16 *buf[MAX_BAND_COUNT]; /* Input data buffer (one line of data) */
+    int input_mode;             /* Specifies how the bands are accessed */
+    int16 *lut[MAX_BAND_COUNT]; /* Lookup table replacing each value read
+                                   for the band; NULL if the values are used
+                                   as they are */
+    int16 *therm_match_lut;     /* Lookup table for the thermal band as the
+                                   object match reads it, leaving the
+                                   saturated value as it is; NULL if it is
+                                   the same as the thermal band's table */
+    int16 *cube[MAX_BAND_COUNT]; /* Resident band data (all lines of data);
+                                    only allocated for the resident mode */
+    int16 *map[MAX_BAND_COUNT]; /* Mapped band data (all lines of data);
+                                   only mapped for the mapped mode */
+    size_t map_bytes[MAX_BAND_COUNT]; /* Size of each mapping in bytes */
+    pthread_t reader;           /* Background reader for the prefetch mode */
+    pthread_mutex_t lock;       /* Guards the prefetch state */
+    pthread_cond_t changed;     /* Signals a prefetch state change */
+    bool reader_running;        /* Indicates the reader thread was started */
+    bool reader_stop;           /* Tells the reader thread to exit */
+    bool reader_error;          /* Indicates the reader thread failed */
+    struct Input_lines_s *prefetch_lines; /* Lines of the processing threads
+                                             the reader prefetches */
+    int prefetch_lines_count;   /* Number of the threads' lines */
     float dsun_doy[366];        /* Array of earth/sun distances for each DOY;
                                    read from the EarthSunDistance.txt file */
 } Input_t;
 
 
+/* Structure for the lines of the input bands read by one processing thread;
+   each thread has its own, so several threads can read lines of the same
+   input at the same time */
+typedef struct Input_lines_s
+{
+    int16 *buf[MAX_BAND_COUNT]; /* Current line of each band; points into the
+                                   cube, the mapping, the block or the
+                                   prefetched strips */
+    int16 *block[MAX_BAND_COUNT]; /* Lines read for each band when the input
+                                     doesn't hold them itself */
+    int block_first[MAX_BAND_COUNT]; /* First line held in each block */
+    int block_lines[MAX_BAND_COUNT]; /* Number of lines held in each block */
+    Input_prefetch_t prefetch[MAX_BAND_COUNT]; /* Prefetched strips of the
+                                                  thread's lines; only used
+                                                  for the prefetch mode */
+    Input_t *input;             /* Input the lines are read from */
+    struct Input_lines_s *next; /* Next thread's lines the reader
+                                   prefetches */
+} Input_lines_t;
+
+
 /* Prototypes */
 Input_t *
-OpenInput(Espa_internal_meta_t *metadata, bool use_thermal);
+OpenInput(Espa_internal_meta_t *metadata, int band_set, int input_mode);
 
 bool
-GetInputLine(Input_t *input, int iband, int iline);
+GetInputThermBand(Input_t *input, int16 *dst);
 
 bool
-GetInputThermLine(Input_t *input, int iline);
+GetInputBlock(Input_t *input, int band_index, int first_line, int nlines,
+              int16 *dst);
+
+Input_lines_t *
+CreateInputLines(Input_t *input);
+
+bool
+GetInputLines(Input_t *input, Input_lines_t *lines, int band_set, int iline);
+
+void
+FreeInputLines(Input_lines_t *lines);
 
 bool
 CloseInput(Input_t *input);
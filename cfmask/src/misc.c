@@ -84,75 +84,296 @@ int prctile
 
 
 /*****************************************************************************
-MODULE:  prctile2
+MODULE:  histogram_init
 
-PURPOSE:  Calculate Percentile of a floating point array
+PURPOSE: Initialize an empty histogram
+
+RETURN: None
+
+NOTES:
+1. The minimum and maximum start from the values given and only widen as
+   samples are added, so the percentile search starts and ends at the
+   rounded given values unless a sample falls outside them.
+*****************************************************************************/
+void histogram_init
+(
+    Histogram_t *hist, /* O: histogram to initialize */
+    float min,         /* I: starting minimum value */
+    float max          /* I: starting maximum value */
+)
+{
+    hist->count = NULL;
+    hist->first = 0;
+    hist->nbins = 0;
+    hist->nums = 0;
+    hist->min = min;
+    hist->max = max;
+}
+
+
+/*****************************************************************************
+MODULE:  histogram_cover
+
+PURPOSE: Grow the bins of a histogram so they cover the low to high values
 
 RETURN: SUCCESS
         FAILURE
 *****************************************************************************/
-int prctile2
+static int histogram_cover
 (
-    float *array, /* I: input data pointer */
-    int nums,     /* I: number of input data array */
-    float min,    /* I: minimum value in the input data array */
-    float max,    /* I: maximum value in the input data array  */
-    float prct,   /* I: percentage threshold */
-    float *result /* O: percentile calculated */
+    Histogram_t *hist, /* I/O: histogram to grow */
+    int low,           /* I: lowest value to cover */
+    int high           /* I: highest value to cover */
 )
 {
-    int *interval;      /* array to store data in an interval */
-    int i, j;           /* loop variables */
-    int start, end;     /* start/end variables */
-    int loops;          /* data range of input data */
-    float inv_nums_100; /* inverse of the nums value * 100 */
-    int sum;
+    int *count;     /* new bins */
+    int first;      /* value of the first new bin */
+    int last;       /* value of the last new bin */
+    int nbins;      /* number of new bins */
+    int extra;      /* bins added beyond the ones needed */
 
-    /* Just return 0 if no input value */
-    if (nums == 0)
+    if (hist->nbins > 0)
     {
-        *result = 0.0;
-        return SUCCESS;
+        if (low >= hist->first && high < hist->first + hist->nbins)
+            return SUCCESS;
+
+        if (low > hist->first)
+            low = hist->first;
+        if (high < hist->first + hist->nbins - 1)
+            high = hist->first + hist->nbins - 1;
     }
-    else
+
+    /* Allocate at least twice the current bins, so growing one value at a
+       time doesn't copy the bins for every value */
+    nbins = high - low + 1;
+    if (nbins < 2 * hist->nbins)
+        nbins = 2 * hist->nbins;
+    if (nbins < HISTOGRAM_MIN_BINS)
+        nbins = HISTOGRAM_MIN_BINS;
+    extra = nbins - (high - low + 1);
+
+    /* Put the extra bins on the side that is growing */
+    first = low;
+    last = high + extra;
+    if (hist->nbins > 0 && low < hist->first)
     {
-        *result = max;
+        if (high >= hist->first + hist->nbins)
+        {
+            first = low - extra / 2;
+            last = high + (extra - extra / 2);
+        }
+        else
+        {
+            first = low - extra;
+            last = high;
+        }
     }
 
-    start = (int)rint(min);
-    end = (int)rint(max);
+    count = calloc(last - first + 1, sizeof(int));
+    if (count == NULL)
+    {
+        RETURN_ERROR("Invalid memory allocation", "histogram_cover", FAILURE);
+    }
 
-    loops = end - start + 2;
+    if (hist->nbins > 0)
+    {
+        memcpy(&count[hist->first - first], hist->count,
+               hist->nbins * sizeof(int));
+        free(hist->count);
+    }
 
-    interval = calloc(loops, sizeof(int));
-    if (interval == NULL)
+    hist->count = count;
+    hist->first = first;
+    hist->nbins = last - first + 1;
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  histogram_add
+
+PURPOSE: Add an integer sample to a histogram
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+int histogram_add
+(
+    Histogram_t *hist, /* I/O: histogram */
+    int16 value        /* I: sample to add */
+)
+{
+    if (value < hist->first || value >= hist->first + hist->nbins
+        || hist->nbins == 0)
     {
-        RETURN_ERROR("Invalid memory allocation", "prctile2", FAILURE);
+        if (histogram_cover(hist, value, value) != SUCCESS)
+        {
+            RETURN_ERROR("Growing the histogram", "histogram_add", FAILURE);
+        }
     }
 
-    for (i = 0; i < nums; i++)
+    hist->count[value - hist->first]++;
+    hist->nums++;
+    if (value < hist->min)
+        hist->min = value;
+    if (value > hist->max)
+        hist->max = value;
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  histogram_add_float
+
+PURPOSE: Add a floating point sample to a histogram
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. The sample goes to the bin of its nearest integer.
+*****************************************************************************/
+int histogram_add_float
+(
+    Histogram_t *hist, /* I/O: histogram */
+    float value        /* I: sample to add */
+)
+{
+    int bin = (int)rint(value); /* bin of the sample */
+
+    if (bin < hist->first || bin >= hist->first + hist->nbins
+        || hist->nbins == 0)
     {
-        interval[(int)rint(array[i]) - start]++;
+        if (histogram_cover(hist, bin, bin) != SUCCESS)
+        {
+            RETURN_ERROR("Growing the histogram", "histogram_add_float",
+                         FAILURE);
+        }
     }
 
-    inv_nums_100 = (1.0 / nums) * 100.0;
+    hist->count[bin - hist->first]++;
+    hist->nums++;
+    if (value < hist->min)
+        hist->min = value;
+    if (value > hist->max)
+        hist->max = value;
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  histogram_merge
+
+PURPOSE: Add the samples of one histogram to another, such as the
+         histograms accumulated separately by each thread
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+int histogram_merge
+(
+    Histogram_t *hist,        /* I/O: histogram to add the samples to */
+    const Histogram_t *other  /* I: histogram with the samples to add */
+)
+{
+    int i;
+
+    if (other->nbins > 0)
+    {
+        if (histogram_cover(hist, other->first,
+                            other->first + other->nbins - 1) != SUCCESS)
+        {
+            RETURN_ERROR("Growing the histogram", "histogram_merge",
+                         FAILURE);
+        }
+
+        for (i = 0; i < other->nbins; i++)
+            hist->count[other->first - hist->first + i] += other->count[i];
+    }
+
+    hist->nums += other->nums;
+    if (other->min < hist->min)
+        hist->min = other->min;
+    if (other->max > hist->max)
+        hist->max = other->max;
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  histogram_prctile
+
+PURPOSE: Calculate Percentile of the samples in a histogram
+
+RETURN: None
+
+NOTES:
+1. The bins are summed from the rounded minimum up, and the first value at
+   which the sum reaches the percentage is returned.  The maximum is
+   returned if it never does, and 0 if there are no samples.
+*****************************************************************************/
+void histogram_prctile
+(
+    const Histogram_t *hist, /* I: histogram */
+    float prct,              /* I: percentage threshold */
+    float *result            /* O: percentile calculated */
+)
+{
+    int value;          /* value of the current bin */
+    int start, end;     /* values of the first and last bins to search */
+    float inv_nums_100; /* inverse of the nums value * 100 */
+    int sum;
+
+    /* Just return 0 if no input value */
+    if (hist->nums == 0)
+    {
+        *result = 0.0;
+        return;
+    }
+    else
+    {
+        *result = hist->max;
+    }
+
+    start = (int)rint(hist->min);
+    end = (int)rint(hist->max);
+
+    inv_nums_100 = (1.0 / hist->nums) * 100.0;
     sum = 0;
-    for (j = 0; j < loops; j++)
+    for (value = start; value <= end; value++)
     {
-        sum += interval[j];
+        if (value >= hist->first && value < hist->first + hist->nbins)
+            sum += hist->count[value - hist->first];
         if ((sum * inv_nums_100) >= prct)
         {
-            *result = start + j;
+            *result = value;
             break;
         }
-        else
-        {
-            continue;
-        }
     }
-    free(interval);
+}
 
-    return SUCCESS;
+
+/*****************************************************************************
+MODULE:  histogram_free
+
+PURPOSE: Release the bins of a histogram
+
+RETURN: None
+*****************************************************************************/
+void histogram_free
+(
+    Histogram_t *hist /* I/O: histogram */
+)
+{
+    free(hist->count);
+    hist->count = NULL;
+    hist->first = 0;
+    hist->nbins = 0;
+    hist->nums = 0;
 }
 
 
@@ -185,6 +406,13 @@ int get_args
     int *sdpix,        /* O: shadow_pixel buffer used for image dilate */
     bool *use_cirrus,  /* O: use Cirrus data */
     bool *use_thermal, /* O: use Thermal data */
+    int *input_mode,   /* O: how the input bands are accessed */
+    int *fill_engine,  /* O: how the local minima are filled */
+    int *fill_scale,   /* O: block size of the approximate fill */
+    bool *fill_compare,/* O: compare the approximate fill to the exact one */
+    int *height_stride,/* O: stride of the coarse cloud height search */
+    bool *height_compare, /* O: compare the coarse height search to the
+                                exhaustive one */
     bool *verbose      /* O: verbose */
 )
 {
@@ -197,6 +425,9 @@ int get_args
     static float cloud_prob_default = 22.5; /* Default cloud probability */
     static int use_cirrus_flag = 0;  /* Default to not using Cirrus band data */
     static int use_thermal_flag = 1; /* Default to using Thermal band data */
+    static int fill_compare_flag = 0; /* Default to not comparing fills */
+    static int height_compare_flag = 0; /* Default to not comparing height
+                                           searches */
     char errmsg[MAX_STR_LEN];               /* error message */
     static struct option long_options[] = {
         {"xml", required_argument, 0, 'i'},
@@ -205,6 +436,12 @@ int get_args
         {"prob", required_argument, 0, 'p'},
         {"cldpix", required_argument, 0, 'c'},
         {"sdpix", required_argument, 0, 's'},
+        {"input-mode", required_argument, 0, 'm'},
+        {"fill-engine", required_argument, 0, 'f'},
+        {"fill-scale", required_argument, 0, 'a'},
+        {"fill-compare", no_argument, &fill_compare_flag, 1},
+        {"height-stride", required_argument, 0, 'g'},
+        {"height-compare", no_argument, &height_compare_flag, 1},
         {"verbose", no_argument, &verbose_flag, 1},
         {"version", no_argument, 0, 'v'},
         {"help", no_argument, 0, 'h'},
@@ -215,6 +452,10 @@ int get_args
     *cloud_prob = cloud_prob_default;
     *cldpix = cldpix_default;
     *sdpix = sdpix_default;
+    *input_mode = INPUT_MODE_LINE;
+    *fill_engine = FILL_ENGINE_QUEUE;
+    *fill_scale = 1;
+    *height_stride = 1;
 
     /* Loop through all the cmd-line options */
     opterr = 0; /* turn off getopt_long error msgs as we'll print our own */
@@ -262,6 +503,56 @@ int get_args
             *sdpix = atoi(optarg);
             break;
 
+        case 'm':          /* input access mode */
+            if (strcmp(optarg, "line") == 0)
+                *input_mode = INPUT_MODE_LINE;
+            else if (strcmp(optarg, "resident") == 0)
+                *input_mode = INPUT_MODE_RESIDENT;
+            else if (strcmp(optarg, "mmap") == 0)
+                *input_mode = INPUT_MODE_MMAP;
+            else if (strcmp(optarg, "prefetch") == 0)
+                *input_mode = INPUT_MODE_PREFETCH;
+            else
+            {
+                sprintf(errmsg, "Unknown input mode %s", optarg);
+                usage();
+                RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+            }
+            break;
+
+        case 'f':          /* local minima fill engine */
+            if (strcmp(optarg, "queue") == 0)
+                *fill_engine = FILL_ENGINE_QUEUE;
+            else if (strcmp(optarg, "hybrid") == 0)
+                *fill_engine = FILL_ENGINE_HYBRID;
+            else
+            {
+                sprintf(errmsg, "Unknown fill engine %s", optarg);
+                usage();
+                RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+            }
+            break;
+
+        case 'a':          /* block size of the approximate fill */
+            *fill_scale = atoi(optarg);
+            if (*fill_scale < 1)
+            {
+                sprintf(errmsg, "Invalid fill scale %s", optarg);
+                usage();
+                RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+            }
+            break;
+
+        case 'g':          /* stride of the coarse cloud height search */
+            *height_stride = atoi(optarg);
+            if (*height_stride < 1)
+            {
+                sprintf(errmsg, "Invalid height stride %s", optarg);
+                usage();
+                RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+            }
+            break;
+
         case '?':
         default:
             sprintf(errmsg, "Unknown option %s", argv[optind - 1]);
@@ -291,6 +582,32 @@ int get_args
     else
         *use_thermal = false;
 
+    /* Check the fill comparison flag, which only has an approximate fill
+       to compare with a fill scale above 1 */
+    if (fill_compare_flag)
+        *fill_compare = true;
+    else
+        *fill_compare = false;
+    if (*fill_compare && *fill_scale < 2)
+    {
+        sprintf(errmsg, "--fill-compare needs a --fill-scale above 1");
+        usage();
+        RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+    }
+
+    /* Check the height search comparison flag, which only has a coarse
+       search to compare with a height stride above 1 */
+    if (height_compare_flag)
+        *height_compare = true;
+    else
+        *height_compare = false;
+    if (*height_compare && *height_stride < 2)
+    {
+        sprintf(errmsg, "--height-compare needs a --height-stride above 1");
+        usage();
+        RETURN_ERROR(errmsg, FUNC_NAME, FAILURE);
+    }
+
     /* Check the verbose flag */
     if (verbose_flag)
         *verbose = true;
@@ -303,6 +620,28 @@ int get_args
         printf("cloud_probability = %f\n", *cloud_prob);
         printf("cloud_pixel_buffer = %d\n", *cldpix);
         printf("shadow_pixel_buffer = %d\n", *sdpix);
+        if (*input_mode == INPUT_MODE_RESIDENT)
+            printf("input_mode = resident\n");
+        else if (*input_mode == INPUT_MODE_MMAP)
+            printf("input_mode = mmap\n");
+        else if (*input_mode == INPUT_MODE_PREFETCH)
+            printf("input_mode = prefetch\n");
+        else
+            printf("input_mode = line\n");
+        if (*fill_engine == FILL_ENGINE_HYBRID)
+            printf("fill_engine = hybrid\n");
+        else
+            printf("fill_engine = queue\n");
+        printf("fill_scale = %d\n", *fill_scale);
+        if (*fill_compare)
+            printf("fill_compare = true\n");
+        else
+            printf("fill_compare = false\n");
+        printf("height_stride = %d\n", *height_stride);
+        if (*height_compare)
+            printf("height_compare = true\n");
+        else
+            printf("height_compare = false\n");
         if (*use_cirrus)
             printf("use_cirrus = true\n");
         else
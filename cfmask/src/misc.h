@@ -4,6 +4,24 @@
 #include <stdbool.h>
 
 
+/* Smallest number of bins allocated for a histogram */
+#define HISTOGRAM_MIN_BINS 256
+
+
+/* Histogram with one bin per integer value, used to get percentiles without
+   keeping the samples.  The bins only cover the range of the samples added
+   and grow as needed. */
+typedef struct
+{
+    int *count;   /* number of samples in each bin */
+    int first;    /* value of the first bin */
+    int nbins;    /* number of bins */
+    int nums;     /* number of samples */
+    float min;    /* minimum sample value */
+    float max;    /* maximum sample value */
+} Histogram_t;
+
+
 int prctile
 (
     int16 *array, /* I: input data pointer */
@@ -15,14 +33,46 @@ int prctile
 );
 
 
-int prctile2
+void histogram_init
 (
-    float *array, /* I: input data pointer */
-    int nums,     /* I: number of input data array */
-    float min,    /* I: minimum value in the input data array */
-    float max,    /* I: maximum value in the input data array  */
-    float prct,   /* I: percentage threshold */
-    float *result /* O: percentile calculated */
+    Histogram_t *hist, /* O: histogram to initialize */
+    float min,         /* I: starting minimum value */
+    float max          /* I: starting maximum value */
+);
+
+
+int histogram_add
+(
+    Histogram_t *hist, /* I/O: histogram */
+    int16 value        /* I: sample to add */
+);
+
+
+int histogram_add_float
+(
+    Histogram_t *hist, /* I/O: histogram */
+    float value        /* I: sample to add */
+);
+
+
+int histogram_merge
+(
+    Histogram_t *hist,        /* I/O: histogram to add the samples to */
+    const Histogram_t *other  /* I: histogram with the samples to add */
+);
+
+
+void histogram_prctile
+(
+    const Histogram_t *hist, /* I: histogram */
+    float prct,              /* I: percentage threshold */
+    float *result            /* O: percentile calculated */
+);
+
+
+void histogram_free
+(
+    Histogram_t *hist /* I/O: histogram */
 );
 
 
@@ -36,6 +86,13 @@ int get_args
     int *sdpix,        /* O: shadow_pixel buffer used for image dilate  */
     bool *use_cirrus,  /* O: use Cirrus data */
     bool *use_thermal, /* O: use Thermal data */
+    int *input_mode,   /* O: how the input bands are accessed */
+    int *fill_engine,  /* O: how the local minima are filled */
+    int *fill_scale,   /* O: block size of the approximate fill */
+    bool *fill_compare,/* O: compare the approximate fill to the exact one */
+    int *height_stride,/* O: stride of the coarse cloud height search */
+    bool *height_compare, /* O: compare the coarse height search to the
+                                exhaustive one */
     bool *verbose      /* O: verbose */
 );
 
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <math.h>
 
 
@@ -24,6 +25,168 @@
 #define MAX_CLOUD_TYPE 3000000
 #define MIN_CLOUD_OBJ 9
 
+/* Clouds of at least this many pixels are matched one at a time, with the
+   threads sharing out their pixels; the smaller clouds are matched at the
+   same time, one to a thread */
+#define PARALLEL_CLOUD_PIXELS 100000
+
+/* Maximum number of cloud base heights scored at the same time for one
+   cloud */
+#define MAX_BATCH_HEIGHTS 64
+
+/* Number of cloud pixels moved to their true positions at a time while a
+   height is scored */
+#define SCORE_BLOCK_PIXELS 256
+
+
+/* Structure for the bounding box of a cloud, with a bitmap holding one bit
+   for each pixel of the box that is part of the cloud */
+typedef struct
+{
+    int first_row;          /* First row of the box */
+    int first_col;          /* First column of the box */
+    int rows;               /* Number of rows in the box */
+    int cols;               /* Number of columns in the box */
+    int row_bytes;          /* Number of bytes for each row of the bitmap */
+    unsigned char *bits;    /* Bitmap of the cloud pixels */
+    size_t bits_allocated;  /* Number of bytes allocated for the bitmap */
+} CLOUD_BOX_T;
+
+
+/* Structure for the scene values the shadow match of every cloud uses */
+typedef struct
+{
+    int nrows;                  /* Number of rows */
+    int ncols;                  /* Number of columns */
+    unsigned char *pixel_mask;  /* Pixel mask */
+    unsigned char *cal_mask;    /* Calibration mask the shadows are stamped
+                                   into */
+    int16 *temp_data;           /* Brightness temperature; NULL without
+                                   thermal data */
+    RLE_T *cloud_runs;          /* Array of cloud runs */
+    bool use_thermal;           /* Indicates thermal data is used */
+    int data_counter;           /* Count of imagery pixels */
+    int i_step;                 /* Cloud base height step (m) */
+    int height_stride;          /* Height steps between the heights of the
+                                   coarse search; 1 for the exhaustive
+                                   search */
+    bool height_compare;        /* Also run the exhaustive search and count
+                                   the clouds matched at other heights */
+    float t_templ;              /* Percentile of low background temp */
+    float t_temph;              /* Percentile of high background temp */
+    float a, b, c;              /* Coefficients from viewgeo */
+    float inv_a_b_distance;     /* Precalculated for truecloud_dist_par */
+    float inv_cos_omiga_per_minus_par; /* Precalculated for
+                                          truecloud_dist_par */
+    float cos_omiga_par;        /* Precalculated for truecloud_move */
+    float sin_omiga_par;        /* Precalculated for truecloud_move */
+    float inv_shadow_step;      /* Inverse of the shadow step (m) */
+    float shadow_unit_vec_x;    /* Shadow direction */
+    float shadow_unit_vec_y;
+    float sun_az;               /* Solar azimuth angle (degrees) */
+} SHADOW_MATCH_T;
+
+
+/* Structure for the buffers a thread matches the shadow of a cloud in,
+   grown as larger clouds come along */
+typedef struct
+{
+    int pixels_allocated;   /* Number of cloud pixels the buffers hold */
+    int *orig_row;          /* Original cloud locations */
+    int *orig_col;
+    float *dist_par;        /* Distance of each pixel from the central
+                               perpendicular, from truecloud_dist_par */
+    int16 *temp_obj;        /* Temperature of each pixel */
+    CLOUD_BOX_T box;        /* Bounding box and bitmap of the cloud */
+    long heights_scored;    /* Count of the heights scored by the search */
+    long exhaustive_heights; /* Count of the heights scored by the
+                                exhaustive search it is compared to */
+    int clouds_compared;    /* Count of the clouds compared */
+    int clouds_differ;      /* Count of the clouds the searches match at
+                               different heights */
+} SHADOW_SCRATCH_T;
+
+
+/*****************************************************************************
+MODULE:  build_cloud_box
+
+PURPOSE: Build the bitmap of a cloud's pixels in its bounding box, growing
+         the bitmap memory if needed
+
+RETURN: SUCCESS or FAILURE
+*****************************************************************************/
+static int build_cloud_box
+(
+    const CLOUD_T *cloud, /* I: cloud record with the bounding box */
+    int *rows,          /* I: row of each cloud pixel */
+    int *cols,          /* I: column of each cloud pixel */
+    CLOUD_BOX_T *box    /* I/O: cloud box to build */
+)
+{
+    int min_row = cloud->first_row;
+    int min_col = cloud->first_col;
+    size_t bits_size;
+    unsigned char *new_bits;
+    int index;
+
+    box->first_row = min_row;
+    box->first_col = min_col;
+    box->rows = cloud->last_row - min_row + 1;
+    box->cols = cloud->last_col - min_col + 1;
+    box->row_bytes = (box->cols + 7) / 8;
+
+    bits_size = (size_t)box->rows * box->row_bytes;
+    if (bits_size > box->bits_allocated)
+    {
+        new_bits = realloc(box->bits, bits_size);
+        if (new_bits == NULL)
+            return FAILURE;
+        box->bits = new_bits;
+        box->bits_allocated = bits_size;
+    }
+    memset(box->bits, 0, bits_size);
+
+    for (index = 0; index < cloud->pixel_count; index++)
+    {
+        int box_col = cols[index] - min_col;
+
+        box->bits[(rows[index] - min_row) * box->row_bytes + box_col / 8]
+            |= 1 << (box_col % 8);
+    }
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  cloud_box_has_pixel
+
+PURPOSE: Check whether an image pixel is part of the cloud in a cloud box
+
+RETURN: true if the pixel is part of the cloud
+*****************************************************************************/
+static inline bool cloud_box_has_pixel
+(
+    const CLOUD_BOX_T *box, /* I: cloud box */
+    int row,                /* I: image row */
+    int col                 /* I: image column */
+)
+{
+    unsigned int box_row = row - box->first_row;
+    unsigned int box_col = col - box->first_col;
+
+    /* Pixels before the box wrap around to large values, so one comparison
+       covers both sides */
+    if (box_row >= (unsigned int)box->rows
+        || box_col >= (unsigned int)box->cols)
+    {
+        return false;
+    }
+
+    return (box->bits[box_row * box->row_bytes + box_col / 8]
+            >> (box_col % 8)) & 1;
+}
+
 
 /*****************************************************************************
 MODULE:  viewgeo
@@ -84,54 +247,66 @@ void viewgeo
 
 
 /*****************************************************************************
-MODULE:  mat_truecloud
+MODULE:  truecloud_dist_par
 
-PURPOSE:  Calculate shadow pixel locations of a true cloud segment
+PURPOSE:  Calculate the distance of a cloud pixel from the central
+          perpendicular, in the parallel direction
 
-RETURN: None
+RETURN: The distance (unit: pixel)
 *****************************************************************************/
-void mat_truecloud
+static inline float truecloud_dist_par
 (
-    int *x,              /* I: input pixel cloumn */
-    int *y,              /* I: input pixel row */
-    int array_length,    /* I: number of input array */
-    float *h,            /* I: cloud pixel height */
+    int x,               /* I: input pixel cloumn */
+    int y,               /* I: input pixel row */
     float a,             /* I: coefficient */
     float b,             /* I: coefficient */
     float c,             /* I: coefficient */
     float inv_a_b_distance, /* I: precalculated */
-    float inv_cos_omiga_per_minus_par, /* I: precalculated */
+    float inv_cos_omiga_per_minus_par /* I: precalculated */
+)
+{
+    float dist;      /* distance */
+
+    dist = (a * (float)x + b * (float)y + c) * inv_a_b_distance;
+
+    /* from the cetral perpendicular (unit: pixel) */
+    return dist * inv_cos_omiga_per_minus_par;
+}
+
+
+/*****************************************************************************
+MODULE:  truecloud_move
+
+PURPOSE:  Calculate the true location of a cloud pixel at a height
+
+RETURN: None
+*****************************************************************************/
+static inline void truecloud_move
+(
+    int x,               /* I: input pixel cloumn */
+    int y,               /* I: input pixel row */
+    float dist_par,      /* I: distance from truecloud_dist_par */
+    float h,             /* I: cloud pixel height */
     float cos_omiga_par, /* I: precalculated */
     float sin_omiga_par, /* I: precalculated */
     float *x_new,        /* O: output pixel cloumn */
     float *y_new         /* O: output pixel row */
 )
 {
-    float dist;      /* distance */
-    float dist_par;  /* distance in parallel direction */
     float dist_move; /* distance moved */
     float delt_x;    /* change in column */
     float delt_y;    /* change in row */
 
     float height = 705000.0; /* average Landsat 4,5,&7 height (m) */
-    int i;
-
-    for (i = 0; i < array_length; i++)
-    {
-        dist = (a * (float)x[i] + b * (float)y[i] + c) * inv_a_b_distance;
-
-        /* from the cetral perpendicular (unit: pixel) */
-        dist_par = dist * inv_cos_omiga_per_minus_par;
 
-        /* cloud move distance (m) */
-        dist_move = (dist_par * h[i]) / height;
+    /* cloud move distance (m) */
+    dist_move = (dist_par * h) / height;
 
-        delt_x = dist_move * cos_omiga_par;
-        delt_y = dist_move * sin_omiga_par;
+    delt_x = dist_move * cos_omiga_par;
+    delt_y = dist_move * sin_omiga_par;
 
-        x_new[i] = x[i] + delt_x; /* new x, j */
-        y_new[i] = y[i] + delt_y; /* new y, i */
-    }
+    *x_new = x + delt_x; /* new x, j */
+    *y_new = y + delt_y; /* new y, i */
 }
 
 
@@ -232,6 +407,638 @@ void image_dilate
 }
 
 
+/*****************************************************************************
+MODULE:  grow_shadow_scratch
+
+PURPOSE: Make sure the scratch buffers of a thread can hold a cloud
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+static int grow_shadow_scratch
+(
+    SHADOW_SCRATCH_T *scratch, /* I/O: scratch buffers of the thread */
+    int cloud_pixels           /* I: number of pixels in the cloud */
+)
+{
+    char *FUNC_NAME = "grow_shadow_scratch";
+    void *new_buffer;
+
+    if (cloud_pixels <= scratch->pixels_allocated)
+        return SUCCESS;
+
+#define GROW_SCRATCH_BUFFER(buffer)                                         \
+    new_buffer = realloc(scratch->buffer,                                   \
+                         cloud_pixels * sizeof(*scratch->buffer));          \
+    if (new_buffer == NULL)                                                 \
+        RETURN_ERROR("Allocating cloud memory", FUNC_NAME, FAILURE);        \
+    scratch->buffer = new_buffer;
+
+    GROW_SCRATCH_BUFFER(orig_row)
+    GROW_SCRATCH_BUFFER(orig_col)
+    GROW_SCRATCH_BUFFER(dist_par)
+    GROW_SCRATCH_BUFFER(temp_obj)
+
+#undef GROW_SCRATCH_BUFFER
+
+    scratch->pixels_allocated = cloud_pixels;
+
+    return SUCCESS;
+}
+
+
+/*****************************************************************************
+MODULE:  free_shadow_scratch
+
+PURPOSE: Release the scratch buffers of a thread
+
+RETURN: None
+*****************************************************************************/
+static void free_shadow_scratch
+(
+    SHADOW_SCRATCH_T *scratch /* I/O: scratch buffers of the thread */
+)
+{
+    free(scratch->orig_row);
+    free(scratch->orig_col);
+    free(scratch->dist_par);
+    free(scratch->temp_obj);
+    free(scratch->box.bits);
+    memset(scratch, 0, sizeof(*scratch));
+}
+
+
+/*****************************************************************************
+MODULE:  compare_cloud_size
+
+PURPOSE: qsort comparison putting the largest clouds first, and clouds of
+         the same size in image order
+
+RETURN: Negative, zero or positive like any qsort comparison
+*****************************************************************************/
+static int compare_cloud_size
+(
+    const void *left, /* I: pointer to the first cloud record pointer */
+    const void *right /* I: pointer to the second cloud record pointer */
+)
+{
+    const CLOUD_T *left_cloud = *(const CLOUD_T * const *)left;
+    const CLOUD_T *right_cloud = *(const CLOUD_T * const *)right;
+
+    if (left_cloud->pixel_count != right_cloud->pixel_count)
+        return left_cloud->pixel_count > right_cloud->pixel_count ? -1 : 1;
+
+    return left_cloud->first_run - right_cloud->first_run;
+}
+
+
+/*****************************************************************************
+MODULE:  pixel_cloud_height
+
+PURPOSE: Calculate the height of a cloud pixel at a cloud base height
+
+RETURN: The cloud pixel height (m)
+*****************************************************************************/
+static inline float pixel_cloud_height
+(
+    const SHADOW_MATCH_T *match,      /* I: scene values for the match */
+    const SHADOW_SCRATCH_T *scratch,  /* I: buffers holding the cloud */
+    int index,                        /* I: index of the cloud pixel */
+    float t_obj,                      /* I: cloud base temperature */
+    int base_h                        /* I: cloud base height (m) */
+)
+{
+    float inv_rate_elapse = 1.0/6.5; /* inverse wet air lapse rate */
+
+    if (!match->use_thermal)
+        return base_h;
+
+    return (10.0 * (t_obj - (float)scratch->temp_obj[index]))
+           * inv_rate_elapse + (float)base_h;
+}
+
+
+/*****************************************************************************
+MODULE:  shadow_pixel
+
+PURPOSE: Find the shadow pixel of a true cloud location at a cloud pixel
+         height
+
+RETURN: None
+*****************************************************************************/
+static inline void shadow_pixel
+(
+    const SHADOW_MATCH_T *match, /* I: scene values for the match */
+    float pos_col,               /* I: true cloud column */
+    float pos_row,               /* I: true cloud row */
+    float cloud_height,          /* I: cloud pixel height (m) */
+    int *col,                    /* O: shadow column */
+    int *row                     /* O: shadow row */
+)
+{
+    float i_xy = cloud_height * match->inv_shadow_step;
+
+    /* The check here can assume to handle the south up north down scene
+       case correctly as azimuth angle needs to be added by 180.0 degree */
+    if (match->sun_az < 180.0)
+    {
+        *col = rint(pos_col - i_xy * match->shadow_unit_vec_x);
+        *row = rint(pos_row - i_xy * match->shadow_unit_vec_y);
+    }
+    else
+    {
+        *col = rint(pos_col + i_xy * match->shadow_unit_vec_x);
+        *row = rint(pos_row + i_xy * match->shadow_unit_vec_y);
+    }
+}
+
+
+/*****************************************************************************
+MODULE:  score_cloud_height
+
+PURPOSE: Calculate how well the shadow of a cloud at a cloud base height
+         matches the cloud and shadow pixels of the scene
+
+RETURN: The fraction of the shadow pixels that match
+*****************************************************************************/
+static float score_cloud_height
+(
+    const SHADOW_MATCH_T *match,      /* I: scene values for the match */
+    const SHADOW_SCRATCH_T *scratch,  /* I: buffers holding the cloud */
+    int cloud_pixels,                 /* I: number of pixels in the cloud */
+    float t_obj,                      /* I: cloud base temperature */
+    int base_h                        /* I: cloud base height (m) */
+)
+{
+    int nrows = match->nrows;
+    int ncols = match->ncols;
+    int out_all = 0;           /* total number of pixels outdside boundary */
+    int match_all = 0;         /* total number of matched pixels */
+    int total_all = 0;         /* total number of pixels */
+    int first_index;
+    int index;
+
+    for (first_index = 0; first_index < cloud_pixels;
+         first_index += SCORE_BLOCK_PIXELS)
+    {
+        float pos_col[SCORE_BLOCK_PIXELS];
+        float pos_row[SCORE_BLOCK_PIXELS];
+        float cloud_height[SCORE_BLOCK_PIXELS];
+        int block_pixels = cloud_pixels - first_index;
+        if (block_pixels > SCORE_BLOCK_PIXELS)
+            block_pixels = SCORE_BLOCK_PIXELS;
+
+        /* Get the true postion of the block's cloud pixels with the base
+           height */
+        for (index = 0; index < block_pixels; index++)
+        {
+            int pixel = first_index + index;
+
+            cloud_height[index] = pixel_cloud_height(match, scratch, pixel,
+                                                     t_obj, base_h);
+            truecloud_move(scratch->orig_col[pixel], scratch->orig_row[pixel],
+                           scratch->dist_par[pixel], cloud_height[index],
+                           match->cos_omiga_par, match->sin_omiga_par,
+                           &pos_col[index], &pos_row[index]);
+        }
+
+        /* Count the pixels their shadows fall on */
+        for (index = 0; index < block_pixels; index++)
+        {
+            int col;
+            int row;
+
+            shadow_pixel(match, pos_col[index], pos_row[index],
+                         cloud_height[index], &col, &row);
+
+            /* the id that is out of the image */
+            if (row < 0 || row >= nrows || col < 0 || col >= ncols)
+            {
+                out_all++;
+            }
+            else
+            {
+                bool in_cloud = cloud_box_has_pixel(&scratch->box, row, col);
+                unsigned char mask = match->pixel_mask[row * ncols + col];
+
+                if ((mask & CF_FILL_BIT)
+                    || (!in_cloud
+                        && (mask & (CF_CLOUD_BIT | CF_SHADOW_BIT))))
+                {
+                    match_all++;
+                }
+                if (!in_cloud)
+                {
+                    total_all++;
+                }
+            }
+        }
+    }
+    match_all += out_all;
+    total_all += out_all;
+
+    return (float)match_all / (float)total_all;
+}
+
+
+/*****************************************************************************
+MODULE:  search_cloud_height
+
+PURPOSE: Step through the cloud base heights of a cloud until the match
+         stops improving, and find the height with the best match
+
+RETURN: true if a height matched well enough to mark the cloud's shadow
+
+NOTES:
+1. The large clouds score a batch of heights at a time, one height to a
+   thread, and the heights are then taken in order just as if they had been
+   scored one at a time.  Only the heights past the one the search stops at
+   in the last batch are scored for nothing.
+2. The search has to settle on a height within a step of the last one, so
+   with the height step the rule is the exhaustive search of Fmask.
+*****************************************************************************/
+static bool search_cloud_height
+(
+    const SHADOW_MATCH_T *match,     /* I: scene values for the match */
+    const SHADOW_SCRATCH_T *scratch, /* I: buffers holding the cloud */
+    int cloud_pixels,       /* I: number of pixels in the cloud */
+    float t_obj,            /* I: cloud base temperature */
+    float t_similar,        /* I: similarity threshold */
+    float t_buffer,         /* I: threshold for matching buffering */
+    int batch_heights,      /* I: number of heights scored at a time */
+    int first_h,            /* I: first cloud base height searched (m) */
+    int last_h,             /* I: last cloud base height searched (m) */
+    int step,               /* I: cloud base height step (m) */
+    int *record_base_h,     /* O: cloud base height with the best match */
+    long *heights_scored    /* I/O: count of the heights scored */
+)
+{
+    int base_h;                /* cloud base height */
+    int height_index;          /* index of the cloud base height */
+    int batch_first = 0;       /* index of the first height of the batch */
+    int batch_count = 0;       /* number of heights in the batch */
+    float max_similar = 0.95;  /* max similarity threshold */
+    float thresh_match;        /* thresh match value */
+    float record_thresh;       /* record thresh value */
+    float batch_scores[MAX_BATCH_HEIGHTS]; /* match of each batch height */
+
+    /* Initialize height and similarity info */
+    record_thresh = 0.0;
+    *record_base_h = first_h;
+    for (height_index = 0, base_h = first_h; base_h <= last_h;
+         height_index++, base_h += step)
+    {
+        if (height_index >= batch_first + batch_count)
+        {
+            int batch_index;
+
+            batch_first = height_index;
+            batch_count = (last_h - base_h) / step + 1;
+            if (batch_count > batch_heights)
+                batch_count = batch_heights;
+            *heights_scored += batch_count;
+
+#ifdef _OPENMP
+            #pragma omp parallel for schedule(dynamic, 1) if (batch_count > 1)
+#endif
+            for (batch_index = 0; batch_index < batch_count; batch_index++)
+            {
+                batch_scores[batch_index] =
+                    score_cloud_height(match, scratch, cloud_pixels, t_obj,
+                                       base_h + batch_index * step);
+            }
+        }
+
+        thresh_match = batch_scores[height_index - batch_first];
+        if (((thresh_match - t_buffer * record_thresh) >= MINSIGMA)
+            && (base_h < last_h - step)
+            && ((record_thresh - max_similar) < MINSIGMA))
+        {
+            if (thresh_match > record_thresh)
+            {
+                /* Save the new height */
+                record_thresh = thresh_match;
+                *record_base_h = base_h;
+            }
+        }
+        else if (record_thresh > t_similar)
+        {
+            /* Done with this cloud */
+            return true;
+        }
+        else
+        {
+            record_thresh = 0.0;
+        }
+    }
+
+    return false;
+}
+
+
+/*****************************************************************************
+MODULE:  match_cloud_shadow
+
+PURPOSE: Find the cloud base height giving the best match between a cloud
+         and the cloud and shadow pixels of the scene, and stamp the shadow
+         of the cloud at that height into the calibration mask
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. Several clouds can be matched at the same time, so the shadow bits are
+   stamped atomically.  Nothing else is written outside the scratch buffers.
+2. The loops over the cloud's pixels, and the scoring of the heights, only
+   run in parallel when asked to, for the clouds large enough to pay for it.
+3. With a height stride above 1, the heights are searched that many steps
+   at a time first.  The search then runs again a step at a time over the
+   heights within a coarse step of the best coarse match, with the best
+   match starting over from none.  It can stop at another height than the
+   exhaustive search, which starts from the lowest height.
+*****************************************************************************/
+static int match_cloud_shadow
+(
+    const SHADOW_MATCH_T *match, /* I: scene values for the match */
+    const CLOUD_T *cloud,        /* I: cloud to match */
+    SHADOW_SCRATCH_T *scratch,   /* I/O: scratch buffers of the thread */
+    bool parallel_pixels         /* I: use the threads on the cloud's pixels */
+)
+{
+    char *FUNC_NAME = "match_cloud_shadow";
+    char errstr[MAX_STR_LEN];  /* error string */
+    int nrows = match->nrows;  /* number of rows */
+    int ncols = match->ncols;  /* number of columns */
+    int cloud_pixels = cloud->pixel_count;
+    int16 *temp_obj;           /* temperature for each cloud pixel */
+    int16 temp_obj_max = cloud->temp_max; /* maximum temperature */
+    int16 temp_obj_min = cloud->temp_min; /* minimum temperature */
+    int *cloud_orig_row;       /* original cloud locations */
+    int *cloud_orig_col;
+
+    int index;                 /* loop index */
+    int row = 0;               /* row index */
+    int col = 0;               /* column index */
+    int run_index;             /* Index into the cloud_runs */
+    int record_base_h;         /* cloud base height with the best match */
+    int coarse_step;           /* cloud base height step of the coarse
+                                  search */
+    int batch_heights;         /* number of heights scored at a time */
+    bool found;                /* a height matched well enough */
+    int max_cl_height;         /* Max cloud base height (m) */
+    int min_cl_height;         /* Min cloud base height (m) */
+    int max_height;            /* refined maximum height (m) */
+    int min_height;            /* refined minimum height (m) */
+
+    float t_similar;           /* similarity threshold */
+    float t_buffer;            /* threshold for matching buffering */
+    float num_pix = 3.0;       /* number of inward pixes (240m) for cloud base
+                                  temperature */
+    float inv_rate_dlapse = 1.0/9.8; /* inverse dry air lapse rate */
+    float cloud_radius;        /* Cloud radius */
+    float pct_obj;             /* percent of edge pixels */
+    float t_obj = 0.0;         /* cloud percentile value */
+    short int t_obj_int = 0;   /* Integer object temperature */
+
+    if (grow_shadow_scratch(scratch, cloud_pixels) != SUCCESS)
+        RETURN_ERROR("Growing the cloud scratch buffers", FUNC_NAME, FAILURE);
+
+    temp_obj = scratch->temp_obj;
+    cloud_orig_row = scratch->orig_row;
+    cloud_orig_col = scratch->orig_col;
+
+    /* Update in Fmask v3.3, for larger (> 10% scene area), use
+       another set of t_similar and t_buffer to address some
+       missing cloud shadow at edge area */
+    if (cloud_pixels <= (int)(0.1 * match->data_counter))
+    {
+        t_similar = 0.3;
+        t_buffer = 0.95;
+    }
+    else
+    {
+        t_similar = 0.1;
+        t_buffer = 0.98;
+    }
+
+    /* Build the set of pixels for the current cloud, whose min/max
+       temperatures were found with the cloud */
+    index = 0;
+    run_index = cloud->first_run;
+    while (run_index != -1)
+    {
+        RLE_T *run = &match->cloud_runs[run_index];
+        int end_col = run->start_col + run->col_count;
+
+        if (match->use_thermal)
+        {
+            memcpy(&temp_obj[index],
+                   &match->temp_data[run->row * ncols + run->start_col],
+                   run->col_count * sizeof(*temp_obj));
+        }
+
+        for (col = run->start_col; col < end_col; col++)
+        {
+            cloud_orig_col[index] = col;
+            cloud_orig_row[index] = run->row;
+            index++;
+        }
+        run_index = run->next_index;
+    }
+
+    /* Make sure the number of pixels counted is the same as the
+       number expected */
+    if (index != cloud_pixels)
+    {
+        snprintf(errstr, sizeof(errstr),
+                 "Inconsistent number of pixels found in a"
+                 " cloud %d/%d - this is a bug", index, cloud_pixels);
+        RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
+    }
+
+    /* Mark the cloud's pixels in its bounding box, so the match can
+       tell them apart from the other clouds */
+    if (build_cloud_box(cloud, cloud_orig_row, cloud_orig_col,
+                        &scratch->box) != SUCCESS)
+    {
+        RETURN_ERROR("Allocating cloud box memory", FUNC_NAME, FAILURE);
+    }
+
+    if (match->use_thermal)
+    {
+        /* The base temperature for cloud.  Assumes object is round
+           with cloud_radius being the radius of cloud */
+        cloud_radius = sqrt(cloud_pixels / (2.0 * PI));
+
+        /* number of inward pixels for correct temperature */
+        if (cloud_radius > num_pix)
+        {
+            pct_obj = ((cloud_radius - num_pix)
+                       * (cloud_radius - num_pix))
+                      / (cloud_radius * cloud_radius);
+
+            if (prctile(temp_obj, cloud_pixels, temp_obj_min,
+                        temp_obj_max, 100.0 * pct_obj, &t_obj)
+                != SUCCESS)
+            {
+                RETURN_ERROR("Error calling prctile", FUNC_NAME, FAILURE);
+            }
+        }
+        else
+        {
+            /* Use the minimum temperature instead */
+            t_obj = temp_obj_min;
+        }
+
+        t_obj_int = rint(t_obj);
+    }
+
+    /* refine cloud height range (m) */
+    min_cl_height = 200;
+    max_cl_height = 12000;
+
+    if (match->use_thermal)
+    {
+        min_height =
+            (int)rint(10.0 * (match->t_templ - t_obj) * inv_rate_dlapse);
+        max_height = (int)rint(10.0 * (match->t_temph - t_obj));
+
+        /* Pick the smallest height range based */
+        if (min_cl_height < min_height)
+            min_cl_height = min_height;
+        if (max_cl_height > max_height)
+            max_cl_height = max_height;
+
+        /* put the edge of the cloud the same value as t_obj */
+#ifdef _OPENMP
+        #pragma omp parallel for if (parallel_pixels)
+#endif
+        for (index = 0; index < cloud_pixels; index++)
+        {
+            if (temp_obj[index] > t_obj_int)
+                temp_obj[index] = t_obj_int;
+        }
+    }
+
+    /* The distance of each pixel from the central perpendicular doesn't
+       change with the height */
+#ifdef _OPENMP
+    #pragma omp parallel for if (parallel_pixels)
+#endif
+    for (index = 0; index < cloud_pixels; index++)
+    {
+        scratch->dist_par[index] =
+            truecloud_dist_par(cloud_orig_col[index], cloud_orig_row[index],
+                               match->a, match->b, match->c,
+                               match->inv_a_b_distance,
+                               match->inv_cos_omiga_per_minus_par);
+    }
+
+    /* The large clouds score a batch of heights at a time */
+    batch_heights = 1;
+#ifdef _OPENMP
+    if (parallel_pixels)
+        batch_heights = omp_get_max_threads();
+#endif
+    if (batch_heights > MAX_BATCH_HEIGHTS)
+        batch_heights = MAX_BATCH_HEIGHTS;
+
+    if (match->height_stride > 1)
+    {
+        /* Locate the best match on the coarse heights, then step through
+           the heights between the coarse heights around it */
+        coarse_step = match->height_stride * match->i_step;
+        found = search_cloud_height(match, scratch, cloud_pixels, t_obj,
+                                    t_similar, t_buffer, batch_heights,
+                                    min_cl_height, max_cl_height,
+                                    coarse_step, &record_base_h,
+                                    &scratch->heights_scored);
+        if (found)
+        {
+            min_height = record_base_h - coarse_step;
+            if (min_height < min_cl_height)
+                min_height = min_cl_height;
+            max_height = record_base_h + coarse_step;
+            if (max_height > max_cl_height)
+                max_height = max_cl_height;
+            found = search_cloud_height(match, scratch, cloud_pixels, t_obj,
+                                        t_similar, t_buffer, batch_heights,
+                                        min_height, max_height,
+                                        match->i_step, &record_base_h,
+                                        &scratch->heights_scored);
+        }
+
+        if (match->height_compare)
+        {
+            bool exhaustive_found;
+            int exhaustive_base_h;
+
+            exhaustive_found =
+                search_cloud_height(match, scratch, cloud_pixels, t_obj,
+                                    t_similar, t_buffer, batch_heights,
+                                    min_cl_height, max_cl_height,
+                                    match->i_step, &exhaustive_base_h,
+                                    &scratch->exhaustive_heights);
+            scratch->clouds_compared++;
+            if (found != exhaustive_found
+                || (found && record_base_h != exhaustive_base_h))
+            {
+                scratch->clouds_differ++;
+            }
+        }
+    }
+    else
+    {
+        found = search_cloud_height(match, scratch, cloud_pixels, t_obj,
+                                    t_similar, t_buffer, batch_heights,
+                                    min_cl_height, max_cl_height,
+                                    match->i_step, &record_base_h,
+                                    &scratch->heights_scored);
+    }
+
+    if (found)
+    {
+        /* Re-calculate the cloud position using the height with the best
+           match, and mark its shadow */
+#ifdef _OPENMP
+        #pragma omp parallel for private(col, row) if (parallel_pixels)
+#endif
+        for (index = 0; index < cloud_pixels; index++)
+        {
+            float matched_height;
+            float pos_col;
+            float pos_row;
+
+            matched_height = pixel_cloud_height(match, scratch, index,
+                                                t_obj, record_base_h);
+            truecloud_move(cloud_orig_col[index], cloud_orig_row[index],
+                           scratch->dist_par[index], matched_height,
+                           match->cos_omiga_par, match->sin_omiga_par,
+                           &pos_col, &pos_row);
+            shadow_pixel(match, pos_col, pos_row, matched_height,
+                         &col, &row);
+
+            /* put data within range */
+            if (row < 0)
+                row = 0;
+            else if (row >= nrows)
+                row = nrows - 1;
+            if (col < 0)
+                col = 0;
+            else if (col >= ncols)
+                col = ncols - 1;
+
+#ifdef _OPENMP
+            #pragma omp atomic
+#endif
+            match->cal_mask[row * ncols + col] |= CF_SHADOW_BIT;
+        }
+    }
+
+    return SUCCESS;
+}
+
+
 /*****************************************************************************
 MODULE:  object_cloud_shadow_match
 
@@ -253,12 +1060,14 @@ int object_cloud_shadow_match
     unsigned char *pixel_mask, /* I/O: pixel mask */
     int *image_data_count,  /* O: count of valid image pixels */
     bool use_thermal, /* I: value to indicate if thermal data should be used */
+    int height_stride, /* I: stride of the coarse cloud height search */
+    bool height_compare, /* I: compare the coarse height search to the
+                               exhaustive one */
     bool verbose      /* I: value to indicate if intermediate messages
                             be printed */
 )
 {
     char *FUNC_NAME = "object_cloud_shadow_match";
-    char errstr[MAX_STR_LEN];  /* error string */
     int nrows = input->size.l; /* number of rows */
     int ncols = input->size.s; /* number of columns */
 
@@ -323,25 +1132,13 @@ int object_cloud_shadow_match
     else
     {
         unsigned char *cal_mask = NULL; /* calibration pixel mask */
-        int *cloud_map = NULL;      /* Image sized array with cloud numbers */
         int16 *temp_data = NULL;    /* brightness temperature */
-        int16 *temp_obj = NULL;     /* temperature for each cloud */
 
-        int index;             /* loop index */
         int row = 0;           /* row index */
         int col = 0;           /* column index */
 
-        int base_h;            /* cloud base height */
-        int out_all;           /* total number of pixels outdside boundary */
-        int match_all;         /* total number of matched pixels */
-        int total_all;         /* total number of pixels */
         int num_clouds;
-        int max_cl_height;     /* Max cloud base height (m) */
-        int min_cl_height;     /* Min cloud base height (m) */
-        int max_height;        /* refined maximum height (m) */
-        int min_height;        /* refined minimum height (m) */
         int i_step;            /* iteration step */
-        int max_cloud_pixels = 1;
         int x_ul = 0;          /* upper left column */
         int y_ul = 0;          /* upper left row */
         int x_lr = 0;          /* lower right column */
@@ -350,20 +1147,7 @@ int object_cloud_shadow_match
         int y_ll = 0;          /* lower left row */
         int x_ur = 0;          /* upper right column */
         int y_ur = 0;          /* upper right row */
-        int16 temp_obj_max = 0; /* maximum temperature for each cloud */
-        int16 temp_obj_min = 0; /* minimum temperature for each cloud */
-        int num_of_real_clouds; /* counter */
-        int run_index;          /* Index into the cloud_runs */
-
-        float t_similar;       /* similarity threshold */
-        float t_buffer;        /* threshold for matching buffering */
-        float max_similar = 0.95; /* max similarity threshold */
-        float num_pix = 3.0;   /* number of inward pixes (240m) for cloud base
-                                  temperature */
-        float inv_rate_elapse = 1.0/6.5; /* inverse wet air lapse rate */
-        float inv_rate_dlapse = 1.0/9.8; /* inverse dry air lapse rate */
-        float thresh_match;    /* thresh match value */
-        float record_thresh;   /* record thresh value */
+
         float inv_a_b_distance;            /* Inverse of... */
         float inv_cos_omiga_per_minus_par; /* Inverse of... */
         float cos_omiga_par;
@@ -372,12 +1156,14 @@ int object_cloud_shadow_match
                                                 routine, see it for detail */
 
         int cloud_type;          /* cloud type iterator */
-        int *cloud_orig_row_col; /* Array for original cloud locations */
-        int *cloud_orig_row;
-        int *cloud_orig_col;
-        float *cloud_pos_row_col;
-        float *cloud_pos_row;
-        float *cloud_pos_col;
+        int order_index;         /* index into the cloud order */
+        const CLOUD_T **cloud_order = NULL; /* clouds from largest to
+                                               smallest */
+        SHADOW_MATCH_T match;    /* scene values for the match */
+        SHADOW_SCRATCH_T *scratch = NULL; /* scratch buffers of each thread */
+        int num_threads = 1;
+        int thread;
+        int failed = 0;
 
         float pixel_size = 30.0; /* pixel size */
         float sun_ele;           /* sun elevation angle */
@@ -388,9 +1174,6 @@ int object_cloud_shadow_match
         float shadow_unit_vec_x;
         float shadow_unit_vec_y;
 
-        float pct_obj;           /* percent of edge pixels */
-        float t_obj;             /* cloud percentile value */
-
         /* Tangent of sun elevation angle */
         sun_ele = 90.0 - input->meta.sun_zen;
         tan_sun_elevation = tan (sun_ele * RAD);
@@ -497,516 +1280,220 @@ int object_cloud_shadow_match
         cos_omiga_par = cos(omiga_par);
         sin_omiga_par = sin(omiga_par);
 
-        /* Labeling the cloud pixels */
-        printf("Labeling Clouds\n");
-        int *cloud_pixel_count = NULL; /* Array for the count of pixels
-                                          in each of the identified clouds */
-        int *cloud_lookup = NULL; /* Array to point to the first run for each
-                                     cloud */
-        RLE_T *cloud_runs = NULL; /* Array of cloud run-length encoded
-                                     segments */
-
-        /* Allocate memory for array to map image pixels to cloud numbers */
-        cloud_map = calloc(pixel_count, sizeof(*cloud_map));
-        if (cloud_map == NULL)
-        {
-            RETURN_ERROR("Allocating memory for cloud map",
-                         FUNC_NAME, FAILURE);
-        }
-
-        if (identify_clouds(pixel_mask, nrows, ncols, &cloud_runs,
-                            &cloud_lookup, &cloud_pixel_count, &num_clouds,
-                            cloud_map) != SUCCESS)
+        if (use_thermal)
         {
-            free(cloud_map);
-            RETURN_ERROR("Failed labeling clouds", FUNC_NAME, FAILURE);
-        }
-
-        /* If there are no clouds, set the maximum cloud pixels to 1 since
-           leaving it at zero would cause problems later */
-        if (num_clouds == 0)
-            max_cloud_pixels = 1;
+            /* Thermal band data allocation */
+            temp_data = calloc(pixel_count, sizeof (int16));
+            if (temp_data == NULL)
+                RETURN_ERROR("Allocating temp memory", FUNC_NAME, FAILURE);
 
-        printf("Filtering Clouds\n");
-        num_of_real_clouds = 0;
-        for (index = 1; index < num_clouds; index++)
-        {
-            if (cloud_pixel_count[index] <= MIN_CLOUD_OBJ)
+            /* Load the thermal band, before labeling the clouds so their
+               temperature ranges are found with them */
+            if (!GetInputThermBand(input, temp_data))
             {
-                cloud_pixel_count[index] = 0;
-                cloud_lookup[index] = -1;
-                continue;
+                free(temp_data);
+                RETURN_ERROR("Reading input thermal data", FUNC_NAME,
+                             FAILURE);
             }
-
-            num_of_real_clouds++;
-
-            if (max_cloud_pixels < cloud_pixel_count[index])
-                max_cloud_pixels = cloud_pixel_count[index];
-        }
-
-        if (verbose)
-        {
-            printf("Num of clouds = %d\n", num_clouds);
-            printf("Num of real clouds = %d\n", num_of_real_clouds);
         }
 
-        printf("Finding Shadows\n");
-        /* Allocate space for the row/col locations of the height adjusted
-           cloud */
-        cloud_pos_row_col = malloc(2 * max_cloud_pixels
-                                   * sizeof(*cloud_pos_row_col));
-
-        /* Allocate space for the row/col locations of the original cloud */
-        cloud_orig_row_col = malloc(2 * max_cloud_pixels
-                                    * sizeof(*cloud_orig_row_col));
+        /* Labeling the cloud pixels, dropping the clouds of MIN_CLOUD_OBJ
+           pixels or fewer */
+        printf("Labeling Clouds\n");
+        CLOUD_T *clouds = NULL;   /* Array of the records of the identified
+                                     clouds */
+        RLE_T *cloud_runs = NULL; /* Array of cloud run-length encoded
+                                     segments */
+        int num_small_clouds;     /* Number of clouds dropped for size */
 
-        if (cloud_pos_row_col == NULL || cloud_orig_row_col == NULL)
+        if (identify_clouds(pixel_mask, temp_data, nrows, ncols,
+                            MIN_CLOUD_OBJ, &cloud_runs, &clouds, &num_clouds,
+                            &num_small_clouds) != SUCCESS)
         {
-            free(cloud_pixel_count);
-            free(cloud_lookup);
-            free(cloud_runs);
-            free(cloud_map);
-            free(cloud_pos_row_col);
-            free(cloud_orig_row_col);
-            RETURN_ERROR("Allocating cloud memory", FUNC_NAME, FAILURE);
+            free(temp_data);
+            RETURN_ERROR("Failed labeling clouds", FUNC_NAME, FAILURE);
         }
 
-        /* Set up pointers to the row/column info for the cloud row/col info */
-        cloud_pos_row = cloud_pos_row_col;
-        cloud_pos_col = &cloud_pos_row_col[max_cloud_pixels];
-        cloud_orig_row = cloud_orig_row_col;
-        cloud_orig_col = &cloud_orig_row_col[max_cloud_pixels];
-
-        if (use_thermal)
+        if (verbose)
         {
-            /* Thermal band data allocation */
-            temp_data = calloc(pixel_count, sizeof (int16));
-            if (temp_data == NULL)
-            {
-                free(cloud_pixel_count);
-                free(cloud_lookup);
-                free(cloud_runs);
-                free(cloud_map);
-                free(cloud_pos_row_col);
-                free(cloud_orig_row_col);
-                RETURN_ERROR("Allocating temp memory", FUNC_NAME, FAILURE);
-            }
-
-            /* Load the thermal band */
-            for (row = 0; row < nrows; row++)
-            {
-                if (!GetInputThermLine(input, row))
-                {
-                    free(cloud_pixel_count);
-                    free(cloud_lookup);
-                    free(cloud_runs);
-                    free(cloud_map);
-                    free(cloud_pos_row_col);
-                    free(cloud_orig_row_col);
-                    free(temp_data);
-                    snprintf(errstr, sizeof(errstr),
-                             "Reading input thermal data for line %d", row);
-                    RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
-                }
-                memcpy(&temp_data[row * ncols], &input->buf[BI_THERMAL][0],
-                       ncols * sizeof(int16));
-            }
-
-            /* Temperature of the cloud object */
-            temp_obj = calloc(max_cloud_pixels, sizeof(int16));
-            if (temp_obj == NULL)
-            {
-                free(cloud_pixel_count);
-                free(cloud_lookup);
-                free(cloud_runs);
-                free(cloud_map);
-                free(cloud_pos_row_col);
-                free(cloud_orig_row_col);
-                free(temp_data);
-                RETURN_ERROR("Allocating temp_obj memory", FUNC_NAME, FAILURE);
-            }
+            printf("Num of clouds = %d\n", num_clouds + num_small_clouds);
+            printf("Num of real clouds = %d\n", num_clouds);
         }
 
+        printf("Finding Shadows\n");
         /* Cloud cal mask */
         cal_mask = calloc(pixel_count, sizeof(unsigned char));
         if (cal_mask == NULL)
         {
-            free(cloud_pixel_count);
-            free(cloud_lookup);
+            free(clouds);
             free(cloud_runs);
-            free(cloud_map);
-            free(cloud_pos_row_col);
-            free(cloud_orig_row_col);
             free(temp_data);
-            free(temp_obj);
             RETURN_ERROR("Allocating cal_mask memory", FUNC_NAME, FAILURE);
         }
 
-        /* Cloud_cal pixels are cloud_mask pixels with < 9 pixels removed */
-        unsigned char pixel_mask_value;
+        /* Cloud_cal pixels are cloud_mask pixels with < 9 pixels removed,
+           so mark the non-fill pixels of the runs of the clouds that were
+           kept.  The mask was allocated cleared to CF_CLEAR_PIXEL. */
 #ifdef _OPENMP
-        #pragma omp parallel for private(pixel_mask_value)
+        #pragma omp parallel for schedule(dynamic, 64)
 #endif
-        for (pixel_index = 0; pixel_index < pixel_count; pixel_index++)
-        {
-            pixel_mask_value = pixel_mask[pixel_index];
-
-            /* Has not been used yet, so initialize it first */
-            cal_mask[pixel_index] = CF_CLEAR_PIXEL;
-
-            if ((pixel_mask_value & CF_CLOUD_BIT)
-                && (!(pixel_mask_value & CF_FILL_BIT))
-                && (cloud_pixel_count[cloud_map[pixel_index]] != 0))
-            {
-                cal_mask[pixel_index] |= CF_CLOUD_BIT;
-            }
-        }
-
-        /* Use iteration to get the optimal move distance, Calulate the
-           moving cloud shadow */
-        for (cloud_type = 1; cloud_type < num_clouds; cloud_type++)
+        for (cloud_type = 0; cloud_type < num_clouds; cloud_type++)
         {
-            float *cloud_height;              /* Cloud height */
-            float *matched_height;            /* Best match height values */
-            float cloud_radius;               /* Cloud radius */
-            short int t_obj_int;              /* Integer object temperature */
-            int cloud_pixels = cloud_pixel_count[cloud_type];
-
-            if (cloud_pixels == 0)
-                continue;
+            int cal_run_index = clouds[cloud_type].first_run;
 
-            /* Update in Fmask v3.3, for larger (> 10% scene area), use
-               another set of t_similar and t_buffer to address some
-               missing cloud shadow at edge area */
-            if (cloud_pixels <= (int)(0.1 * data_counter))
+            while (cal_run_index != -1)
             {
-                t_similar = 0.3;
-                t_buffer = 0.95;
-            }
-            else
-            {
-                t_similar = 0.1;
-                t_buffer = 0.98;
-            }
+                RLE_T *run = &cloud_runs[cal_run_index];
+                int run_pixel = run->row * ncols + run->start_col;
+                int end_pixel = run_pixel + run->col_count;
 
-            /* Build the set of pixels for the current cloud and find the
-               min/max temperatures present in the cloud */
-            temp_obj_max = SHRT_MIN;
-            temp_obj_min = SHRT_MAX;
-            index = 0;
-            run_index = cloud_lookup[cloud_type];
-            while (run_index != -1)
-            {
-                RLE_T *run = &cloud_runs[run_index];
-                int end_col = run->start_col + run->col_count;
-
-                for (col = run->start_col; col < end_col; col++)
+                for (; run_pixel < end_pixel; run_pixel++)
                 {
-                    if (use_thermal)
-                    {
-                        temp_obj[index] = temp_data[run->row * ncols + col];
-
-                        if (temp_obj[index] > temp_obj_max)
-                            temp_obj_max = temp_obj[index];
-
-                        if (temp_obj[index] < temp_obj_min)
-                            temp_obj_min = temp_obj[index];
-                    }
-
-                    cloud_orig_col[index] = col;
-                    cloud_orig_row[index] = run->row;
-                    index++;
+                    if (!(pixel_mask[run_pixel] & CF_FILL_BIT))
+                        cal_mask[run_pixel] |= CF_CLOUD_BIT;
                 }
-                run_index = run->next_index;
-            }
-
-            /* Make sure the number of pixels counted is the same as the
-               number expected */
-            if (index != cloud_pixels)
-            {
-                free(cloud_pixel_count);
-                free(cal_mask);
-                free(cloud_lookup);
-                free(cloud_runs);
-                free(cloud_map);
-                free(cloud_pos_row_col);
-                free(cloud_orig_row_col);
-                free(temp_data);
-                free(temp_obj);
-                snprintf(errstr, sizeof(errstr),
-                         "Inconsistent number of pixels found in a"
-                         " cloud %d/%d - this is a bug", index, cloud_pixels);
-                RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
+                cal_run_index = run->next_index;
             }
+        }
 
-            if (use_thermal)
-            {
-                /* The base temperature for cloud.  Assumes object is round
-                   with cloud_radius being the radius of cloud */
-                cloud_radius = sqrt(cloud_pixels / (2.0 * PI));
-
-                /* number of inward pixels for correct temperature */
-                if (cloud_radius > num_pix)
-                {
-                    pct_obj = ((cloud_radius - num_pix)
-                               * (cloud_radius - num_pix))
-                              / (cloud_radius * cloud_radius);
-
-                    if (prctile(temp_obj, cloud_pixels, temp_obj_min,
-                                temp_obj_max, 100.0 * pct_obj, &t_obj)
-                        != SUCCESS)
-                    {
-                        free(cloud_pixel_count);
-                        free(cal_mask);
-                        free(cloud_lookup);
-                        free(cloud_runs);
-                        free(cloud_map);
-                        free(cloud_pos_row_col);
-                        free(cloud_orig_row_col);
-                        free(temp_data);
-                        free(temp_obj);
-                        RETURN_ERROR("Error calling prctile",
-                                     FUNC_NAME, FAILURE);
-                    }
-                }
-                else
-                {
-                    /* Use the minimum temperature instead */
-                    t_obj = temp_obj_min;
-                }
-
-                t_obj_int = rint(t_obj);
-            }
-
-            /* refine cloud height range (m) */
-            min_cl_height = 200;
-            max_cl_height = 12000;
-
-            if (use_thermal)
-            {
-                min_height =
-                    (int)rint(10.0 * (t_templ - t_obj) * inv_rate_dlapse);
-                max_height = (int)rint(10.0 * (t_temph - t_obj));
-
-                /* Pick the smallest height range based */
-                if (min_cl_height < min_height)
-                    min_cl_height = min_height;
-                if (max_cl_height > max_height)
-                    max_cl_height = max_height;
+        /* Use iteration to get the optimal move distance, Calulate the
+           moving cloud shadow.  The clouds are matched largest first: the
+           large ones one at a time with the threads sharing their pixels,
+           then the rest in parallel with each taking the next cloud as it
+           finishes one. */
+        match.nrows = nrows;
+        match.ncols = ncols;
+        match.pixel_mask = pixel_mask;
+        match.cal_mask = cal_mask;
+        match.temp_data = temp_data;
+        match.cloud_runs = cloud_runs;
+        match.use_thermal = use_thermal;
+        match.data_counter = data_counter;
+        match.i_step = i_step;
+        match.height_stride = height_stride;
+        match.height_compare = height_compare;
+        match.t_templ = t_templ;
+        match.t_temph = t_temph;
+        match.a = a;
+        match.b = b;
+        match.c = c;
+        match.inv_a_b_distance = inv_a_b_distance;
+        match.inv_cos_omiga_per_minus_par = inv_cos_omiga_per_minus_par;
+        match.cos_omiga_par = cos_omiga_par;
+        match.sin_omiga_par = sin_omiga_par;
+        match.inv_shadow_step = inv_shadow_step;
+        match.shadow_unit_vec_x = shadow_unit_vec_x;
+        match.shadow_unit_vec_y = shadow_unit_vec_y;
+        match.sun_az = input->meta.sun_az;
 
-                /* put the edge of the cloud the same value as t_obj */
 #ifdef _OPENMP
-                #pragma omp parallel for
+        num_threads = omp_get_max_threads();
 #endif
-                for (index = 0; index < cloud_pixels; index++)
-                {
-                    if (temp_obj[index] > t_obj_int)
-                        temp_obj[index] = t_obj_int;
-                }
-            }
+        cloud_order = malloc((num_clouds + 1) * sizeof(*cloud_order));
+        scratch = calloc(num_threads, sizeof(*scratch));
+        if (cloud_order == NULL || scratch == NULL)
+        {
+            free(cloud_order);
+            free(scratch);
+            free(cal_mask);
+            free(clouds);
+            free(cloud_runs);
+            free(temp_data);
+            RETURN_ERROR("Allocating cloud order memory", FUNC_NAME, FAILURE);
+        }
+
+        for (cloud_type = 0; cloud_type < num_clouds; cloud_type++)
+            cloud_order[cloud_type] = &clouds[cloud_type];
+        qsort(cloud_order, num_clouds, sizeof(*cloud_order),
+              compare_cloud_size);
 
-            /* Allocate memory for cloud height and matched height */
-            cloud_height = malloc(cloud_pixels * sizeof(float));
-            matched_height = calloc(cloud_pixels, sizeof(float));
-            if (cloud_height == NULL || matched_height == NULL)
+        for (order_index = 0; order_index < num_clouds && !failed
+             && cloud_order[order_index]->pixel_count
+                >= PARALLEL_CLOUD_PIXELS; order_index++)
+        {
+            if (match_cloud_shadow(&match, cloud_order[order_index],
+                                   &scratch[0], true) != SUCCESS)
             {
-                free(cloud_pixel_count);
-                free(cal_mask);
-                free(cloud_lookup);
-                free(cloud_runs);
-                free(cloud_map);
-                free(cloud_pos_row_col);
-                free(cloud_orig_row_col);
-                free(temp_data);
-                free(temp_obj);
-                RETURN_ERROR("Allocating cloud height memory",
-                             FUNC_NAME, FAILURE);
+                failed = 1;
             }
+        }
 
-            /* Initialize height and similarity info */
-            record_thresh = 0.0;
-            for (base_h = min_cl_height; base_h <= max_cl_height;
-                 base_h += i_step)
-            {
-                if (use_thermal)
-                {
+        /* The rest are only matched if the large clouds were, and the flag
+           is shared, so a failure in any thread stops the clouds not yet
+           started by the others */
+        if (!failed)
+        {
 #ifdef _OPENMP
-                    #pragma omp parallel for
+            #pragma omp parallel for schedule(dynamic, 1)
 #endif
-                    for (index = 0; index < cloud_pixels; index++)
-                    {
-                        cloud_height[index] =
-                            (10.0 * (t_obj - (float)temp_obj[index]))
-                            * inv_rate_elapse + (float)base_h;
-                    }
-                }
-                else
-                {
-                    for (index = 0; index < cloud_pixels; index++)
-                    {
-                        cloud_height[index] = base_h;
-                    }
-                }
+            for (cloud_type = order_index; cloud_type < num_clouds;
+                 cloud_type++)
+            {
+                int thread_num = 0;
+                int stop;
 
-                /* Get the true postion of the cloud
-                   calculate cloud DEM with initial base height */
-                mat_truecloud(cloud_orig_col, cloud_orig_row,
-                              cloud_pixels, cloud_height, a, b, c,
-                              inv_a_b_distance,
-                              inv_cos_omiga_per_minus_par,
-                              cos_omiga_par, sin_omiga_par,
-                              cloud_pos_col, cloud_pos_row);
-
-                float i_xy;
-                out_all = 0;
-                match_all = 0;
-                total_all = 0;
 #ifdef _OPENMP
-                #pragma omp parallel for private(i_xy, col, row) reduction(+:out_all, match_all, total_all)
+                thread_num = omp_get_thread_num();
+                #pragma omp atomic read
 #endif
-                for (index = 0; index < cloud_pixels; index++)
-                {
-                    i_xy = cloud_height[index] * inv_shadow_step;
-
-                    /* The check here can assume to handle the south up
-                       north down scene case correctly as azimuth angle
-                       needs to be added by 180.0 degree */
-                    if (input->meta.sun_az < 180.0)
-                    {
-                        col = rint(cloud_pos_col[index]
-                                   - i_xy * shadow_unit_vec_x);
-                        row = rint(cloud_pos_row[index]
-                                   - i_xy * shadow_unit_vec_y);
-                    }
-                    else
-                    {
-                        col = rint(cloud_pos_col[index]
-                                   + i_xy * shadow_unit_vec_x);
-                        row = rint(cloud_pos_row[index]
-                                   + i_xy * shadow_unit_vec_y);
-                    }
-
-                    /* the id that is out of the image */
-                    if (row < 0 || row >= nrows || col < 0 || col >= ncols)
-                    {
-                        out_all++;
-                    }
-                    else
-                    {
-                        int c_value = cloud_map[row * ncols + col];
-                        unsigned char mask = pixel_mask[row * ncols + col];
-
-                        if ((mask & CF_FILL_BIT)
-                            || ((c_value != cloud_type)
-                                && (mask & (CF_CLOUD_BIT | CF_SHADOW_BIT))))
-                        {
-                            match_all++;
-                        }
-                        if (c_value != cloud_type)
-                        {
-                            total_all++;
-                        }
-                    }
-                }
-                match_all += out_all;
-                total_all += out_all;
-
-                thresh_match = (float)match_all / (float)total_all;
-                if (((thresh_match - t_buffer * record_thresh) >= MINSIGMA)
-                    && (base_h < max_cl_height - i_step)
-                    && ((record_thresh - max_similar) < MINSIGMA))
-                {
-                    if (thresh_match > record_thresh)
-                    {
-                        record_thresh = thresh_match;
+                stop = failed;
+                if (stop)
+                    continue;
 
-                        /* Save the new heights */
-                        memcpy(matched_height, cloud_height,
-                               sizeof(*matched_height) * cloud_pixels);
-                    }
-                }
-                else if (record_thresh > t_similar)
+                if (match_cloud_shadow(&match, cloud_order[cloud_type],
+                                       &scratch[thread_num], false)
+                    != SUCCESS)
                 {
-                    /* Re-calculate the cloud position using the height
-                       with the best match */
-                    mat_truecloud(cloud_orig_col, cloud_orig_row,
-                                  cloud_pixels, matched_height, a, b, c,
-                                  inv_a_b_distance,
-                                  inv_cos_omiga_per_minus_par,
-                                  cos_omiga_par, sin_omiga_par,
-                                  cloud_pos_col, cloud_pos_row);
-
-                    float i_vir;
 #ifdef _OPENMP
-                    #pragma omp parallel for private(i_vir, col, row)
+                    #pragma omp atomic write
 #endif
-                    for (index = 0; index < cloud_pixels; index++)
-                    {
-                        i_vir = matched_height[index] * inv_shadow_step;
-
-                        /* The check here can assume to handle the south
-                           up north down scene case correctly as azimuth
-                           angle needs to be added by 180.0 degree */
-                        if (input->meta.sun_az < 180.0)
-                        {
-                            col = rint(cloud_pos_col[index]
-                                       - i_vir * shadow_unit_vec_x);
-                            row = rint(cloud_pos_row[index]
-                                       - i_vir * shadow_unit_vec_y);
-                        }
-                        else
-                        {
-                            col = rint(cloud_pos_col[index]
-                                       + i_vir * shadow_unit_vec_x);
-                            row = rint(cloud_pos_row[index]
-                                       + i_vir * shadow_unit_vec_y);
-                        }
-
-                        /* put data within range */
-                        if (row < 0)
-                            row = 0;
-                        else if (row >= nrows)
-                            row = nrows - 1;
-                        if (col < 0)
-                            col = 0;
-                        else if (col >= ncols)
-                            col = ncols - 1;
-
-                        cal_mask[row * ncols + col] |= CF_SHADOW_BIT;
-                    }
-
-                    /* Done with this cloud */
-                    break;
-                }
-                else
-                {
-                    record_thresh = 0.0;
+                    failed = 1;
                 }
             }
+        }
+
+        if (height_stride > 1 && height_compare)
+        {
+            long heights_scored = 0;
+            long exhaustive_heights = 0;
+            int clouds_compared = 0;
+            int clouds_differ = 0;
 
-            free(cloud_height);
-            cloud_height = NULL;
-            free(matched_height);
-            matched_height = NULL;
+            for (thread = 0; thread < num_threads; thread++)
+            {
+                heights_scored += scratch[thread].heights_scored;
+                exhaustive_heights += scratch[thread].exhaustive_heights;
+                clouds_compared += scratch[thread].clouds_compared;
+                clouds_differ += scratch[thread].clouds_differ;
+            }
+            if (exhaustive_heights == 0)
+                exhaustive_heights = 1;
+            printf("Height search at a stride of %d: %d of %d clouds"
+                   " matched at another height than the exhaustive search,"
+                   " scoring %.1f%% of its heights\n", height_stride,
+                   clouds_differ, clouds_compared,
+                   100.0 * heights_scored / exhaustive_heights);
         }
 
+        for (thread = 0; thread < num_threads; thread++)
+            free_shadow_scratch(&scratch[thread]);
+        free(scratch);
+        free(cloud_order);
+
         /* Release memory */
-        free(cloud_pixel_count);
-        cloud_pixel_count = NULL;
-        free(cloud_lookup);
-        cloud_lookup = NULL;
+        free(clouds);
+        clouds = NULL;
         free(cloud_runs);
         cloud_runs = NULL;
-        free(cloud_map);
-        cloud_map = NULL;
-        free(cloud_pos_row_col);
-        cloud_pos_row_col = NULL;
-        free(cloud_orig_row_col);
-        cloud_orig_row_col = NULL;
         free(temp_data);
         temp_data = NULL;
-        free(temp_obj);
-        temp_obj = NULL;
+
+        if (failed)
+        {
+            free(cal_mask);
+            RETURN_ERROR("Failed matching the cloud shadows", FUNC_NAME,
+                         FAILURE);
+        }
 
         /* Do image dilate for cloud, shadow, snow */
         if (verbose)
@@ -13,6 +13,9 @@ int object_cloud_shadow_match
     unsigned char *pixel_mask, /* I/O: pixel mask */
     int *data_count,  /* O: count of valid image pixels */
     bool use_thermal, /* I: value to indicate if thermal data should be used */
+    int height_stride, /* I: stride of the coarse cloud height search */
+    bool height_compare, /* I: compare the coarse height search to the
+                               exhaustive one */
     bool verbose      /* I: value to indicate if intermediate messages be
                             printed */
 );
@@ -17,126 +17,746 @@
 #include "input.h"
 #include "misc.h"
 #include "fill_local_minima_in_image.h"
+#include "spectral_tests.h"
 #include "potential_cloud_shadow_snow_mask.h"
 
 
-bool is_fill_data
+/* Range of the percentile indexes a probability code holds, and the code of
+   the probabilities kept outside of the plane */
+#define PROB_CODE_MIN_INDEX (-8192)
+#define PROB_CODE_MAX_INDEX 8191
+#define PROB_CODE_OUTSIDE 0xFFFF
+
+/* Number of probabilities a thread's outside list starts with room for */
+#define PROB_OUTSIDE_INITIAL 256
+
+
+/* Counters and histograms gathered by one thread over its rows; they are
+   merged in thread order once all of the rows are done */
+typedef struct
+{
+    int status;                    /* SUCCESS, or FAILURE once the thread
+                                      hit an error */
+    int image_data_counter;        /* mask counter */
+    int clear_pixel_counter;       /* clear sky pixel counter */
+    int clear_land_pixel_counter;  /* clear land pixel counter */
+    int clear_water_pixel_counter; /* clear water pixel counter */
+    Histogram_t land_temp;         /* clear land temperature */
+    Histogram_t water_temp;        /* clear water temperature */
+    Histogram_t land_nir;          /* clear land NIR */
+    Histogram_t water_nir;         /* clear water NIR */
+    Histogram_t land_swir1;        /* clear land SWIR1 */
+    Histogram_t water_swir1;       /* clear water SWIR1 */
+    Histogram_t prob;              /* clear land probability */
+    Histogram_t wprob;             /* clear water probability */
+    int *outside_index;            /* pixels with probabilities outside the
+                                      range of the codes */
+    float *outside_prob;           /* probabilities of those pixels */
+    int outside_count;             /* number of those pixels */
+    int outside_size;              /* room in the outside lists */
+} Mask_shard_t;
+
+
+/*****************************************************************************
+MODULE:  create_shards
+
+PURPOSE: Allocate and initialize the counters and histograms of each thread
+
+RETURN: NULL if the memory could not be allocated
+*****************************************************************************/
+static Mask_shard_t *create_shards
 (
-    Input_t * input, /* I: input structure */
-    int column,      /* I: column in the input data array */
-    bool use_cirrus, /* I: use the cirrus data or not */
-    bool use_thermal /* I: use the thermal data or not */
+    int nshards /* I: number of threads */
 )
 {
-    if (input->buf[BI_BLUE][column] == FILL_PIXEL
-        || input->buf[BI_GREEN][column] == FILL_PIXEL
-        || input->buf[BI_RED][column] == FILL_PIXEL
-        || input->buf[BI_NIR][column] == FILL_PIXEL
-        || input->buf[BI_SWIR_1][column] == FILL_PIXEL
-        || input->buf[BI_SWIR_2][column] == FILL_PIXEL)
+    Mask_shard_t *shards;
+    int i;
+
+    shards = calloc(nshards, sizeof(Mask_shard_t));
+    if (shards == NULL)
+        return NULL;
+
+    /* The same starting values as the merged histograms, so the threads
+       without any samples leave them unchanged */
+    for (i = 0; i < nshards; i++)
     {
-        return true;
+        shards[i].status = SUCCESS;
+        histogram_init(&shards[i].land_temp, SHRT_MAX, SHRT_MIN);
+        histogram_init(&shards[i].water_temp, SHRT_MAX, SHRT_MIN);
+        histogram_init(&shards[i].land_nir, 0.0, 0.0);
+        histogram_init(&shards[i].water_nir, 0.0, 0.0);
+        histogram_init(&shards[i].land_swir1, 0.0, 0.0);
+        histogram_init(&shards[i].water_swir1, 0.0, 0.0);
+        histogram_init(&shards[i].prob, 0.0, 0.0);
+        histogram_init(&shards[i].wprob, 0.0, 0.0);
     }
 
-    if (use_cirrus)
+    return shards;
+}
+
+
+/*****************************************************************************
+MODULE:  free_shards
+
+PURPOSE: Free the histograms of each thread and the shards themselves
+
+RETURN: None
+*****************************************************************************/
+static void free_shards
+(
+    Mask_shard_t *shards, /* I: counters and histograms of each thread */
+    int nshards           /* I: number of threads */
+)
+{
+    int i;
+
+    for (i = 0; i < nshards; i++)
     {
-        if (input->buf[BI_CIRRUS][column] == FILL_PIXEL)
-            return true;
+        histogram_free(&shards[i].land_temp);
+        histogram_free(&shards[i].water_temp);
+        histogram_free(&shards[i].land_nir);
+        histogram_free(&shards[i].water_nir);
+        histogram_free(&shards[i].land_swir1);
+        histogram_free(&shards[i].water_swir1);
+        histogram_free(&shards[i].prob);
+        histogram_free(&shards[i].wprob);
+        free(shards[i].outside_index);
+        free(shards[i].outside_prob);
     }
+    free(shards);
+}
 
-    if (use_thermal)
+
+/*****************************************************************************
+MODULE:  current_shard
+
+PURPOSE: Get the counters and histograms of the calling thread
+
+RETURN: The calling thread's shard
+*****************************************************************************/
+static Mask_shard_t *current_shard
+(
+    Mask_shard_t *shards /* I: counters and histograms of each thread */
+)
+{
+#ifdef _OPENMP
+    return &shards[omp_get_thread_num()];
+#else
+    return &shards[0];
+#endif
+}
+
+
+/*****************************************************************************
+MODULE:  add_outside_prob
+
+PURPOSE: Keep the probability of a pixel whose probability code can't hold
+         it in the thread's outside lists
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+static int add_outside_prob
+(
+    Mask_shard_t *shard, /* I/O: the thread's counters and histograms */
+    int pixel_index,     /* I: the pixel */
+    float prob           /* I: the pixel's probability */
+)
+{
+    int size;
+    int *new_index;
+    float *new_prob;
+
+    if (shard->outside_count == shard->outside_size)
     {
-        if (input->buf[BI_THERMAL][column] <= FILL_PIXEL)
-            return true;
+        size = shard->outside_size * 2;
+        if (size < PROB_OUTSIDE_INITIAL)
+            size = PROB_OUTSIDE_INITIAL;
+
+        new_index = realloc(shard->outside_index, size * sizeof(int));
+        if (new_index == NULL)
+        {
+            RETURN_ERROR("Growing the outside pixel list",
+                         "add_outside_prob", FAILURE);
+        }
+        shard->outside_index = new_index;
+
+        new_prob = realloc(shard->outside_prob, size * sizeof(float));
+        if (new_prob == NULL)
+        {
+            RETURN_ERROR("Growing the outside probability list",
+                         "add_outside_prob", FAILURE);
+        }
+        shard->outside_prob = new_prob;
+        shard->outside_size = size;
     }
 
-    return false;
+    shard->outside_index[shard->outside_count] = pixel_index;
+    shard->outside_prob[shard->outside_count] = prob;
+    shard->outside_count++;
+
+    return SUCCESS;
 }
 
 
-bool basic_cloud_test
+/*****************************************************************************
+MODULE:  encode_prob
+
+PURPOSE: Encode a cloud probability as a 16 bit code which gives the same
+         answers as the probability for the confidence tests
+
+RETURN: The code, or PROB_CODE_OUTSIDE if the code can't hold the answers
+
+NOTES:
+1. The probability thresholds are a percentile of the histogram, which is
+   always the value of one of its bins, plus the cloud probability
+   threshold.  For a percentile index the high confidence test is
+   prob > (float)index + offset, and the medium confidence test is
+   prob > (float)index + offset - 10.0.  Both answers only change once as
+   the index grows, so the code holds the smallest index for which each of
+   them is false.  The index is then compared against those instead.
+2. The high test index is held in the upper 14 bits, and how far the
+   medium test index is from it plus 10, which is -1, 0, or 1 depending on
+   the rounding, in the lower 2 bits.
+*****************************************************************************/
+static inline unsigned short encode_prob
 (
-    Input_t * input, /* I: input structure */
-    int column,      /* I: column in the input data array */
-    float ndvi,      /* I: NDVI value */
-    float ndsi,      /* I: NDSI value */
-    bool use_thermal /* I: use the thermal data or not */
+    float prob,  /* I: the cloud probability */
+    float offset /* I: the cloud probability threshold */
 )
 {
-    bool result = false;
-
-    if (ndsi < 0.8 && ndvi < 0.8 && (input->buf[BI_SWIR_2][column] > 300))
+    int high;  /* smallest index failing the high confidence test */
+    int med;   /* smallest index failing the medium confidence test */
+
+    /* Also catches probabilities which aren't numbers */
+    if (!(fabs((double)prob - offset) < PROB_CODE_MAX_INDEX - 16))
+        return PROB_CODE_OUTSIDE;
+
+    high = (int)ceil((double)prob - offset);
+    while ((float)(high - 1) + offset >= prob)
+        high--;
+    while ((float)high + offset < prob)
+        high++;
+
+    med = high + 10;
+    while ((double)((float)(med - 1) + offset) - 10.0 >= prob)
+        med--;
+    while ((double)((float)med + offset) - 10.0 < prob)
+        med++;
+
+    if (high < PROB_CODE_MIN_INDEX || high > PROB_CODE_MAX_INDEX
+        || med - high < 9 || med - high > 11)
     {
-        result = true;
+        return PROB_CODE_OUTSIDE;
     }
 
-    /* If we are using thermal, then the original test was and'ing the thermal
-       test */
-    if (result && use_thermal)
+    return ((high - PROB_CODE_MIN_INDEX) << 2) | (med - high - 9);
+}
+
+
+/*****************************************************************************
+MODULE:  set_prob_confidence
+
+PURPOSE: Set the confidence of a pixel the thermal test left undecided from
+         the probability tests, then refine the water mask with the final
+         cloud mask
+
+RETURN: None
+*****************************************************************************/
+static inline void set_prob_confidence
+(
+    unsigned char *pixel_mask, /* I/O: pixel mask */
+    unsigned char *conf_mask,  /* I/O: confidence mask */
+    int pixel_index,           /* I: the pixel */
+    bool above_high,           /* I: probability is above the threshold */
+    bool above_med             /* I: probability is above the threshold
+                                     less 10 */
+)
+{
+    if (conf_mask[pixel_index] == CLOUD_CONFIDENCE_NONE)
     {
-        if (input->buf[BI_THERMAL][column] < 2700)
+        if ((pixel_mask[pixel_index] & CF_CLOUD_BIT) && above_high)
+        {
+            /* This test indicates a high confidence */
+            conf_mask[pixel_index] = CLOUD_CONFIDENCE_HIGH;
+
+            /* Original code was only this if test and setting the
+               cloud bit or not */
+            pixel_mask[pixel_index] |= CF_CLOUD_BIT;
+        }
+        else if ((pixel_mask[pixel_index] & CF_CLOUD_BIT) && above_med)
         {
-            result = true;
+            /* This test indicates a medium confidence */
+            conf_mask[pixel_index] = CLOUD_CONFIDENCE_MED;
+
+            /* Don't set the cloud bit per the original code */
+            pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
         }
         else
         {
-            result = false;
+            /* All remaining are a low confidence */
+            conf_mask[pixel_index] = CLOUD_CONFIDENCE_LOW;
+
+            /* Don't set the cloud bit per the original code */
+            pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
         }
     }
 
-    return result;
+    /* refine Water mask (no confusion water/cloud) */
+    if ((pixel_mask[pixel_index] & CF_WATER_BIT) &&
+        (pixel_mask[pixel_index] & CF_CLOUD_BIT))
+    {
+        pixel_mask[pixel_index] &= ~CF_WATER_BIT;
+    }
 }
 
 
-bool basic_snow_test
+/* Inline the row kernel into each of its versions, so the constant flags
+   remove the tests they decide */
+#if defined(__GNUC__)
+    #define ALWAYS_INLINE inline __attribute__ ((always_inline))
+#else
+    #define ALWAYS_INLINE inline
+#endif
+
+
+/* Scene values and planes the probability pass works with */
+typedef struct
+{
+    int ncols;                       /* number of columns */
+    float t_wtemp;                   /* high percentile water temperature */
+    float t_templ;                   /* low percentile background temp */
+    float t_temph;                   /* high percentile background temp */
+    float temp_diff;                 /* difference of low/high temperature
+                                        percentiles */
+    int t_buffer;                    /* temperature test buffer */
+    int satu_blue;                   /* blue values from this are saturated */
+    int satu_green;                  /* green values from this are saturated */
+    int satu_red;                    /* red values from this are saturated */
+    const unsigned char *clear_mask; /* clear pixel bits */
+    const int16 *filled_nir_data;    /* filled NIR */
+    const int16 *filled_swir1_data;  /* filled SWIR1 */
+    unsigned char *pixel_mask;       /* pixel mask */
+    unsigned char *conf_mask;        /* confidence mask */
+    float prob_offset;               /* cloud probability threshold */
+    unsigned short *prob_code;       /* final probability value codes */
+} Prob_pass_t;
+
+
+/* A version of the probability pass for one line */
+typedef int (*Prob_row_t)
+(
+    const Prob_pass_t *pass, /* I/O: scene values and planes */
+    int16 **buf,             /* I: current line of each band */
+    int row,                 /* I: the line being processed */
+    Mask_shard_t *shard      /* I/O: the thread's counters and histograms */
+);
+
+
+/*****************************************************************************
+MODULE:  probability_row
+
+PURPOSE: Computes the cloud probability, the thermal confidence test, and
+         the potential shadow test for the samples of one line
+
+RETURN: SUCCESS
+        FAILURE
+
+NOTES:
+1. Always inlined into the versions defined with PROBABILITY_ROW, where the
+   sensor and band flags are constants.
+*****************************************************************************/
+static ALWAYS_INLINE int probability_row
 (
-    Input_t * input, /* I: input structure */
-    int column,      /* I: column in the input data array */
-    float ndsi,      /* I: NDSI value */
-    bool use_thermal /* I: use the thermal data or not */
+    const Prob_pass_t *pass, /* I/O: scene values and planes */
+    int16 **buf,             /* I: current line of each band */
+    int row,                 /* I: the line being processed */
+    Mask_shard_t *shard,     /* I/O: the thread's counters and histograms */
+    bool check_saturation,   /* I: whiteness is zero for saturated visible
+                                   bands (not Landsat 8) */
+    bool use_thermal,        /* I: use the thermal data or not */
+    bool use_cirrus          /* I: use the cirrus data or not */
 )
 {
-    bool result = false;
-
-    if (ndsi > 0.15
-        && input->buf[BI_NIR][column] > 1100
-        && input->buf[BI_GREEN][column] > 1000)
+    int col;                    /* column index */
+    int pixel_index;
+    float ndvi, ndsi;           /* NDVI and NDSI values */
+    float visi_mean;            /* mean of visible bands */
+    float whiteness = 0.0;      /* whiteness value */
+    int t_bright;               /* brightness test value for water */
+    float brightness_prob;      /* brightness probability value */
+    float vari_prob;            /* probability from NDVI, NDSI, and
+                                   whiteness */
+    float max_value;            /* maximum value */
+    int16 new_nir;              /* NIR difference from the filled NIR */
+    int16 new_swir1;            /* SWIR1 difference from the filled SWIR1 */
+    int16 shadow_prob;          /* shadow probability */
+    unsigned char *pixel_mask = pass->pixel_mask;
+    unsigned char *conf_mask = pass->conf_mask;
+    float final_prob;           /* final probability value, over water for
+                                   water pixels and over land otherwise */
+    unsigned short *prob_code = pass->prob_code;
+
+    /* Loop through each sample in the line */
+    for (col = 0; col < pass->ncols; col++)
     {
-        result = true;
-    }
+        pixel_index = row * pass->ncols + col;
 
-    /* If we are using thermal, then the original test was and'ing the thermal
-       test */
-    if (result && use_thermal)
-    {
-        if (input->buf[BI_THERMAL][column] < 1000)
+        if (pixel_mask[pixel_index] & CF_FILL_BIT)
+        {
+            conf_mask[pixel_index] = CF_FILL_PIXEL;
+            continue;
+        }
+
+        if (pixel_mask[pixel_index] & CF_WATER_BIT)
         {
-            result = true;
+            /* Brightness test (over water) */
+            t_bright = 1100;
+            brightness_prob = (float)buf[BI_SWIR_1][col] / (float)t_bright;
+            if (brightness_prob > 1.0)
+                brightness_prob = 1.0;
+            if (brightness_prob < 0.0)
+                brightness_prob = 0.0;
+
+            if (use_thermal)
+            {
+                /* water temperature probability value */
+                float wtemp_prob;
+
+                /* Get cloud prob over water */
+                /* Temperature test over water */
+                wtemp_prob = (pass->t_wtemp - (float)buf[BI_THERMAL][col])
+                             / 400.0;
+
+                if (wtemp_prob < 0.0)
+                    wtemp_prob = 0.0;
+
+                brightness_prob *= wtemp_prob;
+            }
+
+            /*Final prob mask (water), cloud over water probability */
+            if (use_cirrus)
+            {
+                final_prob = 100.0
+                    * (brightness_prob + (float)buf[BI_CIRRUS][col] / 400.0);
+            }
+            else
+            {
+                final_prob = 100.0 * brightness_prob;
+            }
+
+            /* Gather the clear water probability */
+            if (pass->clear_mask[pixel_index] & CF_CLEAR_WATER_BIT)
+            {
+                if (histogram_add_float(&shard->wprob, final_prob)
+                    != SUCCESS)
+                {
+                    RETURN_ERROR("Adding to the wprob histogram",
+                                 "probability_row", FAILURE);
+                }
+            }
         }
         else
         {
-            result = false;
+            if ((buf[BI_RED][col] + buf[BI_NIR][col]) != 0)
+            {
+                ndvi = (float)(buf[BI_NIR][col] - buf[BI_RED][col])
+                       / (float)(buf[BI_NIR][col] + buf[BI_RED][col]);
+            }
+            else
+                ndvi = 0.01;
+
+            if ((buf[BI_GREEN][col] + buf[BI_SWIR_1][col]) != 0)
+            {
+                ndsi = (float)(buf[BI_GREEN][col] - buf[BI_SWIR_1][col])
+                       / (float)(buf[BI_GREEN][col] + buf[BI_SWIR_1][col]);
+            }
+            else
+                ndsi = 0.01;
+
+            /* NDVI and NDSI should not be negative */
+            if (ndsi < 0.0)
+                ndsi = 0.0;
+            if (ndvi < 0.0)
+                ndvi = 0.0;
+
+            visi_mean = (buf[BI_BLUE][col] + buf[BI_GREEN][col]
+                         + buf[BI_RED][col]) / 3.0;
+            if (visi_mean != 0)
+            {
+                whiteness = ((fabs((float)buf[BI_BLUE][col] - visi_mean)
+                              + fabs((float)buf[BI_GREEN][col] - visi_mean)
+                              + fabs((float)buf[BI_RED][col] - visi_mean)))
+                            / visi_mean;
+            }
+            else
+                whiteness = 0.0;
+
+            if (check_saturation)
+            {
+                /* Landsat 8 doesn't have saturation issues */
+                /* If one visible band is saturated, whiteness = 0 */
+                if (buf[BI_BLUE][col] >= pass->satu_blue
+                    || buf[BI_GREEN][col] >= pass->satu_green
+                    || buf[BI_RED][col] >= pass->satu_red)
+                {
+                    whiteness = 0.0;
+                }
+            }
+
+            /* Vari_prob=1-max(max(abs(NDSI),abs(NDVI)),whiteness); */
+            if (ndsi > ndvi)
+                max_value = ndsi;
+            else
+                max_value = ndvi;
+            if (whiteness > max_value)
+                max_value = whiteness;
+            vari_prob = 1.0 - max_value;
+
+            if (use_thermal)
+            {
+                /* temperature probability */
+                float temp_prob;
+
+                temp_prob = (pass->t_temph - (float)buf[BI_THERMAL][col])
+                            / pass->temp_diff;
+
+                /* Temperature can have prob > 1 */
+                if (temp_prob < 0.0)
+                    temp_prob = 0.0;
+
+                vari_prob *= temp_prob;
+            }
+
+            /*Final prob mask (land) */
+            if (use_cirrus)
+            {
+                final_prob = 100.0 *
+                    (vari_prob + ((float)buf[BI_CIRRUS][col] / 400.0));
+            }
+            else
+            {
+                final_prob = 100.0 * vari_prob;
+            }
+
+            /* Gather the clear land probability */
+            if (pass->clear_mask[pixel_index] & CF_CLEAR_LAND_BIT)
+            {
+                if (histogram_add_float(&shard->prob, final_prob)
+                    != SUCCESS)
+                {
+                    RETURN_ERROR("Adding to the prob histogram",
+                                 "probability_row", FAILURE);
+                }
+            }
+        }
+
+        /* Keep the probability as its code, or in the outside lists when
+           the code can't hold it */
+        prob_code[pixel_index] = encode_prob(final_prob, pass->prob_offset);
+        if (prob_code[pixel_index] == PROB_CODE_OUTSIDE)
+        {
+            if (add_outside_prob(shard, pixel_index, final_prob) != SUCCESS)
+                return FAILURE;
+        }
+
+        if (use_thermal)
+        {
+            if (buf[BI_THERMAL][col]
+                < pass->t_templ + pass->t_buffer - 3500)
+            {
+                /* This test indicates a high confidence */
+                conf_mask[pixel_index] = CLOUD_CONFIDENCE_HIGH;
+
+                /* Original code was only this if test and setting the
+                   cloud bit or not */
+                pixel_mask[pixel_index] |= CF_CLOUD_BIT;
+            }
         }
+
+        new_nir = pass->filled_nir_data[pixel_index] - buf[BI_NIR][col];
+        new_swir1 = pass->filled_swir1_data[pixel_index]
+                    - buf[BI_SWIR_1][col];
+
+        if (new_nir < new_swir1)
+            shadow_prob = new_nir;
+        else
+            shadow_prob = new_swir1;
+
+        if (shadow_prob > 200)
+            pixel_mask[pixel_index] |= CF_SHADOW_BIT;
+        else
+            pixel_mask[pixel_index] &= ~CF_SHADOW_BIT;
     }
 
-    return result;
+    return SUCCESS;
+}
+
+
+/* Define a version of the probability pass for one combination of the
+   sensor and band flags */
+#define PROBABILITY_ROW(name, check_saturation, use_thermal, use_cirrus) \
+static int name \
+( \
+    const Prob_pass_t *pass, \
+    int16 **buf, \
+    int row, \
+    Mask_shard_t *shard \
+) \
+{ \
+    return probability_row(pass, buf, row, shard, check_saturation, \
+                           use_thermal, use_cirrus); \
 }
 
+/* Landsat 4-7, which check for saturation */
+PROBABILITY_ROW(probability_row_tm, true, true, false)
+PROBABILITY_ROW(probability_row_tm_cirrus, true, true, true)
+PROBABILITY_ROW(probability_row_tm_no_thermal, true, false, false)
+PROBABILITY_ROW(probability_row_tm_no_thermal_cirrus, true, false, true)
 
-bool zhe_water_test
+/* Landsat 8, which doesn't have saturation issues */
+PROBABILITY_ROW(probability_row_oli_tirs, false, true, false)
+PROBABILITY_ROW(probability_row_oli_tirs_cirrus, false, true, true)
+PROBABILITY_ROW(probability_row_oli, false, false, false)
+PROBABILITY_ROW(probability_row_oli_cirrus, false, false, true)
+
+#undef PROBABILITY_ROW
+
+
+/*****************************************************************************
+MODULE:  select_probability_row
+
+PURPOSE: Picks the version of the probability pass for the scene's sensor
+         and the bands being used
+
+RETURN: The version to run for each line
+*****************************************************************************/
+static Prob_row_t select_probability_row
+(
+    int satellite,    /* I: the satellite being processed */
+    bool use_thermal, /* I: use the thermal data or not */
+    bool use_cirrus   /* I: use the cirrus data or not */
+)
+{
+    /* Indexed by saturation check, thermal, and cirrus */
+    static const Prob_row_t versions[2][2][2] =
+    {
+        {
+            {probability_row_oli, probability_row_oli_cirrus},
+            {probability_row_oli_tirs, probability_row_oli_tirs_cirrus}
+        },
+        {
+            {probability_row_tm_no_thermal,
+             probability_row_tm_no_thermal_cirrus},
+            {probability_row_tm, probability_row_tm_cirrus}
+        }
+    };
+
+    return versions[satellite != IS_LANDSAT_8][use_thermal][use_cirrus];
+}
+
+
+/*****************************************************************************
+MODULE:  report_fill_disagreement
+
+PURPOSE: Fills the NIR and SWIR1 bands exactly, and reports how often the
+         approximate fill gives a different potential shadow test, and how
+         many of the filled values differ
+
+RETURN: SUCCESS
+        FAILURE
+*****************************************************************************/
+static int report_fill_disagreement
 (
-    Input_t * input, /* I: input structure */
-    int column,      /* I: column in the input data array */
-    float ndvi       /* I: NDVI value */
+    const char *const *band_names,  /* I: names of the NIR and SWIR1 bands */
+    const int16 *const *in_imgs,    /* I: NIR and SWIR1 data */
+    const int16 *const *approx_imgs,/* I: approximately filled NIR and
+                                          SWIR1 */
+    int nrows,                      /* I: number of rows */
+    int ncols,                      /* I: number of columns */
+    const float *boundary_vals,     /* I: NIR and SWIR1 boundary values */
+    int fill_engine,                /* I: FILL_ENGINE_* used for the fill */
+    int fill_scale                  /* I: block size of the approximate
+                                          fill */
 )
 {
-    if ((ndvi < 0.01 && input->buf[BI_NIR][column] < 1100)
-        || (ndvi < 0.1 && ndvi > 0.0 && input->buf[BI_NIR][column] < 500))
+    char *FUNC_NAME = "report_fill_disagreement";
+    int pixel_count = nrows * ncols;
+    int16 *exact_imgs[2];
+    long data_count = 0;        /* pixels with NIR and SWIR1 data */
+    long shadow_count = 0;      /* pixels with a different shadow test */
+    long value_count = 0;       /* pixels with a different filled value */
+    int pixel_index;
+
+    exact_imgs[0] = calloc(pixel_count, sizeof(int16));
+    exact_imgs[1] = calloc(pixel_count, sizeof(int16));
+    if (exact_imgs[0] == NULL || exact_imgs[1] == NULL)
+    {
+        free(exact_imgs[0]);
+        free(exact_imgs[1]);
+        RETURN_ERROR("Allocating the exact fill memory", FUNC_NAME,
+                     FAILURE);
+    }
+
+    if (fill_local_minima_in_images(2, band_names, in_imgs, nrows, ncols,
+                                    boundary_vals, fill_engine, exact_imgs)
+        != SUCCESS)
+    {
+        free(exact_imgs[0]);
+        free(exact_imgs[1]);
+        RETURN_ERROR("Running the exact fill", FUNC_NAME, FAILURE);
+    }
+
+    /* Same shadow test as the probability pass, on both fills */
+#ifdef _OPENMP
+    #pragma omp parallel for \
+        reduction(+:data_count, shadow_count, value_count)
+#endif
+    for (pixel_index = 0; pixel_index < pixel_count; pixel_index++)
     {
-        return true;
+        int exact_prob;
+        int approx_prob;
+
+        if (in_imgs[0][pixel_index] == FILL_PIXEL
+            || in_imgs[1][pixel_index] == FILL_PIXEL)
+        {
+            continue;
+        }
+        data_count++;
+
+        exact_prob = exact_imgs[0][pixel_index] - in_imgs[0][pixel_index];
+        if (exact_imgs[1][pixel_index] - in_imgs[1][pixel_index]
+            < exact_prob)
+        {
+            exact_prob = exact_imgs[1][pixel_index] - in_imgs[1][pixel_index];
+        }
+        approx_prob = approx_imgs[0][pixel_index] - in_imgs[0][pixel_index];
+        if (approx_imgs[1][pixel_index] - in_imgs[1][pixel_index]
+            < approx_prob)
+        {
+            approx_prob = approx_imgs[1][pixel_index]
+                          - in_imgs[1][pixel_index];
+        }
+        if ((exact_prob > 200) != (approx_prob > 200))
+            shadow_count++;
+        if (exact_imgs[0][pixel_index] != approx_imgs[0][pixel_index]
+            || exact_imgs[1][pixel_index] != approx_imgs[1][pixel_index])
+        {
+            value_count++;
+        }
     }
 
-    return false;
+    free(exact_imgs[0]);
+    free(exact_imgs[1]);
+
+    if (data_count == 0)
+        data_count = 1;
+    printf("Fill at 1/%d scale: %.4f%% of the potential shadow tests and"
+           " %.4f%% of the filled values differ from the exact fill\n",
+           fill_scale, 100.0 * shadow_count / data_count,
+           100.0 * value_count / data_count);
+
+    return SUCCESS;
 }
 
 
@@ -158,6 +778,27 @@ NOTES:
 1. Thermal buffer is expected to be in degrees Celsius with a factor applied
    of 100.  Many values which compare to the thermal buffer in this code are
    hardcoded and assume degrees celsius * 100.
+2. Saturated values are expected to already be replaced by the maximum
+   values, which the input layer does as the data is read.
+3. The image is read twice.  The first pass runs the spectral tests and
+   builds the clear land and clear water histograms separately, since
+   which of them feed the percentiles is only known once the pass is done.
+   The second pass computes the probabilities, the thermal confidence test,
+   and the potential shadow test.  The probability confidence needs the
+   percentiles of the second pass, so it is applied from memory afterwards.
+4. With threading enabled the rows of each pass are split between the
+   threads.  Each thread reads its rows into its own lines, and gathers its
+   own counters and histograms, which are merged in thread order after the
+   pass.  The counts are exact, so the results don't depend on the number
+   of threads.
+5. The probability pass runs a version of its line loop built for the
+   sensor and the bands used, which is picked once for the scene.
+6. Between the second pass and the confidence tests the probabilities are
+   kept as 16 bit codes, which give the same test results (see
+   encode_prob).
+7. With a fill scale above one the NIR and SWIR1 bands are filled
+   approximately on reduced images (see fill_local_minima_approx), and the
+   fill comparison reports how far that is from the exact fill.
 *****************************************************************************/
 int potential_cloud_shadow_snow_mask
 (
@@ -172,27 +813,36 @@ int potential_cloud_shadow_snow_mask
                                      be used */
     bool use_thermal,           /*I: value to indicate if Thermal data should
                                      be used */
+    int fill_engine,            /*I: FILL_ENGINE_* used to fill the NIR and
+                                     SWIR1 bands */
+    int fill_scale,             /*I: block size the NIR and SWIR1 bands are
+                                     reduced by for an approximate fill; 1
+                                     for the exact fill */
+    bool fill_compare,          /*I: value to indicate if the approximate
+                                     fill should be compared to the exact
+                                     fill */
     bool verbose                /*I: value to indicate if intermediate
                                      messages should be printed */
 )
 {
     char *FUNC_NAME = "potential_cloud_shadow_snow_mask";
-    char errstr[MAX_STR_LEN];   /* error string */
     int nrows = input->size.l;  /* number of rows */
     int ncols = input->size.s;  /* number of columns */
-    int band_index = 0;         /* band index */
-    int row = 0;                /* row index */
-    int col = 0;                /* column index */
     int image_data_counter = 0;        /* mask counter */
     int clear_pixel_counter = 0;       /* clear sky pixel counter */
     int clear_land_pixel_counter = 0;  /* clear land pixel counter */
     int clear_water_pixel_counter = 0; /* clear water pixel counter */
-    float ndvi, ndsi;           /* NDVI and NDSI values */
-    int16 *f_temp = NULL;       /* clear land temperature */
-    int16 *f_wtemp = NULL;      /* clear water temperature */
-    float visi_mean;            /* mean of visible bands */
-    float whiteness = 0.0;      /* whiteness value */
-    float hot;                  /* hot value for hot test */
+    Histogram_t land_temp;      /* clear land temperature */
+    Histogram_t water_temp;     /* clear water temperature */
+    Histogram_t clear_temp;     /* clear temperature */
+    Histogram_t *f_temp;        /* temperature used for land */
+    Histogram_t *f_wtemp;       /* temperature used for water */
+    Histogram_t land_nir;       /* clear land NIR */
+    Histogram_t water_nir;      /* clear water NIR */
+    Histogram_t land_swir1;     /* clear land SWIR1 */
+    Histogram_t water_swir1;    /* clear water SWIR1 */
+    Mask_shard_t *shards = NULL; /* counters and histograms of each thread */
+    int nshards;                /* number of threads */
     float land_ptm;             /* clear land pixel percentage */
     float water_ptm;            /* clear water pixel percentage */
     unsigned char land_bit;     /* Which clear bit to test all or just land */
@@ -200,36 +850,47 @@ int potential_cloud_shadow_snow_mask
     float l_pt;                 /* low percentile threshold */
     float h_pt;                 /* high percentile threshold */
     float t_wtemp;              /* high percentile water temperature */
-    float *wfinal_prob = NULL;  /* final water pixel probabilty value */
-    float *final_prob = NULL;   /* final land pixel probability value */
-    int t_bright;               /* brightness test value for water */
-    float brightness_prob;      /* brightness probability value */
+    unsigned short *prob_code = NULL; /* final probability value codes,
+                                         over water for water pixels and
+                                         over land otherwise */
+    Prob_pass_t pass;           /* what the probability pass works with */
+    Prob_row_t prob_row;        /* version of the probability pass for the
+                                   scene */
     int t_buffer;               /* temperature test buffer */
     float temp_diff = 0.0;      /* difference of low/high temperature
                                    percentiles */
-    float vari_prob;            /* probability from NDVI, NDSI, and whiteness */
-    float max_value;            /* maximum value */
-    float *prob = NULL;         /* probability value */
-    float *wprob = NULL;        /* probability value */
+    Histogram_t prob;           /* probability value */
+    Histogram_t wprob;          /* probability value */
     float clr_mask = 0.0;       /* clear sky pixel threshold */
     float wclr_mask = 0.0;      /* water pixel threshold */
+    int clr_index;              /* percentile of the clear sky threshold */
+    int wclr_index;             /* percentile of the water threshold */
+    float prob_threshold;       /* threshold for the pixel's probability */
     int data_size;              /* Data size for memory allocation */
-    int16 *nir = NULL;          /* near infrared band data */
-    int16 *swir1 = NULL;        /* short wavelength infrared band data */
     int16 *nir_data = NULL;          /* Data to be filled */
     int16 *swir1_data = NULL;        /* Data to be filled */
     int16 *filled_nir_data = NULL;   /* Filled result */
     int16 *filled_swir1_data = NULL; /* Filled result */
     float nir_boundary;         /* NIR boundary value / background value */
     float swir1_boundary;       /* SWIR1 boundary value / background value */
-    int16 shadow_prob;          /* shadow probability */
     int status;                 /* return value */
-    int satu_bv;                /* sum of saturated bands 1, 2, 3 value */
+    int spectral_bands;         /* bands used by the spectral test pass */
+    int prob_bands;             /* bands used by the probability pass */
+    int i;                      /* loop index */
 
     int pixel_index;
     int pixel_count;
 
     pixel_count = nrows * ncols;
+    data_size = pixel_count;
+
+    /* Declare the bands each pass uses, so only those are read */
+    spectral_bands = INPUT_REFLECTIVE_BANDS;
+    if (use_cirrus)
+        spectral_bands |= INPUT_BAND(BI_CIRRUS);
+    if (use_thermal)
+        spectral_bands |= INPUT_BAND(BI_THERMAL);
+    prob_bands = spectral_bands & ~INPUT_BAND(BI_SWIR_2);
 
     /* Dynamic memory allocation */
     unsigned char *clear_mask = NULL;
@@ -240,252 +901,218 @@ int potential_cloud_shadow_snow_mask
         RETURN_ERROR("Allocating mask memory", FUNC_NAME, FAILURE);
     }
 
-    if (verbose)
+    /* The clear land and clear water samples are kept apart, since which
+       of them are used is only known after the first pass.  The minimum and
+       maximum temperatures start from the extremes, and the others from
+       zero. */
+    histogram_init(&land_temp, SHRT_MAX, SHRT_MIN);
+    histogram_init(&water_temp, SHRT_MAX, SHRT_MIN);
+    histogram_init(&clear_temp, SHRT_MAX, SHRT_MIN);
+    histogram_init(&land_nir, 0.0, 0.0);
+    histogram_init(&water_nir, 0.0, 0.0);
+    histogram_init(&land_swir1, 0.0, 0.0);
+    histogram_init(&water_swir1, 0.0, 0.0);
+    histogram_init(&prob, 0.0, 0.0);
+    histogram_init(&wprob, 0.0, 0.0);
+
+    /* One set of counters and histograms for each thread */
+#ifdef _OPENMP
+    nshards = omp_get_max_threads();
+#else
+    nshards = 1;
+#endif
+    shards = create_shards(nshards);
+    if (shards == NULL)
     {
-        printf("The first pass\n");
+        RETURN_ERROR("Allocating thread histogram memory", FUNC_NAME,
+                     FAILURE);
     }
 
-    /* Loop through each line in the image */
-    for (row = 0; row < nrows; row++)
+    /* The NIR and SWIR1 bands are kept for the flood fill */
+    nir_data = calloc(data_size, sizeof(int16));
+    swir1_data = calloc(data_size, sizeof(int16));
+    if (nir_data == NULL || swir1_data == NULL)
     {
-        if (verbose)
-        {
-            /* Print status on every 1000 lines */
-            if (!(row % 1000))
-            {
-                printf("Processing line %d\r", row);
-                fflush(stdout);
-            }
-        }
+        RETURN_ERROR("Allocating nir and swir1 memory", FUNC_NAME, FAILURE);
+    }
 
-        /* For each of the image bands */
-        for (band_index = 0; band_index < input->num_toa_bands; band_index++)
-        {
-            /* Read each input reflective band -- data is read into
-               input->buf[band_index] */
-            if (!GetInputLine(input, band_index, row))
-            {
-                snprintf(errstr, sizeof(errstr),
-                         "Reading input image data for line %d, band %d",
-                         row, band_index);
-                RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
-            }
-        }
+    if (verbose)
+    {
+        printf("The first pass\n");
+    }
 
-        if (use_thermal)
+    /* Split the lines between the threads, each with its own lines and
+       line mask */
+#ifdef _OPENMP
+    #pragma omp parallel
+#endif
+    {
+        Mask_shard_t *shard = current_shard(shards);
+        Input_lines_t *lines;           /* the thread's input lines */
+        unsigned char *line_mask;       /* spectral test bits of a line */
+        char errstr[MAX_STR_LEN];       /* error string */
+        int row;                        /* row index */
+        int col;                        /* column index */
+        int pixel_index;
+        int status;
+
+        lines = CreateInputLines(input);
+        line_mask = calloc(ncols, sizeof(unsigned char));
+        if (lines == NULL || line_mask == NULL)
         {
-            /* For the thermal band */
-            /* Read the input thermal band --
-               data is read into input->therm_buf */
-            if (!GetInputThermLine(input, row))
-            {
-                snprintf(errstr, sizeof(errstr),
-                         "Reading input thermal data for line %d", row);
-                RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
-            }
+            ERROR_MESSAGE("Allocating line memory", FUNC_NAME);
+            shard->status = FAILURE;
         }
 
-        for (col = 0; col < ncols; col++)
+        /* Loop through each line in the image */
+#ifdef _OPENMP
+        #pragma omp for schedule(static)
+#endif
+        for (row = 0; row < nrows; row++)
         {
-            pixel_index = row * ncols + col;
+            if (shard->status != SUCCESS)
+                continue;
 
-            if (input->satellite != IS_LANDSAT_8)
+            if (verbose)
             {
-                /* Landsat 8 doesn't have saturation issues */
-                int band_index;
-                for (band_index = 0;
-                     band_index < input->num_toa_bands;
-                     band_index++)
-                {
-                    if (input->buf[band_index][col] ==
-                        input->meta.satu_value_ref[band_index])
-                    {
-                        input->buf[band_index][col] =
-                            input->meta.satu_value_max[band_index];
-                    }
-                }
-
-                if (use_thermal)
+                /* Print status on every 1000 lines */
+                if (!(row % 1000))
                 {
-                    if (input->buf[BI_THERMAL][col] ==
-                        input->meta.satu_value_ref[BI_THERMAL])
-                    {
-                        input->buf[BI_THERMAL][col] =
-                            input->meta.satu_value_max[BI_THERMAL];
-                    }
+                    printf("Processing line %d\r", row);
+                    fflush(stdout);
                 }
             }
 
-            /* process non-fill pixels only */
-            if (is_fill_data(input, col, use_cirrus, use_thermal))
+            /* Read the bands used by this pass -- data is read into
+               lines->buf[band_index] */
+            if (!GetInputLines(input, lines, spectral_bands, row))
             {
-                pixel_mask[pixel_index] = CF_FILL_BIT;
-                clear_mask[pixel_index] = CF_CLEAR_FILL_BIT;
+                snprintf(errstr, sizeof(errstr),
+                         "Reading input data for line %d", row);
+                ERROR_MESSAGE(errstr, FUNC_NAME);
+                shard->status = FAILURE;
                 continue;
             }
-            image_data_counter++;
-
-            if ((input->buf[BI_RED][col] + input->buf[BI_NIR][col]) != 0)
-            {
-                ndvi = (float)(input->buf[BI_NIR][col]
-                               - input->buf[BI_RED][col])
-                       / (float)(input->buf[BI_NIR][col]
-                                 + input->buf[BI_RED][col]);
-            }
-            else
-                ndvi = 0.01;
 
-            if ((input->buf[BI_GREEN][col] + input->buf[BI_SWIR_1][col]) != 0)
-            {
-                ndsi = (float)(input->buf[BI_GREEN][col]
-                               - input->buf[BI_SWIR_1][col])
-                       / (float)(input->buf[BI_GREEN][col]
-                                 + input->buf[BI_SWIR_1][col]);
-            }
-            else
-                ndsi = 0.01;
+            /* Run the spectral tests on the whole line */
+            spectral_tests_line(input, lines->buf, use_cirrus, use_thermal,
+                                line_mask);
 
-            /* Basic cloud test, equation 1 */
-            if (basic_cloud_test(input, col, ndvi, ndsi, use_thermal))
+            for (col = 0; col < ncols; col++)
             {
-                pixel_mask[pixel_index] |= CF_CLOUD_BIT;
-            }
-            else
-                pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
+                pixel_index = row * ncols + col;
 
-            /* It takes every snow pixel including snow pixels under thin
-               or icy clouds, equation 20 */
-            if (basic_snow_test(input, col, ndsi, use_thermal))
-            {
-                pixel_mask[pixel_index] |= CF_SNOW_BIT;
-            }
-            else
-                pixel_mask[pixel_index] &= ~CF_SNOW_BIT;
+                /* process non-fill pixels only */
+                if (line_mask[col] & CF_FILL_BIT)
+                {
+                    pixel_mask[pixel_index] = CF_FILL_BIT;
+                    clear_mask[pixel_index] = CF_CLEAR_FILL_BIT;
+                    continue;
+                }
+                shard->image_data_counter++;
 
-            /* Zhe's water test (works over thin cloud), equation 5 */
-            if (zhe_water_test(input, col, ndvi))
-            {
-                pixel_mask[pixel_index] |= CF_WATER_BIT;
-            }
-            else
-                pixel_mask[pixel_index] &= ~CF_WATER_BIT;
+                pixel_mask[pixel_index] &= ~(CF_CLOUD_BIT | CF_SNOW_BIT
+                                             | CF_WATER_BIT);
+                pixel_mask[pixel_index] |= line_mask[col];
 
-            /* visible bands flatness (sum(abs)/mean < 0.6 => bright and dark
-               cloud), equation 2 */
-            if (pixel_mask[pixel_index] & CF_CLOUD_BIT)
-            {
-                visi_mean = (float)(input->buf[BI_BLUE][col]
-                                    + input->buf[BI_GREEN][col]
-                                    + input->buf[BI_RED][col]) / 3.0;
-                if (visi_mean != 0)
+                /* Build counters for clear, clear land, and clear water,
+                   and gather the clear land and clear water histograms */
+                if (pixel_mask[pixel_index] & CF_CLOUD_BIT)
                 {
-                    whiteness =
-                        ((fabs ((float)input->buf[BI_BLUE][col] - visi_mean)
-                          + fabs ((float)input->buf[BI_GREEN][col] - visi_mean)
-                          + fabs ((float)input->buf[BI_RED][col]
-                                  - visi_mean))) / visi_mean;
+                    /* It is cloud so make sure none of the bits are set */
+                    clear_mask[pixel_index] = CF_CLEAR_NONE;
                 }
                 else
                 {
-                    /* Just put a large value to remove them from cloud pixel
-                       identification */
-                    whiteness = 100.0;
-                }
-            }
+                    clear_mask[pixel_index] = CF_CLEAR_BIT;
+                    shard->clear_pixel_counter++;
 
-            satu_bv = 0;
-            if (input->satellite != IS_LANDSAT_8)
-            {
-                /* Landsat 8 doesn't have saturation issues */
-                /* Update cloud_mask,  if one visible band is saturated,
-                   whiteness = 0, due to data type conversion, pixel value
-                   difference of 1 is possible */
-                if ((input->buf[BI_BLUE][col]
-                     >= (input->meta.satu_value_max[BI_BLUE] - 1))
-                    ||
-                    (input->buf[BI_GREEN][col]
-                     >= (input->meta.satu_value_max[BI_GREEN] - 1))
-                    ||
-                    (input->buf[BI_RED][col]
-                     >= (input->meta.satu_value_max[BI_RED] - 1)))
-                {
-                    whiteness = 0.0;
-                    satu_bv = 1;
-                }
-            }
+                    if (pixel_mask[pixel_index] & CF_WATER_BIT)
+                    {
+                        /* Add the clear water bit */
+                        clear_mask[pixel_index] |= CF_CLEAR_WATER_BIT;
+                        shard->clear_water_pixel_counter++;
+
+                        status = histogram_add(&shard->water_nir,
+                                               lines->buf[BI_NIR][col]);
+                        if (status == SUCCESS)
+                            status = histogram_add(&shard->water_swir1,
+                                                lines->buf[BI_SWIR_1][col]);
+                        if (status == SUCCESS && use_thermal)
+                            status = histogram_add(&shard->water_temp,
+                                                lines->buf[BI_THERMAL][col]);
+                    }
+                    else
+                    {
+                        /* Add the clear land bit */
+                        clear_mask[pixel_index] |= CF_CLEAR_LAND_BIT;
+                        shard->clear_land_pixel_counter++;
+
+                        status = histogram_add(&shard->land_nir,
+                                               lines->buf[BI_NIR][col]);
+                        if (status == SUCCESS)
+                            status = histogram_add(&shard->land_swir1,
+                                                lines->buf[BI_SWIR_1][col]);
+                        if (status == SUCCESS && use_thermal)
+                            status = histogram_add(&shard->land_temp,
+                                                lines->buf[BI_THERMAL][col]);
+                    }
 
-            if ((pixel_mask[pixel_index] & CF_CLOUD_BIT) &&
-                whiteness < 0.7)
-            {
-                pixel_mask[pixel_index] |= CF_CLOUD_BIT;
+                    if (status != SUCCESS)
+                    {
+                        ERROR_MESSAGE("Adding to the clear pixel histograms",
+                                      FUNC_NAME);
+                        shard->status = FAILURE;
+                        break;
+                    }
+                }
             }
-            else
-                pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
-
-            /* Haze test, equation 3 */
-            hot = (float)input->buf[BI_BLUE][col]
-                  - 0.5 * (float)input->buf[BI_RED][col]
-                  - 800.0;
-            if ((pixel_mask[pixel_index] & CF_CLOUD_BIT)
-                && (hot > 0.0 || satu_bv == 1))
-                pixel_mask[pixel_index] |= CF_CLOUD_BIT;
-            else
-                pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
 
-            /* Ratio 4/5 > 0.75 test, equation 4 */
-            if ((pixel_mask[pixel_index] & CF_CLOUD_BIT) &&
-                input->buf[BI_SWIR_1][col] != 0)
-            {
-                if ((float)input->buf[BI_NIR][col] /
-                    (float)input->buf[BI_SWIR_1][col] > 0.75)
-                    pixel_mask[pixel_index] |= CF_CLOUD_BIT;
-                else
-                    pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
-            }
-            else
-                pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
+            /* NIR */
+            memcpy(&nir_data[row * ncols], &lines->buf[BI_NIR][0],
+                   ncols * sizeof(int16));
+            /* SWIR1 */
+            memcpy(&swir1_data[row * ncols], &lines->buf[BI_SWIR_1][0],
+                   ncols * sizeof(int16));
+        }
 
-            /* Cirrus cloud test */
-            if (use_cirrus)
-            {
-                if ((pixel_mask[pixel_index] & CF_CLOUD_BIT)
-                    ||
-                    (float)(input->buf[BI_CIRRUS][col] / 400.0 - 0.25)
-                    > 0.0)
-                {
-                    pixel_mask[pixel_index] |= CF_CLOUD_BIT;
-                }
-                else
-                    pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
-            }
+        free(line_mask);
+        FreeInputLines(lines);
+    }
+    printf("\n");
 
-            /* Build counters for clear, clear land, and clear water */
-            if (pixel_mask[pixel_index] & CF_CLOUD_BIT)
-            {
-                /* It is cloud so make sure none of the bits are set */
-                clear_mask[pixel_index] = CF_CLEAR_NONE;
-            }
-            else
-            {
-                clear_mask[pixel_index] = CF_CLEAR_BIT;
-                clear_pixel_counter++;
+    /* Merge the counters and histograms of the threads */
+    for (i = 0; i < nshards; i++)
+    {
+        if (shards[i].status != SUCCESS)
+        {
+            RETURN_ERROR("Running the first pass", FUNC_NAME, FAILURE);
+        }
 
-                if (pixel_mask[pixel_index] & CF_WATER_BIT)
-                {
-                    /* Add the clear water bit */
-                    clear_mask[pixel_index] |= CF_CLEAR_WATER_BIT;
-                    clear_water_pixel_counter++;
-                }
-                else
-                {
-                    /* Add the clear land bit */
-                    clear_mask[pixel_index] |= CF_CLEAR_LAND_BIT;
-                    clear_land_pixel_counter++;
-                }
-            }
+        image_data_counter += shards[i].image_data_counter;
+        clear_pixel_counter += shards[i].clear_pixel_counter;
+        clear_land_pixel_counter += shards[i].clear_land_pixel_counter;
+        clear_water_pixel_counter += shards[i].clear_water_pixel_counter;
+
+        if (histogram_merge(&land_temp, &shards[i].land_temp) != SUCCESS
+            || histogram_merge(&water_temp, &shards[i].water_temp) != SUCCESS
+            || histogram_merge(&land_nir, &shards[i].land_nir) != SUCCESS
+            || histogram_merge(&water_nir, &shards[i].water_nir) != SUCCESS
+            || histogram_merge(&land_swir1, &shards[i].land_swir1) != SUCCESS
+            || histogram_merge(&water_swir1, &shards[i].water_swir1)
+               != SUCCESS)
+        {
+            RETURN_ERROR("Merging the clear pixel histograms", FUNC_NAME,
+                         FAILURE);
         }
+
+        histogram_free(&shards[i].land_temp);
+        histogram_free(&shards[i].water_temp);
+        histogram_free(&shards[i].land_nir);
+        histogram_free(&shards[i].water_nir);
+        histogram_free(&shards[i].land_swir1);
+        histogram_free(&shards[i].water_swir1);
     }
-    printf("\n");
 
     *clear_ptm = 100.0 * ((float)clear_pixel_counter
                           / (float)image_data_counter);
@@ -513,6 +1140,9 @@ int potential_cloud_shadow_snow_mask
             *t_temph = -1.0;
         }
 
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(static)
+#endif
         for (pixel_index = 0; pixel_index < pixel_count; pixel_index++)
         {
             /* All cloud and cloud shadow.  If cloud, mark cloud confidence
@@ -528,24 +1158,20 @@ int potential_cloud_shadow_snow_mask
                 pixel_mask[pixel_index] |= CF_SHADOW_BIT;
             }
         }
+
+        /* Release the memory */
+        histogram_free(&land_temp);
+        histogram_free(&water_temp);
+        histogram_free(&land_nir);
+        histogram_free(&water_nir);
+        histogram_free(&land_swir1);
+        histogram_free(&water_swir1);
+        free_shards(shards, nshards);
+        free(nir_data);
+        free(swir1_data);
     }
     else
     {
-        if (use_thermal)
-        {
-            f_temp = calloc(pixel_count, sizeof(int16));
-            f_wtemp = calloc(pixel_count, sizeof(int16));
-            if (f_temp == NULL || f_wtemp == NULL)
-            {
-                RETURN_ERROR("Allocating temp memory", FUNC_NAME, FAILURE);
-            }
-        }
-
-        if (verbose)
-        {
-            printf("The second pass\n");
-        }
-
         /* Determine which bit to test for land */
         if (land_ptm >= 0.1)
         {
@@ -570,854 +1196,342 @@ int potential_cloud_shadow_snow_mask
             water_bit = CF_CLEAR_BIT;
         }
 
-        int16 f_temp_max = SHRT_MIN;
-        int16 f_temp_min = SHRT_MAX;
-        int16 f_wtemp_max = SHRT_MIN;
-        int16 f_wtemp_min = SHRT_MAX;
-        int land_count = 0;
-        int water_count = 0;
-        /* Loop through each line in the image */
-        for (row = 0; row < nrows; row++)
-        {
-            if (verbose)
-            {
-                /* Print status on every 1000 lines */
-                if (!(row % 1000))
-                {
-                    printf("Processing line %d\r", row);
-                    fflush(stdout);
-                }
-            }
+        /* Tempearture for snow test */
+        l_pt = 0.175;
+        h_pt = 1.0 - l_pt;
 
-            if (use_thermal)
+        if (use_thermal)
+        {
+            /* Select the temperatures used for land and water */
+            f_temp = &land_temp;
+            f_wtemp = &water_temp;
+            if (land_bit == CF_CLEAR_BIT || water_bit == CF_CLEAR_BIT)
             {
-                /* For the thermal band, read the input thermal band  */
-                if (!GetInputThermLine(input, row))
+                if (histogram_merge(&clear_temp, &land_temp) != SUCCESS
+                    || histogram_merge(&clear_temp, &water_temp) != SUCCESS)
                 {
-                    snprintf(errstr, sizeof(errstr),
-                             "Reading input thermal data for line %d", row);
-                    RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
+                    RETURN_ERROR("Merging the temperature histograms",
+                                 FUNC_NAME, FAILURE);
                 }
+                if (land_bit == CF_CLEAR_BIT)
+                    f_temp = &clear_temp;
+                if (water_bit == CF_CLEAR_BIT)
+                    f_wtemp = &clear_temp;
             }
 
-            for (col = 0; col < ncols; col++)
-            {
-                pixel_index = row * ncols + col;
-
-                if (clear_mask[pixel_index] & CF_CLEAR_FILL_BIT)
-                    continue;
-
-                if (use_thermal && input->satellite != IS_LANDSAT_8)
-                {
-                    /* Landsat 8 doesn't have saturation issues */
-                    if (input->buf[BI_THERMAL][col] ==
-                        input->meta.satu_value_ref[BI_THERMAL])
-                    {
-                        input->buf[BI_THERMAL][col] =
-                            input->meta.satu_value_max[BI_THERMAL];
-                    }
-                }
+            /* 0.175 percentile background temperature (low) */
+            histogram_prctile(f_temp, 100.0 * l_pt, t_templ);
 
-                /* get clear land temperature */
-                if (clear_mask[pixel_index] & land_bit)
-                {
-                    if (use_thermal)
-                    {
-                        f_temp[land_count] = input->buf[BI_THERMAL][col];
-                        if (f_temp_max < f_temp[land_count])
-                            f_temp_max = f_temp[land_count];
-                        if (f_temp_min > f_temp[land_count])
-                            f_temp_min = f_temp[land_count];
-                    }
-                    land_count++;
-                }
+            /* 0.825 percentile background temperature (high) */
+            histogram_prctile(f_temp, 100.0 * h_pt, t_temph);
 
-                /* get clear water temperature */
-                if (clear_mask[pixel_index] & water_bit)
-                {
-                    if (use_thermal)
-                    {
-                        f_wtemp[water_count] = input->buf[BI_THERMAL][col];
-                        if (f_wtemp_max < f_wtemp[water_count])
-                            f_wtemp_max = f_wtemp[water_count];
-                        if (f_wtemp_min > f_wtemp[water_count])
-                            f_wtemp_min = f_wtemp[water_count];
-                    }
-                    water_count++;
-                }
-            }
-        }
-        printf("\n");
+            histogram_prctile(f_wtemp, 100.0 * h_pt, &t_wtemp);
 
-        if (use_thermal)
-        {
-            /* Set maximum and minimum values to zero if no clear land/water
-               pixels */
-            if (f_temp_min == SHRT_MAX)
-                f_temp_min = 0;
-            if (f_temp_max == SHRT_MIN)
-                f_temp_max = 0;
-            if (f_wtemp_min == SHRT_MAX)
-                f_wtemp_min = 0;
-            if (f_wtemp_max == SHRT_MIN)
-                f_wtemp_max = 0;
+            /* Temperature test */
+            t_buffer = 4 * 100;
+            *t_templ -= (float)t_buffer;
+            *t_temph += (float)t_buffer;
+            temp_diff = *t_temph - *t_templ;
         }
 
-        /* Tempearture for snow test */
-        l_pt = 0.175;
-        h_pt = 1.0 - l_pt;
-
-        if (use_thermal)
+        /* Band NIR & SWIR1 flood fill section */
+        if (land_bit == CF_CLEAR_BIT)
         {
-            /* 0.175 percentile background temperature (low) */
-            status = prctile(f_temp, land_count, f_temp_min, f_temp_max,
-                             100.0 * l_pt, t_templ);
-            if (status != SUCCESS)
+            if (histogram_merge(&land_nir, &water_nir) != SUCCESS
+                || histogram_merge(&land_swir1, &water_swir1) != SUCCESS)
             {
-                RETURN_ERROR("Error calling prctile routine",
+                RETURN_ERROR("Merging the nir and swir1 histograms",
                              FUNC_NAME, FAILURE);
             }
+        }
 
-            /* 0.825 percentile background temperature (high) */
-            status = prctile(f_temp, land_count, f_temp_min, f_temp_max,
-                             100.0 * h_pt, t_temph);
-            if (status != SUCCESS)
-            {
-                RETURN_ERROR("Error calling prctile routine",
-                             FUNC_NAME, FAILURE);
-            }
+        /* Estimating background (land) Band NIR Ref */
+        histogram_prctile(&land_nir, 100.0 * l_pt, &nir_boundary);
+        histogram_prctile(&land_swir1, 100.0 * l_pt, &swir1_boundary);
+
+        /* Release the memory */
+        histogram_free(&land_temp);
+        histogram_free(&water_temp);
+        histogram_free(&clear_temp);
+        histogram_free(&land_nir);
+        histogram_free(&water_nir);
+        histogram_free(&land_swir1);
+        histogram_free(&water_swir1);
+
+        filled_nir_data = calloc(data_size, sizeof(int16));
+        filled_swir1_data = calloc(data_size, sizeof(int16));
+        if (filled_nir_data == NULL || filled_swir1_data == NULL)
+        {
+            RETURN_ERROR("Allocating nir and swir1 memory",
+                         FUNC_NAME, FAILURE);
+        }
 
-            status = prctile(f_wtemp, water_count, f_wtemp_min, f_wtemp_max,
-                             100.0 * h_pt, &t_wtemp);
-            if (status != SUCCESS)
+        /* Call the fill minima routine to do image fill; both bands are
+           filled together, since they share the boundary pixels */
+        {
+            const char *band_names[2] = {"NIR Band", "SWIR1 Band"};
+            const int16 *in_imgs[2];
+            int16 *out_imgs[2];
+            float boundary_vals[2];
+
+            in_imgs[0] = nir_data;
+            in_imgs[1] = swir1_data;
+            out_imgs[0] = filled_nir_data;
+            out_imgs[1] = filled_swir1_data;
+            boundary_vals[0] = nir_boundary;
+            boundary_vals[1] = swir1_boundary;
+
+            status = fill_local_minima_approx(2, band_names, in_imgs,
+                                              input->size.l, input->size.s,
+                                              boundary_vals, fill_engine,
+                                              fill_scale, out_imgs);
+
+            if (status == SUCCESS && fill_compare && fill_scale > 1)
             {
-                RETURN_ERROR("Error calling prctile routine",
-                             FUNC_NAME, FAILURE);
+                status = report_fill_disagreement(band_names, in_imgs,
+                             (const int16 *const *)out_imgs, input->size.l,
+                             input->size.s, boundary_vals, fill_engine,
+                             fill_scale);
             }
+        }
 
-            /* Temperature test */
-            t_buffer = 4 * 100;
-            *t_templ -= (float)t_buffer;
-            *t_temph += (float)t_buffer;
-            temp_diff = *t_temph - *t_templ;
+        /* Release the memory */
+        free(nir_data);
+        free(swir1_data);
+        nir_data = NULL;
+        swir1_data = NULL;
 
-            /* Release f_temp memory */
-            free(f_wtemp);
-            f_wtemp = NULL;
-            free(f_temp);
-            f_temp = NULL;
+        if (status != SUCCESS)
+        {
+            free(filled_nir_data);
+            free(filled_swir1_data);
+            RETURN_ERROR("Running fill_local_minima_in_images",
+                         FUNC_NAME, FAILURE);
         }
 
-        wfinal_prob = calloc(pixel_count, sizeof(float));
-        final_prob = calloc(pixel_count, sizeof(float));
-        if (wfinal_prob == NULL || final_prob == NULL)
+        prob_code = calloc(pixel_count, sizeof(unsigned short));
+        if (prob_code == NULL)
         {
             RETURN_ERROR("Allocating prob memory", FUNC_NAME, FAILURE);
         }
 
+        /* Gather what the probability pass needs, and pick its version
+           for the scene */
+        pass.ncols = ncols;
+        pass.t_wtemp = 0.0;
+        pass.t_templ = 0.0;
+        pass.t_temph = 0.0;
+        pass.temp_diff = temp_diff;
+        pass.t_buffer = 0;
+        if (use_thermal)
+        {
+            pass.t_wtemp = t_wtemp;
+            pass.t_templ = *t_templ;
+            pass.t_temph = *t_temph;
+            pass.t_buffer = t_buffer;
+        }
+        pass.satu_blue = input->meta.satu_value_max[BI_BLUE] - 1;
+        pass.satu_green = input->meta.satu_value_max[BI_GREEN] - 1;
+        pass.satu_red = input->meta.satu_value_max[BI_RED] - 1;
+        pass.clear_mask = clear_mask;
+        pass.filled_nir_data = filled_nir_data;
+        pass.filled_swir1_data = filled_swir1_data;
+        pass.pixel_mask = pixel_mask;
+        pass.conf_mask = conf_mask;
+        pass.prob_offset = cloud_prob_threshold;
+        pass.prob_code = prob_code;
+        prob_row = select_probability_row(input->satellite, use_thermal,
+                                          use_cirrus);
+
         if (verbose)
         {
-            printf("The third pass\n");
+            printf("The second pass\n");
         }
 
-        /* Loop through each line in the image */
-        for (row = 0; row < nrows; row++)
+        /* Split the lines between the threads, each with its own lines */
+#ifdef _OPENMP
+        #pragma omp parallel
+#endif
         {
-            if (verbose)
+            Mask_shard_t *shard = current_shard(shards);
+            Input_lines_t *lines;       /* the thread's input lines */
+            char errstr[MAX_STR_LEN];   /* error string */
+            int row;                    /* row index */
+
+            lines = CreateInputLines(input);
+            if (lines == NULL)
             {
-                /* Print status on every 1000 lines */
-                if (!(row % 1000))
-                {
-                    printf("Processing line %d\r", row);
-                    fflush(stdout);
-                }
+                ERROR_MESSAGE("Allocating line memory", FUNC_NAME);
+                shard->status = FAILURE;
             }
 
-            /* For each of the image bands */
-            for (band_index = 0;
-                 band_index < input->num_toa_bands;
-                 band_index++)
+            /* Loop through each line in the image */
+#ifdef _OPENMP
+            #pragma omp for schedule(static)
+#endif
+            for (row = 0; row < nrows; row++)
             {
-                /* Read each input reflective band -- data is read into
-                   input->buf[band_index] */
-                if (!GetInputLine(input, band_index, row))
+                if (shard->status != SUCCESS)
+                    continue;
+
+                if (verbose)
                 {
-                    snprintf(errstr, sizeof(errstr),
-                             "Reading input image data for line %d, band %d",
-                             row, band_index);
-                    RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
+                    /* Print status on every 1000 lines */
+                    if (!(row % 1000))
+                    {
+                        printf("Processing line %d\r", row);
+                        fflush(stdout);
+                    }
                 }
-            }
 
-            if (use_thermal)
-            {
-                /* For the thermal band, data is read into input->therm_buf */
-                if (!GetInputThermLine(input, row))
+                /* Read the bands used by this pass -- data is read into
+                   lines->buf[band_index] */
+                if (!GetInputLines(input, lines, prob_bands, row))
                 {
                     snprintf(errstr, sizeof(errstr),
-                             "Reading input thermal data for line %d", row);
-                    RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
+                             "Reading input data for line %d", row);
+                    ERROR_MESSAGE(errstr, FUNC_NAME);
+                    shard->status = FAILURE;
+                    continue;
+                }
+
+                /* Compute the probabilities and tests for the line */
+                if (prob_row(&pass, lines->buf, row, shard) != SUCCESS)
+                {
+                    shard->status = FAILURE;
                 }
             }
 
-            /* Loop through each sample in the image */
-            for (col = 0; col < ncols; col++)
-            {
-                pixel_index = row * ncols + col;
-
-                if (pixel_mask[pixel_index] & CF_FILL_BIT)
-                    continue;
-
-                if (input->satellite != IS_LANDSAT_8)
-                {
-                    /* Landsat 8 doesn't have saturation issues */
-                    for (band_index = 0;
-                         band_index < NON_CIRRUS_BAND_COUNT;
-                         band_index++)
-                    {
-                        if (input->buf[band_index][col] ==
-                            input->meta.satu_value_ref[band_index])
-                        {
-                            input->buf[band_index][col] =
-                                input->meta.satu_value_max[band_index];
-                        }
-                    }
-
-                    if (use_thermal)
-                    {
-                        if (input->buf[BI_THERMAL][col] ==
-                            input->meta.satu_value_ref[BI_THERMAL])
-                        {
-                            input->buf[BI_THERMAL][col] =
-                                input->meta.satu_value_max[BI_THERMAL];
-                        }
-                    }
-                }
-
-                if (pixel_mask[pixel_index] & CF_WATER_BIT)
-                {
-                    /* Brightness test (over water) */
-                    t_bright = 1100;
-                    brightness_prob = (float)input->buf[BI_SWIR_1][col] /
-                        (float)t_bright;
-                    if (brightness_prob > 1.0)
-                        brightness_prob = 1.0;
-                    if (brightness_prob < 0.0)
-                        brightness_prob = 0.0;
-
-                    if (use_thermal)
-                    {
-                        /* water temperature probability value */
-                        float wtemp_prob;
-
-                        /* Get cloud prob over water */
-                        /* Temperature test over water */
-                        wtemp_prob =
-                            (t_wtemp - (float)input->buf[BI_THERMAL][col])
-                            / 400.0;
-
-                        if (wtemp_prob < 0.0)
-                            wtemp_prob = 0.0;
-
-                        brightness_prob *= wtemp_prob;
-                    }
-
-                    /*Final prob mask (water), cloud over water probability */
-                    if (use_cirrus)
-                    {
-                        wfinal_prob[pixel_index] = 100.0
-                            * (brightness_prob
-                               + (float)input->buf[BI_CIRRUS][col] / 400.0);
-                    }
-                    else
-                    {
-                        wfinal_prob[pixel_index] = 100.0 * brightness_prob;
-                    }
-
-                    final_prob[pixel_index] = 0.0;
-                }
-                else
-                {
-                    if ((input->buf[BI_RED][col]
-                         + input->buf[BI_NIR][col]) != 0)
-                    {
-                        ndvi = (float)(input->buf[BI_NIR][col]
-                                       - input->buf[BI_RED][col])
-                               / (float)(input->buf[BI_NIR][col]
-                                         + input->buf[BI_RED][col]);
-                    }
-                    else
-                        ndvi = 0.01;
-
-                    if ((input->buf[BI_GREEN][col]
-                         + input->buf[BI_SWIR_1][col]) != 0)
-                    {
-                        ndsi = (float)(input->buf[BI_GREEN][col]
-                                       - input->buf[BI_SWIR_1][col])
-                               / (float)(input->buf[BI_GREEN][col]
-                                         + input->buf[BI_SWIR_1][col]);
-                    }
-                    else
-                        ndsi = 0.01;
-
-                    /* NDVI and NDSI should not be negative */
-                    if (ndsi < 0.0)
-                        ndsi = 0.0;
-                    if (ndvi < 0.0)
-                        ndvi = 0.0;
-
-                    visi_mean = (input->buf[BI_BLUE][col]
-                                 + input->buf[BI_GREEN][col]
-                                 + input->buf[BI_RED][col]) / 3.0;
-                    if (visi_mean != 0)
-                    {
-                        whiteness =
-                            ((fabs((float)input->buf[BI_BLUE][col]
-                                   - visi_mean)
-                              + fabs((float)input->buf[BI_GREEN][col]
-                                     - visi_mean)
-                              + fabs((float)input->buf[BI_RED][col]
-                                     - visi_mean))) / visi_mean;
-                    }
-                    else
-                        whiteness = 0.0;
-
-                    if (input->satellite != IS_LANDSAT_8)
-                    {
-                        /* Landsat 8 doesn't have saturation issues */
-                        /* If one visible band is saturated, whiteness = 0 */
-                        if ((input->buf[BI_BLUE][col]
-                             >= (input->meta.satu_value_max[BI_BLUE] - 1))
-                            ||
-                            (input->buf[BI_GREEN][col]
-                             >= (input->meta.satu_value_max[BI_GREEN] - 1))
-                            ||
-                            (input->buf[BI_RED][col]
-                             >= (input->meta.satu_value_max[BI_RED] - 1)))
-                        {
-                            whiteness = 0.0;
-                        }
-                    }
-
-                    /* Vari_prob=1-max(max(abs(NDSI),abs(NDVI)),whiteness); */
-                    if (ndsi > ndvi)
-                        max_value = ndsi;
-                    else
-                        max_value = ndvi;
-                    if (whiteness > max_value)
-                        max_value = whiteness;
-                    vari_prob = 1.0 - max_value;
-
-                    if (use_thermal)
-                    {
-                        /* temperature probability */
-                        float temp_prob;
-
-                        temp_prob =
-                            (*t_temph - (float)input->buf[BI_THERMAL][col])
-                            / temp_diff;
-
-                        /* Temperature can have prob > 1 */
-                        if (temp_prob < 0.0)
-                            temp_prob = 0.0;
-
-                        vari_prob *= temp_prob;
-                    }
-
-                    /*Final prob mask (land) */
-                    if (use_cirrus)
-                    {
-                        final_prob[pixel_index] = 100.0 *
-                            (vari_prob + ((float)input->buf[BI_CIRRUS][col]
-                                          / 400.0));
-                    }
-                    else
-                    {
-                        final_prob[pixel_index] = 100.0 * vari_prob;
-                    }
-
-                    wfinal_prob[pixel_index] = 0.0;
-                }
-            }
+            FreeInputLines(lines);
         }
         printf("\n");
 
-        /* Allocate memory for prob */
-        prob = malloc(pixel_count * sizeof(float));
-        if (prob == NULL)
-        {
-            RETURN_ERROR("Allocating prob memory", FUNC_NAME, FAILURE);
-        }
+        /* Release the memory */
+        free(filled_nir_data);
+        filled_nir_data = NULL;
+        free(filled_swir1_data);
+        filled_swir1_data = NULL;
 
-        float prob_max = 0.0;
-        float prob_min = 0.0;
-        land_count = 0;
-        for (pixel_index = 0; pixel_index < pixel_count; pixel_index++)
+        /* Merge the probability histograms of the threads */
+        for (i = 0; i < nshards; i++)
         {
-            if (clear_mask[pixel_index] & CF_CLEAR_FILL_BIT)
-                continue;
-
-            if (clear_mask[pixel_index] & land_bit)
+            if (shards[i].status != SUCCESS)
             {
-                prob[land_count] = final_prob[pixel_index];
-
-                if (prob[land_count] > prob_max)
-                    prob_max = prob[land_count];
-
-                if (prob_min > prob[land_count])
-                    prob_min = prob[land_count];
-
-                land_count++;
+                RETURN_ERROR("Running the second pass", FUNC_NAME, FAILURE);
             }
-        }
 
-        /* Dynamic threshold for land */
-        status = prctile2(prob, land_count, prob_min, prob_max,
-                          100.0 * h_pt, &clr_mask);
-        if (status != SUCCESS)
-        {
-            RETURN_ERROR("Error calling prctile2 routine", FUNC_NAME, FAILURE);
+            if (histogram_merge(&prob, &shards[i].prob) != SUCCESS
+                || histogram_merge(&wprob, &shards[i].wprob) != SUCCESS)
+            {
+                RETURN_ERROR("Merging the prob histograms", FUNC_NAME,
+                             FAILURE);
+            }
         }
-        clr_mask += cloud_prob_threshold;
 
-        /* Release memory for prob */
-        free(prob);
-        prob = NULL;
-
-        /* Allocate memory for wprob */
-        wprob = malloc(pixel_count * sizeof(float));
-        if (wprob == NULL)
+        /* The land probability is zero over clear water and the water
+           probability is zero over clear land, which matters when all clear
+           pixels are used */
+        status = SUCCESS;
+        if (land_bit == CF_CLEAR_BIT)
         {
-            RETURN_ERROR("Allocating wprob memory", FUNC_NAME, FAILURE);
+            for (i = 0; i < clear_water_pixel_counter && status == SUCCESS;
+                 i++)
+            {
+                status = histogram_add_float(&prob, 0.0);
+            }
         }
-
-        float wprob_max = 0.0;
-        float wprob_min = 0.0;
-        water_count = 0;
-        for (pixel_index = 0; pixel_index < pixel_count; pixel_index++)
+        if (water_bit == CF_CLEAR_BIT)
         {
-            if (clear_mask[pixel_index] & CF_CLEAR_FILL_BIT)
-                continue;
-
-            if (clear_mask[pixel_index] & water_bit)
+            for (i = 0; i < clear_land_pixel_counter && status == SUCCESS;
+                 i++)
             {
-                wprob[water_count] = wfinal_prob[pixel_index];
-
-                if (wprob[water_count] > wprob_max)
-                    wprob_max = wprob[water_count];
-
-                if (wprob_min > wprob[water_count])
-                    wprob_min = wprob[water_count];
-
-                water_count++;
+                status = histogram_add_float(&wprob, 0.0);
             }
         }
-
-        /* Dynamic threshold for water */
-        status = prctile2(wprob, water_count, wprob_min, wprob_max,
-                          100.0 * h_pt, &wclr_mask);
         if (status != SUCCESS)
         {
-            RETURN_ERROR("Error calling prctile2 routine", FUNC_NAME, FAILURE);
+            RETURN_ERROR("Adding to the prob histograms", FUNC_NAME, FAILURE);
         }
+
+        /* Dynamic threshold for land.  The percentile is the value of one of
+           the bins, so its index is a whole number. */
+        histogram_prctile(&prob, 100.0 * h_pt, &clr_mask);
+        clr_index = (int)clr_mask;
+        clr_mask += cloud_prob_threshold;
+
+        /* Dynamic threshold for water */
+        histogram_prctile(&wprob, 100.0 * h_pt, &wclr_mask);
+        wclr_index = (int)wclr_mask;
         wclr_mask += cloud_prob_threshold;
 
-        /* Release memory for wprob */
-        free(wprob);
-        wprob = NULL;
+        /* Release memory for prob and wprob */
+        histogram_free(&prob);
+        histogram_free(&wprob);
 
         if (verbose)
         {
             printf("probability threshold (land) = %.2f\n", clr_mask);
             printf("probability threshold (water) = %.2f\n", wclr_mask);
-
-            printf("The fourth pass\n");
-        }
-
-        /* Loop through each line in the image */
-        for (row = 0; row < nrows; row++)
-        {
-            if (verbose)
-            {
-                /* Print status on every 1000 lines */
-                if (!(row % 1000))
-                {
-                    printf("Processing line %d\r", row);
-                    fflush(stdout);
-                }
-            }
-
-            if (use_thermal)
-            {
-                /* For the thermal band, data is read into input->therm_buf */
-                if (!GetInputThermLine(input, row))
-                {
-                    snprintf(errstr, sizeof(errstr),
-                             "Reading input thermal data for line %d", row);
-                    RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
-                }
-            }
-
-            for (col = 0; col < ncols; col++)
-            {
-                pixel_index = row * ncols + col;
-
-                if (pixel_mask[pixel_index] & CF_FILL_BIT)
-                    continue;
-
-                if (use_thermal)
-                {
-                    if (input->satellite != IS_LANDSAT_8)
-                    {
-                        /* Landsat 8 doesn't have saturation issues */
-                        if (input->buf[BI_THERMAL][col] ==
-                            input->meta.satu_value_ref[BI_THERMAL])
-                        {
-                            input->buf[BI_THERMAL][col] =
-                                input->meta.satu_value_max[BI_THERMAL];
-                        }
-                    }
-
-                    if (input->buf[BI_THERMAL][col]
-                        < *t_templ + t_buffer - 3500)
-                    {
-                        /* This test indicates a high confidence */
-                        conf_mask[pixel_index] = CLOUD_CONFIDENCE_HIGH;
-
-                        /* Original code was only this if test and setting the
-                           cloud bit or not */
-                        pixel_mask[pixel_index] |= CF_CLOUD_BIT;
-                    }
-                }
-
-                if (conf_mask[pixel_index] == CLOUD_CONFIDENCE_NONE)
-                {
-                    if (((pixel_mask[pixel_index] & CF_CLOUD_BIT)
-                         &&
-                         (final_prob[pixel_index] > clr_mask)
-                         &&
-                         (!(pixel_mask[pixel_index] & CF_WATER_BIT)))
-                        ||
-                        ((pixel_mask[pixel_index] & CF_CLOUD_BIT)
-                         &&
-                         (wfinal_prob[pixel_index] > wclr_mask)
-                         &&
-                         (pixel_mask[pixel_index] & CF_WATER_BIT)))
-                    {
-                        /* This test indicates a high confidence */
-                        conf_mask[pixel_index] = CLOUD_CONFIDENCE_HIGH;
-
-                        /* Original code was only this if test and setting the
-                           cloud bit or not */
-                        pixel_mask[pixel_index] |= CF_CLOUD_BIT;
-                    }
-                    else if (((pixel_mask[pixel_index] & CF_CLOUD_BIT)
-                              &&
-                              (final_prob[pixel_index] > clr_mask-10.0)
-                              &&
-                              (!(pixel_mask[pixel_index] & CF_WATER_BIT)))
-                             ||
-                             ((pixel_mask[pixel_index] & CF_CLOUD_BIT)
-                              &&
-                              (wfinal_prob[pixel_index] > wclr_mask-10.0)
-                              &&
-                              (pixel_mask[pixel_index] & CF_WATER_BIT)))
-                    {
-                        /* This test indicates a medium confidence */
-                        conf_mask[pixel_index] = CLOUD_CONFIDENCE_MED;
-
-                        /* Don't set the cloud bit per the original code */
-                        pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
-                    }
-                    else
-                    {
-                        /* All remaining are a low confidence */
-                        conf_mask[pixel_index] = CLOUD_CONFIDENCE_LOW;
-
-                        /* Don't set the cloud bit per the original code */
-                        pixel_mask[pixel_index] &= ~CF_CLOUD_BIT;
-                    }
-                }
-            }
-        }
-        printf("\n");
-
-        /* Free the memory */
-        free(wfinal_prob);
-        wfinal_prob = NULL;
-        free(final_prob);
-        final_prob = NULL;
-
-        /* Band NIR & SWIR1 flood fill section */
-        data_size = input->size.l * input->size.s;
-        nir = calloc(data_size, sizeof(int16));
-        swir1 = calloc(data_size, sizeof(int16));
-        if (nir == NULL || swir1 == NULL)
-        {
-            RETURN_ERROR("Allocating nir and swir1 memory",
-                         FUNC_NAME, FAILURE);
-        }
-
-        if (verbose)
-        {
-            printf("The fifth pass\n");
-        }
-
-        nir_data = calloc(data_size, sizeof(int16));
-        swir1_data = calloc(data_size, sizeof(int16));
-        filled_nir_data = calloc(data_size, sizeof(int16));
-        filled_swir1_data = calloc(data_size, sizeof(int16));
-        if (nir_data == NULL || swir1_data == NULL ||
-            filled_nir_data == NULL || filled_swir1_data == NULL)
-        {
-            RETURN_ERROR("Allocating nir and swir1 memory",
-                         FUNC_NAME, FAILURE);
-        }
-
-        int16 nir_max = 0;
-        int16 nir_min = 0;
-        int16 swir1_max = 0;
-        int16 swir1_min = 0;
-        int nir_count = 0;
-        int swir1_count = 0;
-        /* Loop through each line in the image */
-        for (row = 0; row < nrows; row++)
-        {
-            if (verbose)
-            {
-                /* Print status on every 1000 lines */
-                if (!(row % 1000))
-                {
-                    printf("Processing line %d\r", row);
-                    fflush(stdout);
-                }
-            }
-
-            /* For each of the image bands */
-            for (band_index = 0;
-                 band_index < input->num_toa_bands;
-                 band_index++)
-            {
-                /* Read each input reflective band -- data is read into
-                   input->buf[band_index] */
-                if (!GetInputLine(input, band_index, row))
-                {
-                    snprintf(errstr, sizeof(errstr),
-                             "Reading input image data for line %d, band %d",
-                             row, band_index);
-                    RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
-                }
-            }
-
-            for (col = 0; col < ncols; col++)
-            {
-                pixel_index = row * ncols + col;
-
-                if (clear_mask[pixel_index] & CF_CLEAR_FILL_BIT)
-                    continue;
-
-                if (input->satellite != IS_LANDSAT_8)
-                {
-                    /* Landsat 8 doesn't have saturation issues */
-                    if (input->buf[BI_NIR][col]
-                        == input->meta.satu_value_ref[BI_NIR])
-                    {
-                        input->buf[BI_NIR][col] =
-                            input->meta.satu_value_max[BI_NIR];
-                    }
-                    if (input->buf[BI_SWIR_1][col]
-                        == input->meta.satu_value_ref[BI_SWIR_1])
-                    {
-                        input->buf[BI_SWIR_1][col] =
-                            input->meta.satu_value_max[BI_SWIR_1];
-                    }
-                }
-
-                if (clear_mask[pixel_index] & land_bit)
-                {
-                    nir[nir_count] = input->buf[BI_NIR][col];
-                    if (nir[nir_count] > nir_max)
-                        nir_max = nir[nir_count];
-                    if (nir[nir_count] < nir_min)
-                        nir_min = nir[nir_count];
-                    nir_count++;
-
-                    swir1[swir1_count] = input->buf[BI_SWIR_1][col];
-                    if (swir1[swir1_count] > swir1_max)
-                        swir1_max = swir1[swir1_count];
-                    if (swir1[swir1_count] < swir1_min)
-                        swir1_min = swir1[swir1_count];
-                    swir1_count++;
-                }
-            }
-
-            /* NIR */
-            memcpy(&nir_data[row * input->size.s], &input->buf[BI_NIR][0],
-                   input->size.s * sizeof(int16));
-            /* SWIR1 */
-            memcpy(&swir1_data[row * input->size.s],
-                   &input->buf[BI_SWIR_1][0], input->size.s * sizeof(int16));
-        }
-        printf("\n");
-
-        /* Estimating background (land) Band NIR Ref */
-        status = prctile(nir, nir_count, nir_min, nir_max,
-                         100.0 * l_pt, &nir_boundary);
-        if (status != SUCCESS)
-        {
-            RETURN_ERROR("Calling prctile function", FUNC_NAME, FAILURE);
         }
-        status = prctile(swir1, swir1_count, swir1_min, swir1_max,
-                         100.0 * l_pt, &swir1_boundary);
-        if (status != SUCCESS)
-        {
-            RETURN_ERROR("Calling prctile function", FUNC_NAME, FAILURE);
-        }
-
-        /* Release the memory */
-        free(nir);
-        free(swir1);
-        nir = NULL;
-        swir1 = NULL;
 
-        /* Call the fill minima routine to do image fill */
-/* Perform them in parallel if threading is enabled */
+        /* Apply the probability thresholds to the pixels the thermal test
+           left undecided, then refine the water mask with the final cloud
+           mask */
 #ifdef _OPENMP
-#pragma omp parallel sections
+        #pragma omp parallel for schedule(static)
 #endif
-{
-    {
-        if (fill_local_minima_in_image("NIR Band", nir_data,
-                                       input->size.l, input->size.s,
-                                       nir_boundary, filled_nir_data)
-            != SUCCESS)
+        for (pixel_index = 0; pixel_index < pixel_count; pixel_index++)
         {
-            printf("Error Running fill_local_minima_in_image on NIR band");
-            status = ERROR;
-        }
-    }
+            int index;  /* percentile index of the pixel's threshold */
+            int high;   /* smallest index failing the high test */
+            int med;    /* smallest index failing the medium test */
 
-#ifdef _OPENMP
-    #pragma omp section
-#endif
-    {
-        if (fill_local_minima_in_image("SWIR1 Band", swir1_data,
-                                       input->size.l, input->size.s,
-                                       swir1_boundary, filled_swir1_data)
-            != SUCCESS)
-        {
-            printf("Error Running fill_local_minima_in_image on SWIR1 band");
-            status = ERROR;
-        }
-    }
-}
+            if (pixel_mask[pixel_index] & CF_FILL_BIT)
+                continue;
 
-        /* Release the memory */
-        free(nir_data);
-        free(swir1_data);
-        nir_data = NULL;
-        swir1_data = NULL;
+            /* Done from the outside lists below */
+            if (prob_code[pixel_index] == PROB_CODE_OUTSIDE)
+                continue;
 
-        if (status == ERROR)
-        {
-            free(filled_nir_data);
-            free(filled_swir1_data);
-            RETURN_ERROR("Running fill_local_minima_in_image",
-                         FUNC_NAME, FAILURE);
-        }
+            if (pixel_mask[pixel_index] & CF_WATER_BIT)
+                index = wclr_index;
+            else
+                index = clr_index;
 
-        if (verbose)
-        {
-            printf("The sixth pass\n");
+            high = (prob_code[pixel_index] >> 2) + PROB_CODE_MIN_INDEX;
+            med = high + 9 + (prob_code[pixel_index] & 3);
+
+            set_prob_confidence(pixel_mask, conf_mask, pixel_index,
+                                index < high, index < med);
         }
 
-        int16 new_nir;
-        int16 new_swir1;
-        for (row = 0; row < nrows; row++)
+        /* The probabilities the codes couldn't hold are compared as they
+           are */
+        for (i = 0; i < nshards; i++)
         {
-            if (verbose)
-            {
-                /* Print status on every 1000 lines */
-                if (!(row % 1000))
-                {
-                    printf("Processing line %d\r", row);
-                    fflush(stdout);
-                }
-            }
-
-            /* For each of the image bands */
-            for (band_index = 0;
-                 band_index < input->num_toa_bands;
-                 band_index++)
-            {
-                /* Read each input reflective band -- data is read into
-                   input->buf[band_index] */
-                if (!GetInputLine(input, band_index, row))
-                {
-                    snprintf(errstr, sizeof(errstr),
-                             "Reading input image data for line %d, band %d",
-                             row, band_index);
-                    RETURN_ERROR(errstr, FUNC_NAME, FAILURE);
-                }
-            }
+            int j;
 
-            for (col = 0; col < ncols; col++)
+            for (j = 0; j < shards[i].outside_count; j++)
             {
-                pixel_index = row * ncols + col;
-
-                if (input->satellite != IS_LANDSAT_8)
-                {
-                    /* Landsat 8 doesn't have saturation issues */
-                    if (input->buf[BI_NIR][col]
-                        == input->meta.satu_value_ref[BI_NIR])
-                    {
-                        input->buf[BI_NIR][col] =
-                            input->meta.satu_value_max[BI_NIR];
-                    }
-                    if (input->buf[BI_SWIR_1][col]
-                        == input->meta.satu_value_ref[BI_SWIR_1])
-                    {
-                        input->buf[BI_SWIR_1][col] =
-                            input->meta.satu_value_max[BI_SWIR_1];
-                    }
-                }
-
-                if (pixel_mask[pixel_index] & CF_FILL_BIT)
-                {
-                    conf_mask[pixel_index] = CF_FILL_PIXEL;
-                    continue;
-                }
-
-                new_nir = filled_nir_data[pixel_index] -
-                          input->buf[BI_NIR][col];
-                new_swir1 = filled_swir1_data[pixel_index] -
-                            input->buf[BI_SWIR_1][col];
-
-                if (new_nir < new_swir1)
-                    shadow_prob = new_nir;
-                else
-                    shadow_prob = new_swir1;
-
-                if (shadow_prob > 200)
-                    pixel_mask[pixel_index] |= CF_SHADOW_BIT;
+                pixel_index = shards[i].outside_index[j];
+                if (pixel_mask[pixel_index] & CF_WATER_BIT)
+                    prob_threshold = wclr_mask;
                 else
-                    pixel_mask[pixel_index] &= ~CF_SHADOW_BIT;
+                    prob_threshold = clr_mask;
 
-                /* refine Water mask (no confusion water/cloud) */
-                if ((pixel_mask[pixel_index] & CF_WATER_BIT) &&
-                    (pixel_mask[pixel_index] & CF_CLOUD_BIT))
-                {
-                    pixel_mask[pixel_index] &= ~CF_WATER_BIT;
-                }
+                set_prob_confidence(pixel_mask, conf_mask, pixel_index,
+                                    shards[i].outside_prob[j]
+                                    > prob_threshold,
+                                    shards[i].outside_prob[j]
+                                    > prob_threshold - 10.0);
             }
         }
-        printf("\n");
+        free_shards(shards, nshards);
+        shards = NULL;
 
-        /* Release the memory */
-        free(filled_nir_data);
-        filled_nir_data = NULL;
-        free(filled_swir1_data);
-        filled_swir1_data = NULL;
+        /* Free the memory */
+        free(prob_code);
+        prob_code = NULL;
     }
 
     free(clear_mask);
@@ -15,6 +15,14 @@ int potential_cloud_shadow_snow_mask
                                       be used */
     bool use_thermal,           /* I: value to indicate if Thermal data should
                                       be used */
+    int fill_engine,            /* I: FILL_ENGINE_* used to fill the NIR and
+                                      SWIR1 bands */
+    int fill_scale,             /* I: block size the NIR and SWIR1 bands are
+                                      reduced by for an approximate fill; 1
+                                      for the exact fill */
+    bool fill_compare,          /* I: value to indicate if the approximate
+                                      fill should be compared to the exact
+                                      fill */
     bool verbose                /* I: value to indicate if intermediate
                                       messages should be printed */
 );
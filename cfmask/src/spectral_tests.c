@@ -0,0 +1,575 @@
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+
+#include "espa_geoloc.h"
+
+
+#include "const.h"
+#include "cfmask.h"
+#include "input.h"
+#include "spectral_tests.h"
+
+
+/* The vector versions rely on the GCC vector extensions and the x86
+   runtime CPU checks; everything else uses the per sample tests only.
+   Defining CFMASK_SCALAR also forces the per sample tests. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+    && !defined(CFMASK_SCALAR)
+    #define SPECTRAL_TESTS_VECTOR
+#endif
+
+
+bool is_fill_data
+(
+    int16 **buf,     /* I: current line of each band */
+    int column,      /* I: column in the input data array */
+    bool use_cirrus, /* I: use the cirrus data or not */
+    bool use_thermal /* I: use the thermal data or not */
+)
+{
+    if (buf[BI_BLUE][column] == FILL_PIXEL
+        || buf[BI_GREEN][column] == FILL_PIXEL
+        || buf[BI_RED][column] == FILL_PIXEL
+        || buf[BI_NIR][column] == FILL_PIXEL
+        || buf[BI_SWIR_1][column] == FILL_PIXEL
+        || buf[BI_SWIR_2][column] == FILL_PIXEL)
+    {
+        return true;
+    }
+
+    if (use_cirrus)
+    {
+        if (buf[BI_CIRRUS][column] == FILL_PIXEL)
+            return true;
+    }
+
+    if (use_thermal)
+    {
+        if (buf[BI_THERMAL][column] <= FILL_PIXEL)
+            return true;
+    }
+
+    return false;
+}
+
+
+bool basic_cloud_test
+(
+    int16 **buf,     /* I: current line of each band */
+    int column,      /* I: column in the input data array */
+    float ndvi,      /* I: NDVI value */
+    float ndsi,      /* I: NDSI value */
+    bool use_thermal /* I: use the thermal data or not */
+)
+{
+    bool result = false;
+
+    if (ndsi < 0.8 && ndvi < 0.8 && (buf[BI_SWIR_2][column] > 300))
+    {
+        result = true;
+    }
+
+    /* If we are using thermal, then the original test was and'ing the thermal
+       test */
+    if (result && use_thermal)
+    {
+        if (buf[BI_THERMAL][column] < 2700)
+        {
+            result = true;
+        }
+        else
+        {
+            result = false;
+        }
+    }
+
+    return result;
+}
+
+
+bool basic_snow_test
+(
+    int16 **buf,     /* I: current line of each band */
+    int column,      /* I: column in the input data array */
+    float ndsi,      /* I: NDSI value */
+    bool use_thermal /* I: use the thermal data or not */
+)
+{
+    bool result = false;
+
+    if (ndsi > 0.15
+        && buf[BI_NIR][column] > 1100
+        && buf[BI_GREEN][column] > 1000)
+    {
+        result = true;
+    }
+
+    /* If we are using thermal, then the original test was and'ing the thermal
+       test */
+    if (result && use_thermal)
+    {
+        if (buf[BI_THERMAL][column] < 1000)
+        {
+            result = true;
+        }
+        else
+        {
+            result = false;
+        }
+    }
+
+    return result;
+}
+
+
+bool zhe_water_test
+(
+    int16 **buf,     /* I: current line of each band */
+    int column,      /* I: column in the input data array */
+    float ndvi       /* I: NDVI value */
+)
+{
+    if ((ndvi < 0.01 && buf[BI_NIR][column] < 1100)
+        || (ndvi < 0.1 && ndvi > 0.0 && buf[BI_NIR][column] < 500))
+    {
+        return true;
+    }
+
+    return false;
+}
+
+
+/*****************************************************************************
+MODULE:  spectral_tests_sample
+
+PURPOSE: Run the spectral tests on one sample of the current line
+
+RETURN: CF_FILL_BIT for fill samples, otherwise the cloud, snow, and water
+        bits found by the tests
+*****************************************************************************/
+static unsigned char spectral_tests_sample
+(
+    Input_t *input,  /* I: input structure */
+    int16 **buf,     /* I: current line of each band */
+    int col,         /* I: column in the input data array */
+    bool use_cirrus, /* I: use the cirrus data or not */
+    bool use_thermal /* I: use the thermal data or not */
+)
+{
+    unsigned char mask = CF_NO_BITS; /* bits found for the sample */
+    float ndvi, ndsi;           /* NDVI and NDSI values */
+    float visi_mean;            /* mean of visible bands */
+    float whiteness = 0.0;      /* whiteness value */
+    float hot;                  /* hot value for hot test */
+    int satu_bv;                /* sum of saturated bands 1, 2, 3 value */
+
+    /* process non-fill pixels only */
+    if (is_fill_data(buf, col, use_cirrus, use_thermal))
+        return CF_FILL_BIT;
+
+    if ((buf[BI_RED][col] + buf[BI_NIR][col]) != 0)
+    {
+        ndvi = (float)(buf[BI_NIR][col]
+                       - buf[BI_RED][col])
+               / (float)(buf[BI_NIR][col]
+                         + buf[BI_RED][col]);
+    }
+    else
+        ndvi = 0.01;
+
+    if ((buf[BI_GREEN][col] + buf[BI_SWIR_1][col]) != 0)
+    {
+        ndsi = (float)(buf[BI_GREEN][col]
+                       - buf[BI_SWIR_1][col])
+               / (float)(buf[BI_GREEN][col]
+                         + buf[BI_SWIR_1][col]);
+    }
+    else
+        ndsi = 0.01;
+
+    /* Basic cloud test, equation 1 */
+    if (basic_cloud_test(buf, col, ndvi, ndsi, use_thermal))
+        mask |= CF_CLOUD_BIT;
+
+    /* It takes every snow pixel including snow pixels under thin
+       or icy clouds, equation 20 */
+    if (basic_snow_test(buf, col, ndsi, use_thermal))
+        mask |= CF_SNOW_BIT;
+
+    /* Zhe's water test (works over thin cloud), equation 5 */
+    if (zhe_water_test(buf, col, ndvi))
+        mask |= CF_WATER_BIT;
+
+    /* visible bands flatness (sum(abs)/mean < 0.6 => bright and dark
+       cloud), equation 2 */
+    if (mask & CF_CLOUD_BIT)
+    {
+        visi_mean = (float)(buf[BI_BLUE][col]
+                            + buf[BI_GREEN][col]
+                            + buf[BI_RED][col]) / 3.0;
+        if (visi_mean != 0)
+        {
+            whiteness =
+                ((fabs ((float)buf[BI_BLUE][col] - visi_mean)
+                  + fabs ((float)buf[BI_GREEN][col] - visi_mean)
+                  + fabs ((float)buf[BI_RED][col]
+                          - visi_mean))) / visi_mean;
+        }
+        else
+        {
+            /* Just put a large value to remove them from cloud pixel
+               identification */
+            whiteness = 100.0;
+        }
+    }
+
+    satu_bv = 0;
+    if (input->satellite != IS_LANDSAT_8)
+    {
+        /* Landsat 8 doesn't have saturation issues */
+        /* Update cloud_mask,  if one visible band is saturated,
+           whiteness = 0, due to data type conversion, pixel value
+           difference of 1 is possible */
+        if ((buf[BI_BLUE][col]
+             >= (input->meta.satu_value_max[BI_BLUE] - 1))
+            ||
+            (buf[BI_GREEN][col]
+             >= (input->meta.satu_value_max[BI_GREEN] - 1))
+            ||
+            (buf[BI_RED][col]
+             >= (input->meta.satu_value_max[BI_RED] - 1)))
+        {
+            whiteness = 0.0;
+            satu_bv = 1;
+        }
+    }
+
+    if ((mask & CF_CLOUD_BIT) && whiteness >= 0.7)
+        mask &= ~CF_CLOUD_BIT;
+
+    /* Haze test, equation 3 */
+    hot = (float)buf[BI_BLUE][col]
+          - 0.5 * (float)buf[BI_RED][col]
+          - 800.0;
+    if (!(hot > 0.0 || satu_bv == 1))
+        mask &= ~CF_CLOUD_BIT;
+
+    /* Ratio 4/5 > 0.75 test, equation 4 */
+    if ((mask & CF_CLOUD_BIT) && buf[BI_SWIR_1][col] != 0)
+    {
+        if (!((float)buf[BI_NIR][col] /
+              (float)buf[BI_SWIR_1][col] > 0.75))
+            mask &= ~CF_CLOUD_BIT;
+    }
+    else
+        mask &= ~CF_CLOUD_BIT;
+
+    /* Cirrus cloud test */
+    if (use_cirrus)
+    {
+        if ((float)(buf[BI_CIRRUS][col] / 400.0 - 0.25) > 0.0)
+            mask |= CF_CLOUD_BIT;
+    }
+
+    return mask;
+}
+
+
+#ifdef SPECTRAL_TESTS_VECTOR
+
+/* Number of samples tested together */
+#define VECTOR_SAMPLES 16
+
+typedef int16 v16hi __attribute__ ((vector_size (VECTOR_SAMPLES * 2)));
+typedef unsigned char v16qu __attribute__ ((vector_size (VECTOR_SAMPLES)));
+typedef int v16si __attribute__ ((vector_size (VECTOR_SAMPLES * 4)));
+typedef float v16sf __attribute__ ((vector_size (VECTOR_SAMPLES * 4)));
+typedef long long v16di __attribute__ ((vector_size (VECTOR_SAMPLES * 8)));
+typedef double v16df __attribute__ ((vector_size (VECTOR_SAMPLES * 8)));
+
+/* Pick a where the mask is set and b elsewhere, the mask being the result
+   of a comparison */
+#define SELECT(vtype, itype, mask, a, b) \
+    ((vtype)(((itype)(a) & (mask)) | ((itype)(b) & ~(mask))))
+
+/* Thresholds of the tests.  The scalar tests compare the float values with
+   double constants, which is the same as comparing with the nearest float
+   on the side of the constant that keeps the result. */
+typedef struct
+{
+    float ndx_cloud;   /* NDVI and NDSI are below 0.8 for clouds */
+    float ndsi_snow;   /* NDSI is above 0.15 for snow */
+    float ndvi_water;  /* NDVI is below 0.01 for water */
+    float ndvi_water2; /* NDVI is below 0.1 for shallow water */
+    float whiteness;   /* whiteness is below 0.7 for clouds */
+    int satu_blue;     /* saturation values of the visible bands, less 1 */
+    int satu_green;
+    int satu_red;
+} Spectral_limits_t;
+
+
+/* Smallest float that is not below the value */
+static float float_not_below
+(
+    double value /* I: value */
+)
+{
+    float result = (float)value;
+
+    if (result < value)
+        result = nextafterf(result, INFINITY);
+    return result;
+}
+
+
+/* Largest float that is not above the value */
+static float float_not_above
+(
+    double value /* I: value */
+)
+{
+    float result = (float)value;
+
+    if (result > value)
+        result = nextafterf(result, -INFINITY);
+    return result;
+}
+
+
+/*****************************************************************************
+MODULE:  spectral_tests_vector
+
+PURPOSE: Run the spectral tests on VECTOR_SAMPLES samples of the current
+         line at once, giving the same bits as spectral_tests_sample
+
+RETURN: None
+
+NOTES:
+1. Always inlined into the versions built for each instruction set.
+2. The whiteness is calculated in double precision like the scalar code,
+   whose fabs promotes the differences to double.
+*****************************************************************************/
+static inline __attribute__ ((always_inline)) void spectral_tests_vector
+(
+    Input_t *input,                   /* I: input structure */
+    int16 **buf,                      /* I: current line of each band */
+    int col,                          /* I: first column to test */
+    const Spectral_limits_t *limits,  /* I: thresholds of the tests */
+    bool use_cirrus,                  /* I: use the cirrus data or not */
+    bool use_thermal,                 /* I: use the thermal data or not */
+    unsigned char *line_mask          /* O: bits found for each sample */
+)
+{
+    v16hi load;
+    v16si blue, green, red, nir, swir1, swir2, cirrus, thermal;
+    v16si fill, cloud, snow, water, satu, den, zero;
+    v16sf ndvi, ndsi, visi_mean, whiteness;
+    v16df diff_sum, visi_mean2;
+    v16di zero2;
+    const v16di abs_bits = (v16di){} + 0x7fffffffffffffffLL;
+    v16si mask;
+    v16qu bits;
+
+#define LOAD_BAND(band, dest) \
+    memcpy(&load, &buf[band][col], sizeof(load)); \
+    dest = __builtin_convertvector(load, v16si)
+
+    LOAD_BAND(BI_BLUE, blue);
+    LOAD_BAND(BI_GREEN, green);
+    LOAD_BAND(BI_RED, red);
+    LOAD_BAND(BI_NIR, nir);
+    LOAD_BAND(BI_SWIR_1, swir1);
+    LOAD_BAND(BI_SWIR_2, swir2);
+
+    fill = (blue == FILL_PIXEL) | (green == FILL_PIXEL) | (red == FILL_PIXEL)
+           | (nir == FILL_PIXEL) | (swir1 == FILL_PIXEL)
+           | (swir2 == FILL_PIXEL);
+    if (use_cirrus)
+    {
+        LOAD_BAND(BI_CIRRUS, cirrus);
+        fill |= (cirrus == FILL_PIXEL);
+    }
+    if (use_thermal)
+    {
+        LOAD_BAND(BI_THERMAL, thermal);
+        fill |= (thermal <= FILL_PIXEL);
+    }
+
+#undef LOAD_BAND
+
+    /* NDVI and NDSI, dividing by one where the sum is zero */
+    den = nir + red;
+    zero = (den == 0);
+    ndvi = __builtin_convertvector(nir - red, v16sf)
+           / __builtin_convertvector(den | (zero & 1), v16sf);
+    ndvi = SELECT(v16sf, v16si, zero, (v16sf){} + 0.01f, ndvi);
+
+    den = green + swir1;
+    zero = (den == 0);
+    ndsi = __builtin_convertvector(green - swir1, v16sf)
+           / __builtin_convertvector(den | (zero & 1), v16sf);
+    ndsi = SELECT(v16sf, v16si, zero, (v16sf){} + 0.01f, ndsi);
+
+    /* Basic cloud test, equation 1 */
+    cloud = (ndsi < limits->ndx_cloud) & (ndvi < limits->ndx_cloud)
+            & (swir2 > 300);
+
+    /* Basic snow test, equation 20 */
+    snow = (ndsi > limits->ndsi_snow) & (nir > 1100) & (green > 1000);
+
+    if (use_thermal)
+    {
+        cloud &= (thermal < 2700);
+        snow &= (thermal < 1000);
+    }
+
+    /* Zhe's water test, equation 5 */
+    water = ((ndvi < limits->ndvi_water) & (nir < 1100))
+            | ((ndvi < limits->ndvi_water2) & (ndvi > 0.0f) & (nir < 500));
+
+    /* Visible bands flatness, equation 2 */
+    visi_mean = __builtin_convertvector(blue + green + red, v16sf) / 3.0f;
+    visi_mean2 = __builtin_convertvector(visi_mean, v16df);
+    diff_sum = (v16df)((v16di)__builtin_convertvector(
+                   __builtin_convertvector(blue, v16sf) - visi_mean, v16df)
+               & abs_bits)
+             + (v16df)((v16di)__builtin_convertvector(
+                   __builtin_convertvector(green, v16sf) - visi_mean, v16df)
+               & abs_bits);
+    diff_sum += (v16df)((v16di)__builtin_convertvector(
+                    __builtin_convertvector(red, v16sf) - visi_mean, v16df)
+                & abs_bits);
+    zero2 = (visi_mean2 == 0.0);
+    visi_mean2 = SELECT(v16df, v16di, zero2, (v16df){} + 1.0, visi_mean2);
+    whiteness = __builtin_convertvector(diff_sum / visi_mean2, v16sf);
+    whiteness = SELECT(v16sf, v16si, (visi_mean == 0.0f),
+                       (v16sf){} + 100.0f, whiteness);
+
+    /* Saturated visible bands pass the whiteness and haze tests */
+    if (input->satellite != IS_LANDSAT_8)
+    {
+        satu = (blue >= limits->satu_blue) | (green >= limits->satu_green)
+               | (red >= limits->satu_red);
+    }
+    else
+        satu = (v16si){};
+
+    cloud &= satu | (whiteness < limits->whiteness);
+
+    /* Haze test, equation 3, in integers since the haze value is exact */
+    cloud &= satu | (2 * blue - red > 1600);
+
+    /* Ratio 4/5 > 0.75 test, equation 4 */
+    zero = (swir1 == 0);
+    cloud &= ~zero
+             & (__builtin_convertvector(nir, v16sf)
+                / __builtin_convertvector(swir1 | (zero & 1), v16sf)
+                > 0.75f);
+
+    /* Cirrus cloud test, which is true when the value is above 100 */
+    if (use_cirrus)
+        cloud |= (cirrus > 100);
+
+    mask = (cloud & CF_CLOUD_BIT) | (snow & CF_SNOW_BIT)
+           | (water & CF_WATER_BIT);
+    mask = (fill & CF_FILL_BIT) | (~fill & mask);
+    bits = __builtin_convertvector(mask, v16qu);
+    memcpy(&line_mask[col], &bits, sizeof(bits));
+}
+
+
+/* Define a version of the line loop for an instruction set */
+#define SPECTRAL_TESTS_LINE(name, isa) \
+static __attribute__ ((target (isa))) int name \
+( \
+    Input_t *input, \
+    int16 **buf, \
+    const Spectral_limits_t *limits, \
+    bool use_cirrus, \
+    bool use_thermal, \
+    unsigned char *line_mask \
+) \
+{ \
+    int col; \
+    for (col = 0; col + VECTOR_SAMPLES <= input->size.s; \
+         col += VECTOR_SAMPLES) \
+    { \
+        spectral_tests_vector(input, buf, col, limits, use_cirrus, \
+                              use_thermal, line_mask); \
+    } \
+    return col; \
+}
+
+SPECTRAL_TESTS_LINE(spectral_tests_avx512, "avx512f,avx512bw")
+SPECTRAL_TESTS_LINE(spectral_tests_avx2, "avx2")
+SPECTRAL_TESTS_LINE(spectral_tests_sse42, "sse4.2")
+
+#undef SPECTRAL_TESTS_LINE
+
+#endif
+
+
+/*****************************************************************************
+MODULE:  spectral_tests_line
+
+PURPOSE: Run the spectral tests on the current line of each band
+
+RETURN: None
+
+NOTES:
+1. The widest vector version the CPU supports tests as many samples as it
+   can, and the per sample tests do the rest, or the whole line when no
+   vector version can be used.
+*****************************************************************************/
+void spectral_tests_line
+(
+    Input_t *input,          /* I: input structure */
+    int16 **buf,             /* I: current line of each band */
+    bool use_cirrus,         /* I: use the cirrus data or not */
+    bool use_thermal,        /* I: use the thermal data or not */
+    unsigned char *line_mask /* O: CF_FILL_BIT for fill samples, otherwise
+                                   the cloud, snow, and water bits */
+)
+{
+    int col = 0;    /* column index */
+
+#ifdef SPECTRAL_TESTS_VECTOR
+    Spectral_limits_t limits;
+
+    limits.ndx_cloud = float_not_below(0.8);
+    limits.ndsi_snow = float_not_above(0.15);
+    limits.ndvi_water = float_not_below(0.01);
+    limits.ndvi_water2 = float_not_below(0.1);
+    limits.whiteness = float_not_below(0.7);
+    limits.satu_blue = input->meta.satu_value_max[BI_BLUE] - 1;
+    limits.satu_green = input->meta.satu_value_max[BI_GREEN] - 1;
+    limits.satu_red = input->meta.satu_value_max[BI_RED] - 1;
+
+    if (__builtin_cpu_supports("avx512f")
+        && __builtin_cpu_supports("avx512bw"))
+    {
+        col = spectral_tests_avx512(input, buf, &limits, use_cirrus,
+                                    use_thermal, line_mask);
+    }
+    else if (__builtin_cpu_supports("avx2"))
+    {
+        col = spectral_tests_avx2(input, buf, &limits, use_cirrus,
+                                  use_thermal, line_mask);
+    }
+    else if (__builtin_cpu_supports("sse4.2"))
+    {
+        col = spectral_tests_sse42(input, buf, &limits, use_cirrus,
+                                   use_thermal, line_mask);
+    }
+#endif
+
+    for (; col < input->size.s; col++)
+    {
+        line_mask[col] = spectral_tests_sample(input, buf, col, use_cirrus,
+                                               use_thermal);
+    }
+}
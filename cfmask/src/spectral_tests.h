@@ -0,0 +1,20 @@
+#ifndef SPECTRAL_TESTS_H
+#define SPECTRAL_TESTS_H
+
+#include <stdbool.h>
+
+#include "input.h"
+
+
+void spectral_tests_line
+(
+    Input_t *input,          /* I: input structure */
+    int16 **buf,             /* I: current line of each band */
+    bool use_cirrus,         /* I: use the cirrus data or not */
+    bool use_thermal,        /* I: use the thermal data or not */
+    unsigned char *line_mask /* O: CF_FILL_BIT for fill samples, otherwise
+                                   the cloud, snow, and water bits */
+);
+
+
+#endif